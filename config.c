@@ -40,7 +40,7 @@
 #include <stdlib.h>
 #include <time.h>
 
-#include <varnish/varnishapi.h>
+#include "vkvsl.h"
 #include <librdkafka/rdkafka.h>
 
 #include "varnishkafka.h"
@@ -52,6 +52,13 @@
 struct conf conf;
 
 
+/**
+ * Set while the configuration file is re-read on reload (SIGUSR2):
+ * only the properties listed in conf_reloadable() are applied.
+ */
+static int conf_reloading = 0;
+
+
 /**
  * Parses the value as true or false.
  */
@@ -77,11 +84,54 @@ static fmt_enc_t encoding_parse (const char *val) {
 		return VK_ENC_STRING;
 	else if (!strcasecmp(val, "json"))
 		return VK_ENC_JSON;
+	else if (!strcasecmp(val, "msgpack"))
+		return VK_ENC_MSGPACK;
+	else if (!strcasecmp(val, "avro"))
+		return VK_ENC_AVRO;
+	else if (!strcasecmp(val, "protobuf"))
+		return VK_ENC_PROTOBUF;
 	else
 		return -1;
 }
 
 
+/**
+ * Append selector value rule "<value> = <target>" to list 'listp'.
+ * A trailing '*' in 'value' makes it a prefix rule.
+ */
+static void rule_add (struct vk_route **listp, int *cntp,
+		      const char *value, const char *target) {
+	struct vk_route *route, **rp;
+
+	route = calloc(1, sizeof(*route));
+	route->value = strdup(value);
+	route->len = strlen(value);
+	if (route->len > 0 && route->value[route->len-1] == '*') {
+		route->prefix = 1;
+		route->value[--route->len] = '\0';
+	}
+	route->target = strdup(target);
+
+	/* Keep configuration order */
+	for (rp = listp ; *rp ; rp = &(*rp)->next)
+		;
+	*rp = route;
+	(*cntp)++;
+}
+
+
+/**
+ * Returns true if property 'name' can be changed by a configuration
+ * reload: the formats and the selector rules, i.e. everything that
+ * makes up a format generation.
+ */
+static int conf_reloadable (const char *name) {
+	return !strncmp(name, "format", strlen("format")) ||
+		!strncmp(name, "topic.route", strlen("topic.route")) ||
+		!strncmp(name, "priority", strlen("priority"));
+}
+
+
 /**
  * Set a single configuration property 'name' using value 'val'.
  * Returns 0 on success, and -1 on error in which case 'errstr' will
@@ -91,6 +141,9 @@ static int conf_set (const char *name, const char *val,
 		     char *errstr, size_t errstr_size) {
 	rd_kafka_conf_res_t res;
 
+	/* Other properties require a restart and are ignored on reload. */
+	if (conf_reloading && !conf_reloadable(name))
+		return 0;
 
 	/* Kafka configuration */
 	if (!strncmp(name, "kafka.", strlen("kafka."))) {
@@ -106,8 +159,15 @@ static int conf_set (const char *name, const char *val,
 			res = rd_kafka_conf_set(conf.rk_conf, name,
 						val, errstr, errstr_size);
 
-		if (res == RD_KAFKA_CONF_OK)
+		if (res == RD_KAFKA_CONF_OK) {
+			/* Needed for priority lane limits */
+			if (!strcmp(name, "queue.buffering.max.messages"))
+				conf.kafka_queue_max = atoi(val);
+			/* Needed to size the in-flight accounting */
+			else if (!strcmp(name, "topic.message.timeout.ms"))
+				conf.kafka_msg_timeout_ms = atoi(val);
 			return 0;
+		}
 		else if (res != RD_KAFKA_CONF_UNKNOWN)
 			return -1;
 		
@@ -127,7 +187,72 @@ static int conf_set (const char *name, const char *val,
 		conf.topic = strdup(val);
 	else if (!strcmp(name, "kafka.partition"))
 		conf.partition = atoi(val);
-	else if (!strcmp(name, "format"))
+	else if (!strcmp(name, "kafka.producers")) {
+		conf.producers = atoi(val);
+		if (conf.producers < 1 || conf.producers > 64) {
+			snprintf(errstr, errstr_size,
+				 "kafka.producers must be 1..64");
+			return -1;
+		}
+	} else if (!strcmp(name, "kafka.partitioner")) {
+		if (!strcmp(val, "random"))
+			conf.partitioner = VK_PART_RANDOM;
+		else if (!strcmp(val, "sticky"))
+			conf.partitioner = VK_PART_STICKY;
+		else if (!strcmp(val, "roundrobin"))
+			conf.partitioner = VK_PART_ROUNDROBIN;
+		else if (!strcmp(val, "hash"))
+			conf.partitioner = VK_PART_HASH;
+		else {
+			snprintf(errstr, errstr_size,
+				 "Unknown kafka.partitioner \"%s\": "
+				 "try \"random\", \"sticky\", "
+				 "\"roundrobin\" or \"hash\"", val);
+			return -1;
+		}
+	} else if (!strcmp(name, "kafka.partitioner.batch.messages"))
+		conf.part_batch_msgs = atoi(val);
+	else if (!strcmp(name, "kafka.partitioner.batch.ms"))
+		conf.part_batch_ms = atoi(val);
+	else if (!strcmp(name, "message.batch.records"))
+		conf.batch_records = atoi(val);
+	else if (!strcmp(name, "message.batch.bytes"))
+		conf.batch_bytes = atoi(val);
+	else if (!strcmp(name, "message.batch.age.ms"))
+		conf.batch_age_ms = atoi(val);
+	else if (!strcmp(name, "message.batch.key")) {
+		if (!strcmp(val, "split"))
+			conf.batch_key = VK_BATCH_KEY_SPLIT;
+		else if (!strcmp(val, "first"))
+			conf.batch_key = VK_BATCH_KEY_FIRST;
+		else if (!strcmp(val, "none"))
+			conf.batch_key = VK_BATCH_KEY_NONE;
+		else {
+			snprintf(errstr, errstr_size,
+				 "Unknown message.batch.key \"%s\": "
+				 "try \"split\", \"first\" or \"none\"",
+				 val);
+			return -1;
+		}
+	} else if (!strcmp(name, "topic.route"))
+		conf.format[FMT_CONF_ROUTE] = strdup(val);
+	else if (!strncmp(name, "topic.route.", strlen("topic.route.")))
+		rule_add(&conf.routes, &conf.route_cnt,
+			 name + strlen("topic.route."), val);
+	else if (!strcmp(name, "priority"))
+		conf.format[FMT_CONF_PRIO] = strdup(val);
+	else if (!strncmp(name, "priority.match.", strlen("priority.match.")))
+		rule_add(&conf.prio_rules, &conf.prio_rule_cnt,
+			 name + strlen("priority.match."), val);
+	else if (!strcmp(name, "priority.high.reserve")) {
+		conf.prio_high_reserve = atoi(val);
+		if (conf.prio_high_reserve < 0 ||
+		    conf.prio_high_reserve > 100) {
+			snprintf(errstr, errstr_size,
+				 "priority.high.reserve must be 0..100");
+			return -1;
+		}
+	} else if (!strcmp(name, "format"))
 		conf.format[FMT_CONF_MAIN] = strdup(val);
 	else if (!strcmp(name, "format.type")) {
 		if ((conf.fconf[FMT_CONF_MAIN].encoding =
@@ -136,6 +261,14 @@ static int conf_set (const char *name, const char *val,
 				 "Unknown format.type value \"%s\"", val);
 			return -1;
 		}
+	} else if (!strcmp(name, "format.avro.fingerprint"))
+		conf.avro_fingerprint = conf_tof(val);
+	else if (!strcmp(name, "format.avro.schema.file")) {
+		free(conf.avro_schema_file);
+		conf.avro_schema_file = strdup(val);
+	} else if (!strcmp(name, "format.protobuf.proto.file")) {
+		free(conf.proto_file);
+		conf.proto_file = strdup(val);
 	} else if (!strcmp(name, "format.key"))
 		conf.format[FMT_CONF_KEY] = strdup(val);
 	else if (!strcmp(name, "format.key.type")) {
@@ -164,12 +297,20 @@ static int conf_set (const char *name, const char *val,
 	else if (!strcmp(name, "log.statistics.file")) {
 		free(conf.stats_file);
 		conf.stats_file = strdup(val);
+	} else if (!strcmp(name, "log.statistics.shm")) {
+		free(conf.stats_shm_path);
+		conf.stats_shm_path = strdup(val);
+	} else if (!strcmp(name, "metrics.listen")) {
+		free(conf.metrics_listen);
+		conf.metrics_listen = strdup(val);
 	} else if (!strcmp(name, "log.statistics.interval"))
 		conf.stats_interval = atoi(val);
 	else if (!strcmp(name, "log.rate.max"))
 		conf.log_rate = atoi(val);
 	else if (!strcmp(name, "log.rate.period"))
 		conf.log_rate_period = atoi(val);
+	else if (!strcmp(name, "log.queue.size"))
+		conf.log_queue_size = atoi(val);
 	else if (!strcmp(name, "daemonize"))
 		conf.daemonize = conf_tof(val);
 	else if (!strcmp(name, "sequence.number")) {
@@ -190,6 +331,98 @@ static int conf_set (const char *name, const char *val,
 				 "try \"stdout\" or \"kafka\"", val);
 			return -1;
 		}
+	} else if (!strcmp(name, "passthrough")) {
+		if (!strcmp(val, "none") || !strcmp(val, "false"))
+			conf.passthrough = VK_PASSTHRU_NONE;
+		else if (!strcmp(val, "format"))
+			conf.passthrough = VK_PASSTHRU_FORMAT;
+		else if (!strcmp(val, "all"))
+			conf.passthrough = VK_PASSTHRU_ALL;
+		else {
+			snprintf(errstr, errstr_size,
+				 "Unknown passthrough mode \"%s\": "
+				 "try \"none\", \"format\" or \"all\"",
+				 val);
+			return -1;
+		}
+	} else if (!strcmp(name, "shard.count")) {
+		conf.shard_cnt = atoi(val);
+		if (conf.shard_cnt < 1) {
+			snprintf(errstr, errstr_size,
+				 "shard.count must be >= 1");
+			return -1;
+		}
+	} else if (!strcmp(name, "shard.index"))
+		conf.shard_idx = atoi(val);
+	else if (!strcmp(name, "varnish.tag.pushdown"))
+		conf.tag_pushdown = conf_tof(val);
+	else if (!strcmp(name, "join.backend"))
+		conf.join_backend = conf_tof(val);
+	else if (!strcmp(name, "join.table.size")) {
+		conf.join_size = atoi(val);
+		if (conf.join_size < 1) {
+			snprintf(errstr, errstr_size,
+				 "join.table.size must be > 0");
+			return -1;
+		}
+	} else if (!strcmp(name, "reload.timeout.ms")) {
+		conf.reload_timeout_ms = atoi(val);
+		if (conf.reload_timeout_ms < 1) {
+			snprintf(errstr, errstr_size,
+				 "reload.timeout.ms must be > 0");
+			return -1;
+		}
+	} else if (!strcmp(name, "join.timeout.ms")) {
+		conf.join_timeout_ms = atoi(val);
+		if (conf.join_timeout_ms < 1) {
+			snprintf(errstr, errstr_size,
+				 "join.timeout.ms must be > 0");
+			return -1;
+		}
+	} else if (!strcmp(name, "capture.ttfb.ms"))
+		conf.capture_ttfb_ms = atoi(val);
+	else if (!strcmp(name, "capture.status.min"))
+		conf.capture_status = atoi(val);
+	else if (!strcmp(name, "capture.records.max")) {
+		conf.capture_max = atoi(val);
+		if (conf.capture_max < 1) {
+			snprintf(errstr, errstr_size,
+				 "capture.records.max must be > 0");
+			return -1;
+		}
+	} else if (!strcmp(name, "capture.topic")) {
+		free(conf.capture_topic);
+		conf.capture_topic = strdup(val);
+	} else if (!strcmp(name, "capture.file")) {
+		free(conf.capture_file);
+		conf.capture_file = strdup(val);
+	} else if (!strcmp(name, "capture.file.size")) {
+		conf.capture_file_size = (size_t)strtoull(val, NULL, 10);
+		if (conf.capture_file_size < 65536) {
+			snprintf(errstr, errstr_size,
+				 "capture.file.size must be >= 65536");
+			return -1;
+		}
+	} else if (!strcmp(name, "cpu.affinity.reader"))
+		conf.cpus_reader = strdup(val);
+	else if (!strcmp(name, "cpu.affinity.kafka"))
+		conf.cpus_kafka = strdup(val);
+	else if (!strcmp(name, "cpu.budget"))
+		conf.cpu_budget = atoi(val);
+	else if (!strcmp(name, "cpu.governor.interval.ms")) {
+		conf.cpu_interval_ms = atoi(val);
+		if (conf.cpu_interval_ms < 10) {
+			snprintf(errstr, errstr_size,
+				 "cpu.governor.interval.ms must be >= 10");
+			return -1;
+		}
+	} else if (!strcmp(name, "cpu.governor.sample.max")) {
+		conf.sample_rate_max = atoi(val);
+		if (conf.sample_rate_max < 1) {
+			snprintf(errstr, errstr_size,
+				 "cpu.governor.sample.max must be >= 1");
+			return -1;
+		}
 	} else if (!strcmp(name, "logline.data.copy"))
 		conf.datacopy = conf_tof(val);
 	else if (!strcmp(name, "logline.hash.size"))
@@ -198,6 +431,12 @@ static int conf_set (const char *name, const char *val,
 		conf.loglines_hmax = atoi(val);
 	else if (!strcmp(name, "logline.scratch.size"))
 		conf.scratch_size = atoi(val);
+	else if (!strcmp(name, "logline.scratch.adaptive"))
+		conf.scratch_adaptive = conf_tof(val);
+	else if (!strcmp(name, "logline.scratch.max"))
+		conf.scratch_max = atoi(val);
+	else if (!strcmp(name, "logline.scratch.headroom"))
+		conf.scratch_headroom = atoi(val);
 	else if (!strncmp(name, "varnish.arg.", strlen("varnish.arg."))) {
 		const char *t = name + strlen("varnish.arg.");
 		int r = 0;
@@ -205,7 +444,7 @@ static int conf_set (const char *name, const char *val,
 			t++;
 
 		/* Pass arbitrary arguments to standard varnish arg parser */
-		if ((r = VSL_Arg(vd, *t, strdup(val))) == -1) {
+		if ((r = vsl_arg(*t, val)) == -1) {
 			snprintf(errstr, errstr_size,
 				 "Error setting \"%s\" to \"%s\"",
 				 name, val);
@@ -223,6 +462,12 @@ static int conf_set (const char *name, const char *val,
 		case 'm':
 			conf.m_flag = 1;
 			break;
+		case 'i':
+		case 'x':
+		case 'I':
+		case 'X':
+			conf.ix_flag = 1;
+			break;
 		}
 
 	} else {
@@ -259,17 +504,20 @@ static int trim (char **sp, char *end) {
 
 /**
  * Read and parse the supplied configuration file.
- * Returns 0 on success or -1 on failure.
+ * Returns 0 on success or -1 on failure in which case 'errstr'
+ * will contain an error string.
  */
-int conf_file_read (const char *path) {
+static int conf_file_parse (const char *path,
+			    char *errstr, size_t errstr_size) {
 	FILE *fp;
 	char buf[512];
-	char errstr[512];
+	char tmp[512];
 	int line = 0;
 
 	if (!(fp = fopen(path, "r"))) {
-		fprintf(stderr, "Failed to open configuration file %s: %s\n",
-			path, strerror(errno));
+		snprintf(errstr, errstr_size,
+			 "Failed to open configuration file %s: %s",
+			 path, strerror(errno));
 		return -1;
 	}
 
@@ -311,9 +559,9 @@ int conf_file_read (const char *path) {
 		trim(&t, t + strlen(t));
 
 		/* set the configuration vlaue. */
-		if (conf_set(s, *t ? t : NULL, errstr, sizeof(errstr)) == -1) {
-			fprintf(stderr, "%s:%i: error: %s\n",
-				path, line, errstr);
+		if (conf_set(s, *t ? t : NULL, tmp, sizeof(tmp)) == -1) {
+			snprintf(errstr, errstr_size, "%s:%i: error: %s",
+				 path, line, tmp);
 			fclose(fp);
 			return -1;
 		}
@@ -325,4 +573,37 @@ int conf_file_read (const char *path) {
 }
 
 
+/**
+ * Read and parse the supplied configuration file.
+ * Returns 0 on success or -1 on failure.
+ */
+int conf_file_read (const char *path) {
+	char errstr[1024];
+
+	if (conf_file_parse(path, errstr, sizeof(errstr)) == -1) {
+		fprintf(stderr, "%s\n", errstr);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Re-read the configuration file on reload, applying only the
+ * reloadable properties (see conf_reloadable()).
+ * Returns 0 on success or -1 on failure in which case 'errstr'
+ * will contain an error string.
+ */
+int conf_file_reload (const char *path, char *errstr, size_t errstr_size) {
+	int r;
+
+	conf_reloading = 1;
+	r = conf_file_parse(path, errstr, errstr_size);
+	conf_reloading = 0;
+
+	return r;
+}
+
+
 
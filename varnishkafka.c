@@ -45,8 +45,15 @@
 #include <sys/queue.h>
 #include <syslog.h>
 #include <netdb.h>
-
-#include <varnish/varnishapi.h>
+#include <math.h>
+#include <zlib.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "vkvsl.h"
 #include <librdkafka/rdkafka.h>
 
 #include <yajl/yajl_common.h>
@@ -55,22 +62,127 @@
 
 #include "varnishkafka.h"
 #include "base64.h"
+#include "vkshm.h"
+#include "vkraw.h"
+
+
+/* Kafka handles, one per producer (kafka.producers) */
+static rd_kafka_t **rks;
+/* Kafka topics, topics[0] is the default topic (kafka.topic).
+ * Topics are never removed and their addresses are stable since
+ * topic instances refer to them from librdkafka's threads. */
+static struct vk_topic **topics;
+static int topic_cnt;
+
+/**
+ * Value map: compiled vk_route rules for O(1) lookup of selector values.
+ */
+#define VALMAP_HSIZE       256
+#define VALMAP_PREFIX_MAX  16   /* Max number of distinct prefix lengths */
+struct valmap {
+	struct vk_route *hash[VALMAP_HSIZE];
+	int prefix_lens[VALMAP_PREFIX_MAX]; /* Descending */
+	int prefix_cnt;
+};
+
+static struct valmap topic_routes;  /* Topic routing, see routes_init() */
+static struct valmap prio_rules;    /* Priority classes, see prio_init() */
 
+/**
+ * Priority lanes, see prio_init()
+ */
+static const char *prio_names[VK_PRIO_NUM] = {
+	[VK_PRIO_NORMAL] = "normal",
+	[VK_PRIO_HIGH]   = "high",
+};
+
+static struct {
+	uint64_t tx;     /* Records produced */
+	uint64_t drop;   /* Records shed or failed to produce */
+} prio_cnt[VK_PRIO_NUM];
 
-/* Kafka handle */
-static rd_kafka_t *rk;
-/* Kafka topic */
-static rd_kafka_topic_t *rkt;
+static int prio_normal_outq_max;  /* Out queue limit for normal priority */
 
+#ifndef VK_VSLQ
 /* Varnish shared memory handle*/
 struct VSM_data *vd;
+#else
+/* Varnish 3 tag names, see vkvsl.h */
+const char *vk_vsl3_tags[256] = {
+	[SLT_Debug] = "Debug",
+	[SLT_Error] = "Error",
+	[SLT_CLI] = "CLI",
+	[SLT_StatSess] = "StatSess",
+	[SLT_ReqEnd] = "ReqEnd",
+	[SLT_SessionOpen] = "SessionOpen",
+	[SLT_SessionClose] = "SessionClose",
+	[SLT_BackendOpen] = "BackendOpen",
+	[SLT_BackendXID] = "BackendXID",
+	[SLT_BackendReuse] = "BackendReuse",
+	[SLT_BackendClose] = "BackendClose",
+	[SLT_HttpGarbage] = "HttpGarbage",
+	[SLT_Backend] = "Backend",
+	[SLT_Length] = "Length",
+	[SLT_FetchError] = "FetchError",
+	[SLT_RxRequest] = "RxRequest",
+	[SLT_RxResponse] = "RxResponse",
+	[SLT_RxStatus] = "RxStatus",
+	[SLT_RxURL] = "RxURL",
+	[SLT_RxProtocol] = "RxProtocol",
+	[SLT_RxHeader] = "RxHeader",
+	[SLT_TxRequest] = "TxRequest",
+	[SLT_TxResponse] = "TxResponse",
+	[SLT_TxStatus] = "TxStatus",
+	[SLT_TxURL] = "TxURL",
+	[SLT_TxProtocol] = "TxProtocol",
+	[SLT_TxHeader] = "TxHeader",
+	[SLT_ObjRequest] = "ObjRequest",
+	[SLT_ObjResponse] = "ObjResponse",
+	[SLT_ObjStatus] = "ObjStatus",
+	[SLT_ObjURL] = "ObjURL",
+	[SLT_ObjProtocol] = "ObjProtocol",
+	[SLT_ObjHeader] = "ObjHeader",
+	[SLT_LostHeader] = "LostHeader",
+	[SLT_TTL] = "TTL",
+	[SLT_Fetch_Body] = "Fetch_Body",
+	[SLT_VCL_acl] = "VCL_acl",
+	[SLT_VCL_call] = "VCL_call",
+	[SLT_VCL_trace] = "VCL_trace",
+	[SLT_VCL_return] = "VCL_return",
+	[SLT_VCL_error] = "VCL_error",
+	[SLT_ReqStart] = "ReqStart",
+	[SLT_Hit] = "Hit",
+	[SLT_HitPass] = "HitPass",
+	[SLT_ExpBan] = "ExpBan",
+	[SLT_ExpKill] = "ExpKill",
+	[SLT_WorkThread] = "WorkThread",
+	[SLT_ESI_xmlerror] = "ESI_xmlerror",
+	[SLT_Hash] = "Hash",
+	[SLT_Backend_health] = "Backend_health",
+	[SLT_VCL_Log] = "VCL_Log",
+	[SLT_Gzip] = "Gzip",
+};
+#endif
+
+/* VSL arguments to apply to additional Varnish instances, see vsl_arg() */
+#define VSL_ARGS_MAX 64
+static struct {
+	int   c;
+	char *arg;
+} vsl_args[VSL_ARGS_MAX];
+static int vsl_arg_cnt;
+
+/* Serializes parse_tag() and Kafka polling with multiple instances */
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
 
 const char *conf_file_path = VARNISHKAFKA_CONF_PATH;
 
 
 static const char *fmt_conf_names[] = {
 	[FMT_CONF_MAIN] = "Main",
-	[FMT_CONF_KEY]  = "Key"
+	[FMT_CONF_KEY]  = "Key",
+	[FMT_CONF_ROUTE] = "Route",
+	[FMT_CONF_PRIO] = "Priority"
 };
 
 /**
@@ -85,6 +197,38 @@ static struct {
 } *loglines;
 
 static int logline_cnt = 0; /* Current number of loglines in memory */
+static int logline_inflight = 0; /* Loglines currently accumulating tags */
+static uint64_t tmpbuf_bytes = 0; /* Memory allocated to tmpbufs */
+
+
+/**
+ * Per-request scratch usage histogram for adaptive scratch pad sizing
+ * (logline.scratch.adaptive).
+ * Entry 'i' counts requests using less than (i+1)*SCRATCH_HIST_GRAN bytes.
+ */
+#define SCRATCH_HIST_GRAN     256
+#define SCRATCH_HIST_SIZE     256     /* Up to 64 KB */
+#define SCRATCH_ADAPT_SAMPLES 100000  /* Requests between adaptions */
+#define SCRATCH_SIZE_MIN      512
+static struct {
+	uint64_t hist[SCRATCH_HIST_SIZE];
+	uint64_t samples;
+} scratch_usage;
+
+
+/**
+ * Size-classed pool of recycled tmpbufs.
+ * Class 'i' holds buffers of TMPBUF_SIZE_MIN << i bytes.
+ */
+#define TMPBUF_SIZE_MIN   512
+#define TMPBUF_CLASSES    8      /* 512 .. 64 KB */
+#define TMPBUF_POOL_MAX   64     /* Max pooled buffers per class */
+static struct {
+	struct tmpbuf *free;
+	int            cnt;
+} tmpbuf_pool[TMPBUF_CLASSES];
+
+static uint64_t tmpbuf_pool_bytes = 0; /* Memory held by the tmpbuf pool */
 
 static void logrotate(void);
 
@@ -99,1727 +243,6260 @@ static struct {
 	uint64_t scratch_toosmall; /* Scratch buffer was too small and
 				    * a temporary buffer was required. */
 	uint64_t scratch_tmpbufs;  /* Number of tmpbufs created */
+	uint64_t scratch_tmpbuf_reuse; /* Number of tmpbufs reused from pool */
+	uint64_t scratch_resize;   /* Adaptive scratch pad size changes */
+	uint64_t kafka_tx;         /* Kafka messages produced */
+	uint64_t kafka_records;    /* Records in produced Kafka messages */
+	uint64_t batch_flush_cnt;  /* Batches flushed on record count */
+	uint64_t batch_flush_bytes;/* Batches flushed on size */
+	uint64_t batch_flush_age;  /* Batches flushed on age */
+	uint64_t batch_flush_key;  /* Batches flushed on key change */
+	uint64_t batch_flush_topic;/* Batches flushed on topic change */
+	uint64_t vsl_records;      /* VSL records dispatched to parse_tag() */
+	uint64_t vsl_skipped;      /* VSL records not subscribed to */
+	uint64_t shard_skipped;    /* VSL records belonging to other shards */
+	uint64_t vsl_wraps;        /* VSL log wraps seen (zero-copy mode) */
+	uint64_t vsl_recopy;       /* Loglines re-copied on VSL wrap */
+	uint64_t vsl_overrun;      /* Loglines dropped due to VSL overrun */
+	uint64_t join_matched;     /* Backend transactions joined */
+	uint64_t join_missed;      /* Backend transactions without client */
+	uint64_t join_evicted;     /* Live join entries overwritten */
+	uint64_t capture_tx;       /* Captured requests output */
+	uint64_t capture_trunc;    /* Captured requests exceeding max records */
+	uint64_t capture_err;      /* Captured requests failed to output */
+	uint64_t log_dropped;      /* Log records dropped on full log queue,
+				    * updated atomically. */
+	uint64_t reload;           /* Configuration reloads */
+	uint64_t reload_err;       /* Failed configuration reloads */
+	uint64_t reload_dropped;   /* Loglines dropped after reload.timeout.ms */
 } cnt;
 
-static void print_stats (void) {
-	vk_log_stats("{ \"varnishkafka\": { "
-	       "\"time\":%llu, "
-	       "\"tx\":%"PRIu64", "
-	       "\"txerr\":%"PRIu64", "
-	       "\"kafka_drerr\":%"PRIu64", "
-	       "\"trunc\":%"PRIu64", "
-	       "\"scratch_toosmall\":%"PRIu64", "
-	       "\"scratch_tmpbufs\":%"PRIu64", "
-	       "\"lp_curr\":%i, "
-	       "\"seq\":%"PRIu64" "
-	       "} }\n",
-	       (unsigned long long)time(NULL),
-	       cnt.tx,
-	       cnt.txerr,
-	       cnt.kafka_drerr,
-	       cnt.trunc,
-	       cnt.scratch_toosmall,
-	       cnt.scratch_tmpbufs,
-	       logline_cnt,
-	       conf.sequence_number);
-}
 
+/**
+ * Effective CPU placement of the main (reader) thread, see placement_get().
+ */
+static struct {
+	int cpu;        /* CPU last run on */
+	int node;       /* NUMA node of 'cpu', -1 if unknown */
+} placement = { -1, -1 };
 
 
 /**
- * All constant strings in the format are placed in 'const_string' which
- * hopefully will be small enough to fit a single cache line.
+ * VSL tag subscription: tags referenced by any format (or all tags
+ * in passthrough=all mode) plus SLT_ReqEnd. See tags_subscribe().
  */
-static char  *const_string      = NULL;
-static size_t const_string_size = 0;
-static size_t const_string_len  = 0;
+static char tag_subscribed[VSL_TAGS_MAX];
+
 
 /**
- * Adds a constant string to the constant string area.
- * If the string is already found in the area, return it instead.
+ * Current batch of records to be coalesced into one Kafka message
+ * (message.batch.records > 1).
+ * Records are newline separated for string and JSON encodings and
+ * varint length prefixed for binary encodings.
  */
-static char *const_string_add (const char *in, int inlen) {
-	char *ret;
-	const char *instr = strndupa(in, inlen);
+static struct {
+	char    *buf;
+	size_t   len;
+	size_t   size;
+	int      cnt;        /* Records in batch */
+	uint64_t t_first;    /* Time of first record (monotonic us) */
+	struct vk_topic *topic; /* Destination topic */
+	int      binary;     /* Varint length prefixed records */
+	char    *key;        /* Message key (copied from first record) */
+	size_t   key_len;
+	size_t   key_size;
+	int      prio_cnt[VK_PRIO_NUM]; /* Records per priority class */
+} batch;
 
-	assert(inlen > 0);
-	if (!const_string || !(ret = strstr(const_string, instr))) {
-		if (const_string_len + inlen + 1 >= const_string_size) {
-			/* Reallocate buffer to fit new string (and more) */
-			const_string_size = (const_string_size + inlen + 64)*2;
-			const_string = realloc(const_string, const_string_size);
-		}
 
-		/* Append new string */
-		ret = const_string + const_string_len;
-		memcpy(ret, in, inlen);
-		ret[inlen] = '\0';
-		const_string_len += inlen;
-	}
+/**
+ * CPU governor state, see governor_check().
+ * One in 'rate' requests is rendered, the others are sampled out.
+ */
+static struct {
+	int      rate;         /* Current sample rate (1 in N) */
+	uint64_t seq;          /* Requests seen, for sampling */
+	uint64_t sampled_out;  /* Requests sampled out */
+	uint64_t t_last;       /* Last measurement (monotonic us) */
+	uint64_t cpu_last;     /* CPU time at last measurement (us) */
+	int      usage;        /* CPU usage at last measurement (%) */
+} gov = { rate: 1 };
 
-	return ret;
-}
+
+/**
+ * Latency histograms, only maintained if the statistics segment is enabled.
+ */
+typedef enum {
+	HIST_RENDER,    /* Render and output of a completed logline */
+	HIST_PRODUCE,   /* rd_kafka_produce() call */
+	HIST_REQ_RENDER,/* Request end (SLT_ReqEnd) to render */
+	HIST_RENDER_ACK,/* Render (produce) to Kafka delivery report */
+	HIST_NUM,
+} hist_type_t;
+
+static struct vk_shm_hist hists[HIST_NUM] = {
+	[HIST_RENDER]  = { name: "render_latency" },
+	[HIST_PRODUCE] = { name: "produce_latency" },
+	[HIST_REQ_RENDER] = { name: "request_to_render_latency" },
+	[HIST_RENDER_ACK] = { name: "render_to_ack_latency" },
+};
 
 
 /**
- * Print parsed format string: formatters
+ * Number of in-flight (produced but not yet delivered) Kafka messages per
+ * produce second, used to track the age of the oldest undelivered message.
+ * The slots cover the message timeout plus INFLIGHT_MARGIN seconds for
+ * delivery reports of expired messages, see inflight_init().
  */
-static __attribute__((unused)) void fmt_dump (const struct fmt_conf *fconf) {
-	int i;
+#define INFLIGHT_MARGIN  60
+static struct {
+	uint64_t *cnt;
+	uint64_t slots;     /* Number of slots in 'cnt' */
+	uint64_t total;     /* Total number of in-flight messages */
+	uint64_t oldest;    /* Oldest produce second with in-flight messages */
+	uint64_t newest;    /* Newest produce second */
+} inflight;
 
-	_DBG("%s %i/%i formats:",
-	     fmt_conf_names[fconf->fid], fconf->fmt_cnt, fconf->fmt_size);
-	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
-		_DBG(" #%-3i  fmt %i (%c)  var \"%s\", def (%i)\"%.*s\"%s",
-		     i,
-		     fconf->fmt[i].id,
-		     isprint(fconf->fmt[i].id) ? (char)fconf->fmt[i].id : ' ',
-		     fconf->fmt[i].var ? : "",
-		     fconf->fmt[i].deflen, fconf->fmt[i].deflen,
-		     fconf->fmt[i].def,
-		     fconf->fmt[i].flags & FMT_F_ESCAPE ? ", escape" : "");
-	}
-}
 
 /**
- * Print parser format string: tags
+ * Key librdkafka statistics, extracted from the statistics callback
+ * of each producer.
  */
-static __attribute__((unused)) void tag_dump (void) {
-	int i;
+struct kafka_stats {
+	uint64_t replyq;     /* Ops waiting to be served by rd_kafka_poll() */
+	uint64_t msg_cnt;    /* Messages in producer queues */
+	uint64_t msg_size;   /* Bytes in producer queues */
+	uint64_t msg_max;    /* Max messages allowed in producer queues */
+};
+static struct kafka_stats *kstats;  /* Per producer */
 
-	_DBG("Tags:");
-	for (i = 0 ; i < VSL_TAGS_MAX ; i++) {
-		struct tag *tag;
 
-		for (tag = conf.tag[i] ; tag ; tag = tag->next) {
-			_DBG(" #%-3i  spec 0x%x, tag %s (%i), var \"%s\", "
-			     "parser %p, col %i, fmt #%i %i (%c)",
-			     i,
-			     tag->spec,
-			     VSL_tags[tag->tag], tag->tag,
-			     tag->var, tag->parser,
-			     tag->col,
-			     tag->fmt->idx,
-			     tag->fmt->id,
-			     isprint(tag->fmt->id) ?
-			     (char)tag->fmt->id : 0);
-		}
-	}
-}
+/**
+ * Returns a monotonic clock in microseconds.
+ */
+static inline uint64_t vk_clock_us (void) {
+	struct timespec ts;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000llu) + (ts.tv_nsec / 1000);
+}
 
+/* Monotonic process start time (microseconds), see produce_opaque() */
+static uint64_t t_clock_start;
 
 /**
- * Adds a parsed formatter to the list of formatters
+ * Returns the Kafka message opaque for a message produced at monotonic
+ * time 't_us': the time since process start in microseconds, truncated
+ * to pointer size (wraps after 71 minutes on 32-bit platforms).
  */
-static int format_add (struct fmt_conf *fconf, int fmtr,
-		       const char *var, ssize_t varlen,
-		       const char *def, ssize_t deflen,
-		       int flags,
-		       char *errstr, size_t errstr_size) {
-	struct fmt *fmt;
+static inline void *produce_opaque (uint64_t t_us) {
+	return (void *)(uintptr_t)(t_us - t_clock_start);
+}
 
-	if (fconf->fmt_cnt >= fconf->fmt_size) {
-		fconf->fmt_size = (fconf->fmt_size ? : 32) * 2;
-		fconf->fmt = realloc(fconf->fmt,
-				     fconf->fmt_size * sizeof(*fconf->fmt));
-	}
+/**
+ * Returns the monotonic produce time of a message with opaque 'opaque'
+ * (see produce_opaque()) given the current time 'now'.
+ * The time since produce is computed modulo pointer size and is thus
+ * correct as long as delivery takes less than the wrap period, which
+ * librdkafka's message timeout ensures.
+ */
+static inline uint64_t produce_time (void *opaque, uint64_t now) {
+	uintptr_t age = (uintptr_t)(now - t_clock_start) - (uintptr_t)opaque;
 
-	fmt = &fconf->fmt[fconf->fmt_cnt];
-	memset(fmt, 0, sizeof(*fmt));
+	return now - (uint64_t)age;
+}
 
-	fmt->id    = fmtr;
-	fmt->idx   = fconf->fmt_cnt;
-	fmt->flags = flags;
-	if (var) {
-		if (varlen == -1)
-			varlen = strlen(var);
+/**
+ * Returns the wall clock in microseconds.
+ */
+static inline uint64_t vk_wallclock_us (void) {
+	struct timespec ts;
 
-		fmt->var = malloc(varlen+1);
-		memcpy((char *)fmt->var, var, varlen);
-		((char *)fmt->var)[varlen] = '\0';
-	} else
-		fmt->var = NULL;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000llu) + (ts.tv_nsec / 1000);
+}
 
-	if (!def)
-		def = "-";
 
-	if (deflen == -1)
-		deflen = strlen(def);
-	fmt->deflen = deflen;
-	fmt->def = const_string_add(def, deflen);
+/**
+ * Size the in-flight accounting for kafka.topic.message.timeout.ms.
+ * Returns 0 on success or -1 if the timeout is infinite (0).
+ */
+static int inflight_init (char *errstr, size_t errstr_size) {
+	if (conf.kafka_msg_timeout_ms <= 0) {
+		snprintf(errstr, errstr_size,
+			 "kafka.topic.message.timeout.ms must be greater "
+			 "than 0: undelivered messages are tracked for at "
+			 "most the message timeout");
+		return -1;
+	}
 
-	fconf->fmt_cnt++;
+	inflight.slots = (conf.kafka_msg_timeout_ms + 999) / 1000 +
+		INFLIGHT_MARGIN;
+	inflight.cnt = calloc(inflight.slots, sizeof(*inflight.cnt));
 
-	return fmt->idx;
+	return 0;
 }
 
+/**
+ * Account a message produced at monotonic time 't_us' as in-flight.
+ */
+static void inflight_add (uint64_t t_us) {
+	uint64_t sec = t_us / 1000000;
+
+	if (!inflight.total)
+		inflight.oldest = sec;
 
+	inflight.cnt[sec % inflight.slots]++;
+	inflight.total++;
+	inflight.newest = sec;
+}
 
 /**
- * Adds a parsed tag to the list of tags
+ * Remove a message produced at monotonic time 't_us' from in-flight
+ * accounting.
  */
-static int tag_add (struct fmt_conf *fconf, struct fmt *fmt,
-		    int spec, int tagid,
-		    const char *var, ssize_t varlen,
-		    int col,
-		    int (*parser) (const struct tag *tag, struct logline *lp,
-				   const char *ptr, int len),
-		    int tag_flags,
-		    char *errstr, size_t errstr_size) {
-	struct tag *tag;
+static void inflight_del (uint64_t t_us) {
+	uint64_t sec = t_us / 1000000;
 
-	tag = calloc(1, sizeof(*tag));
+	if (unlikely(!inflight.cnt[sec % inflight.slots]))
+		return;
 
-	assert(tagid < VSL_TAGS_MAX);
+	inflight.cnt[sec % inflight.slots]--;
+	inflight.total--;
 
-	if (conf.tag[tagid])
-		tag->next = conf.tag[tagid];
+	/* Advance to the next produce second with in-flight messages. */
+	while (inflight.oldest < inflight.newest &&
+	       !inflight.cnt[inflight.oldest % inflight.slots])
+		inflight.oldest++;
+}
 
-	conf.tag[tagid] = tag;
+/**
+ * Returns the age in seconds of the oldest undelivered message.
+ */
+static uint64_t inflight_oldest_age (void) {
+	uint64_t now;
 
-	tag->spec   = spec;
-	tag->tag    = tagid;
-	tag->col    = col;
-	tag->fmt    = fmt;
-	tag->parser = parser;
-	tag->flags  = tag_flags;
-	tag->fid    = fconf->fid;
+	if (!inflight.total)
+		return 0;
 
-	if (var) {
-		if (varlen == -1)
-			varlen = strlen(var);
+	now = vk_clock_us() / 1000000;
+	return now > inflight.oldest ? now - inflight.oldest : 0;
+}
 
-		tag->var = malloc(varlen+1);
-		tag->varlen = varlen;
-		memcpy(tag->var, var, varlen);
-		tag->var[varlen] = '\0';
-	} else
-		tag->var = NULL;
+/**
+ * Logline cache summary, see loglines_stats()
+ */
+#define CHAIN_HIST_MAX  16  /* Chain length distribution size, the last
+			     * entry counts all longer chains. */
+struct loglines_stats {
+	uint64_t hit;        /* Cache hits */
+	uint64_t miss;       /* Cache misses */
+	uint64_t purge;      /* Cache purges */
+	uint64_t oldest_age; /* Age of the oldest in-flight logline (seconds) */
+	uint64_t scratch_bytes; /* Memory allocated to scratch pads */
+	int      chain[CHAIN_HIST_MAX]; /* Buckets per chain length */
+};
 
-	return 0;
-}
-		     
+/**
+ * Collect logline cache summary into 'ls'.
+ * This walks the entire cache and must not be called for each logline.
+ */
+static void loglines_stats (struct loglines_stats *ls, time_t now) {
+	time_t oldest = now;
+	int i;
 
+	memset(ls, 0, sizeof(*ls));
 
-static inline void match_assign0 (const struct tag *tag, struct logline *lp,
-				  const char *ptr, int len);
-static void match_assign (const struct tag *tag, struct logline *lp,
-			  const char *ptr, int len);
+	for (i = 0 ; i < conf.loglines_hsize ; i++) {
+		const struct logline *lp;
+
+		ls->hit   += loglines[i].hit;
+		ls->miss  += loglines[i].miss;
+		ls->purge += loglines[i].purge;
+		ls->chain[loglines[i].cnt < CHAIN_HIST_MAX ?
+			  loglines[i].cnt : CHAIN_HIST_MAX-1]++;
 
+		LIST_FOREACH(lp, &loglines[i].lps, link) {
+			if (lp->t_first && lp->t_first < oldest)
+				oldest = lp->t_first;
+			ls->scratch_bytes += lp->scratch_size;
+		}
+	}
 
+	ls->oldest_age = now - oldest;
+}
 
 
 /**
- * Returns true if 'ptr' is within 'lp's scratch pad, else false.
+ * Returns the NUMA node of CPU 'cpu', or -1 if unknown.
  */
-static inline int is_scratch_ptr (const struct logline *lp, const char *ptr) {
-	return (lp->scratch <= ptr && ptr < lp->scratch + conf.scratch_size);
+static int cpu_numa_node (int cpu) {
+	char path[64];
+	struct dirent *de;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i", cpu);
+	if (!(dir = opendir(path)))
+		return -1;
+
+	while ((de = readdir(dir))) {
+		if (!strncmp(de->d_name, "node", 4) &&
+		    isdigit((int)de->d_name[4])) {
+			node = atoi(de->d_name+4);
+			break;
+		}
+	}
+
+	closedir(dir);
+	return node;
 }
 
+
 /**
- * Rewinds (deallocates) the last allocation by 'len' bytes.
+ * Update the effective placement of the calling (main) thread.
  */
-static inline void scratch_rewind (struct logline *lp, const char *ptr,
-				   size_t len) {
-
-	/* Can only rewind scratch buffer, not tmpbuffers */
-	if (!is_scratch_ptr(lp, ptr))
-		return;
+static void placement_get (void) {
+	int cpu = sched_getcpu();
 
-	assert(lp->sof >= len);
-	lp->sof -= len;
+	if (cpu != placement.cpu) {
+		placement.cpu  = cpu;
+		placement.node = cpu == -1 ? -1 : cpu_numa_node(cpu);
+	}
 }
 
 
 /**
- * Allocate persistent memory space ('len' bytes) in 
- * logline 'lp's scratch buffer.
+ * Parse CPU list 'list' ("0-3,8,10-11") into 'set'.
+ * Returns 0 on success or -1 on parse error.
  */
-static inline char *scratch_alloc (const struct tag *tag, struct logline *lp,
-				   int len) {
-	char *ptr;
+static int cpuset_parse (const char *list, cpu_set_t *set) {
+	const char *s = list;
 
-	if (unlikely(lp->sof + len > conf.scratch_size)) {
-		struct tmpbuf *tmpbuf;
+	CPU_ZERO(set);
 
-		cnt.scratch_toosmall++;
+	while (*s) {
+		char *end;
+		long lo, hi;
 
-		/* Scratch pad is too small: walk tmpbuffers to find
-		 * one with enough free space. */
-		tmpbuf = lp->tmpbuf;
-		while (tmpbuf) {
-			if (tmpbuf->of + len < tmpbuf->size)
-				break;
-			tmpbuf = tmpbuf->next;
-		}
+		lo = strtol(s, &end, 10);
+		if (end == s || lo < 0)
+			return -1;
+		hi = lo;
+		s = end;
 
-		/* No (usable) tmpbuf found, allocate a new one. */
-		if (!tmpbuf) {
-			size_t bsize = len < 512 ? 512 : len;
-			tmpbuf = malloc(sizeof(*tmpbuf) + bsize);
-			tmpbuf->size = bsize;
-			tmpbuf->of = 0;
-			/* Insert at head of tmpbuf list */
-			tmpbuf->next = lp->tmpbuf;
-			lp->tmpbuf = tmpbuf;
-			cnt.scratch_tmpbufs++;
+		if (*s == '-') {
+			s++;
+			hi = strtol(s, &end, 10);
+			if (end == s || hi < lo)
+				return -1;
+			s = end;
 		}
 
-		ptr = tmpbuf->buf + tmpbuf->of;
-		assert(tmpbuf->of + len > tmpbuf->of); /* integer overflow */
-		tmpbuf->of += len;
-		return ptr;
+		if (hi >= CPU_SETSIZE)
+			return -1;
+
+		for ( ; lo <= hi ; lo++)
+			CPU_SET(lo, set);
+
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
 	}
 
-	ptr = lp->scratch + lp->sof;
-	assert(lp->sof + len > lp->sof); /* integer overflow */
-	lp->sof += len;
-	return ptr;
+	return CPU_COUNT(set) > 0 ? 0 : -1;
 }
 
 
 /**
- * Helper that allocates 'len' bytes in the scratch buffer and
- * writes the contents of 'src' there.
+ * Format 'set' as a CPU list into 'buf'.
  */
-static inline int scratch_write (const struct tag *tag, struct logline *lp,
-				 const char *src, int len) {
-	char *dst;
+static const char *cpuset_str (const cpu_set_t *set, char *buf, size_t size) {
+	int i, of = 0;
 
-	dst = scratch_alloc(tag, lp, len);
-	memcpy(dst, src, len);
+	buf[0] = '\0';
 
-	match_assign(tag, lp, dst, len);
+	for (i = 0 ; i < CPU_SETSIZE && of < (int)size ; i++) {
+		int j;
 
-	return len;
+		if (!CPU_ISSET(i, set))
+			continue;
+
+		for (j = i ; j + 1 < CPU_SETSIZE && CPU_ISSET(j + 1, set) ; j++)
+			;
+
+		if (j > i)
+			of += snprintf(buf+of, size-of, "%s%i-%i",
+				       of ? "," : "", i, j);
+		else
+			of += snprintf(buf+of, size-of, "%s%i",
+				       of ? "," : "", i);
+		i = j;
+	}
+
+	return buf;
 }
 
+
 /**
- * Same as scratch_write0() but calls match_assign0() directly, thus
- * not supporting escaping.
+ * Pin the calling thread to the CPUs in 'list'.
+ * Threads created by the calling thread afterwards inherit the affinity.
+ * Returns 0 on success or -1 on error.
  */
-static inline int scratch_write0 (const struct tag *tag, struct logline *lp,
-				 const char *src, int len) {
-	char *dst;
-
-	dst = scratch_alloc(tag, lp, len);
+static int affinity_set (const char *what, const char *list) {
+	cpu_set_t set;
+	int r;
 
-	memcpy(dst, src, len);
+	if (cpuset_parse(list, &set) == -1) {
+		vk_log("AFFINITY", LOG_ERR,
+		       "Invalid %s CPU list \"%s\"", what, list);
+		return -1;
+	}
 
-	match_assign0(tag, lp, dst, len);
+	if ((r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))) {
+		vk_log("AFFINITY", LOG_ERR,
+		       "Failed to set %s CPU affinity to %s: %s",
+		       what, list, strerror(r));
+		return -1;
+	}
 
-	return len;
+	return 0;
 }
 
 
 /**
- * Writes 'src' of 'len' bytes to scratch buffer, escaping
- * all unprintable characters as well as the ones defined in 'map' below.
- * Returns -1 on error.
+ * Log the effective CPU placement of the calling thread.
  */
-static inline int scratch_write_escaped (const struct tag *tag,
-					 struct logline *lp,
-					 const char *src, int len) {
-	static const char *map[256] = {
-		['\t'] = "\\t",
-		['\n'] = "\\n",
-		['\r'] = "\\r",
-		['\v'] = "\\v",
-		['\f'] = "\\f",
-		['"']  = "\\\"",
-		[' ']  = "\\ ",
-	};
-	char *dst;
-	char *dstend;
-	char *d;
-	const char *s, *srcend = src + len;
-
-	/* Allocate initial space for escaped string.
-	 * The maximum expansion size per character is 5 (octal coding). */
-	dst = scratch_alloc(tag, lp, len * 5);
-	dstend = dst + (len * 5);
+static void placement_log (const char *what) {
+	cpu_set_t set;
+	char buf[256];
 
-	s = src;
-	d = dst;
-	while (s < srcend) {
-		int outlen = 1;
-		const char *out;
-		char tmp[6];
-
-		if (unlikely((out = map[(int)*s]) != NULL)) {
-			/* Escape from 'map' */
-			outlen = 2;
+	if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set))
+		return;
 
-		} else if (unlikely(!isprint(*s))) {
-			/* Escape non-printables as \<octal> */
-			sprintf(tmp, "\%04o", (int)*s);
-			out = tmp;
-			outlen = 5;
+	placement_get();
 
-		} else {
-			/* No escaping */
-			out = s;
-		}
+	vk_log("AFFINITY", LOG_INFO,
+	       "%s threads: CPUs %s (running on CPU %i, NUMA node %i)",
+	       what, cpuset_str(&set, buf, sizeof(buf)),
+	       placement.cpu, placement.node);
+}
 
-		assert(d + outlen < dstend);
 
-		if (likely(outlen == 1))
-			*(d++) = *out;
-		else {
-			memcpy(d, out, outlen);
-			d += outlen;
-		}
+static void print_stats (void) {
+	struct loglines_stats ls;
+	char chain[CHAIN_HIST_MAX * 12];
+	char *topicstats;
+	size_t tsize = 16;
+	time_t now = time(NULL);
+	int of = 0;
+	int i;
 
-		s++;
+	loglines_stats(&ls, now);
+	placement_get();
+
+	for (i = 0 ; i < CHAIN_HIST_MAX ; i++)
+		of += snprintf(chain+of, sizeof(chain)-of, "%s%i",
+			       i ? "," : "", ls.chain[i]);
+
+	/* Per topic counters and partition enqueue counts */
+	for (i = 0 ; i < topic_cnt ; i++)
+		tsize += 128 + strlen(topics[i]->name) +
+			(topics[i]->part_max * 22);
+	topicstats = malloc(tsize);
+
+	of = 0;
+	topicstats[0] = '\0';
+	for (i = 0 ; i < topic_cnt ; i++) {
+		int j;
+
+		of += snprintf(topicstats+of, tsize-of,
+			       "%s\"%s\":{\"tx\":%"PRIu64", "
+			       "\"txerr\":%"PRIu64", \"partitions\":[",
+			       i ? ", " : "", topics[i]->name,
+			       topics[i]->tx, topics[i]->txerr);
+		for (j = 0 ; j < topics[i]->part_max ; j++)
+			of += snprintf(topicstats+of, tsize-of,
+				       "%s%"PRIu64, j ? "," : "",
+				       topics[i]->part_enq[j]);
+		of += snprintf(topicstats+of, tsize-of, "]}");
 	}
 
-	/* Rewind scratch pad to reclaim unused memory. */
-	scratch_rewind(lp, dst, (int)(dstend-d));
+	vk_log_stats("{ \"varnishkafka\": { "
+	       "\"time\":%llu, "
+	       "\"tx\":%"PRIu64", "
+	       "\"txerr\":%"PRIu64", "
+	       "\"kafka_drerr\":%"PRIu64", "
+	       "\"trunc\":%"PRIu64", "
+	       "\"scratch_toosmall\":%"PRIu64", "
+	       "\"scratch_tmpbufs\":%"PRIu64", "
+	       "\"scratch_tmpbuf_reuse\":%"PRIu64", "
+	       "\"scratch_resize\":%"PRIu64", "
+	       "\"scratch_size\":%zd, "
+	       "\"kafka_tx\":%"PRIu64", "
+	       "\"kafka_records\":%"PRIu64", "
+	       "\"kafka_records_per_msg\":%.2f, "
+	       "\"batch_flush_cnt\":%"PRIu64", "
+	       "\"batch_flush_bytes\":%"PRIu64", "
+	       "\"batch_flush_age\":%"PRIu64", "
+	       "\"batch_flush_key\":%"PRIu64", "
+	       "\"batch_flush_topic\":%"PRIu64", "
+	       "\"vsl_records\":%"PRIu64", "
+	       "\"vsl_skipped\":%"PRIu64", "
+	       "\"vsl_skipped_ratio\":%.3f, "
+	       "\"shard_skipped\":%"PRIu64", "
+	       "\"vsl_wraps\":%"PRIu64", "
+	       "\"vsl_recopy\":%"PRIu64", "
+	       "\"vsl_overrun\":%"PRIu64", "
+	       "\"join_matched\":%"PRIu64", "
+	       "\"join_missed\":%"PRIu64", "
+	       "\"join_evicted\":%"PRIu64", "
+	       "\"capture_tx\":%"PRIu64", "
+	       "\"capture_trunc\":%"PRIu64", "
+	       "\"capture_err\":%"PRIu64", "
+	       "\"log_dropped\":%"PRIu64", "
+	       "\"reload\":%"PRIu64", "
+	       "\"reload_err\":%"PRIu64", "
+	       "\"reload_dropped\":%"PRIu64", "
+	       "\"cpu\":%i, "
+	       "\"numa_node\":%i, "
+	       "\"topics\":{%s}, "
+	       "\"priority\":{\"normal\":{\"tx\":%"PRIu64", "
+	       "\"drop\":%"PRIu64"}, "
+	       "\"high\":{\"tx\":%"PRIu64", \"drop\":%"PRIu64"}}, "
+	       "\"lp_curr\":%i, "
+	       "\"lp_inflight\":%i, "
+	       "\"lp_hit\":%"PRIu64", "
+	       "\"lp_miss\":%"PRIu64", "
+	       "\"lp_purge\":%"PRIu64", "
+	       "\"lp_oldest_age\":%"PRIu64", "
+	       "\"lp_scratch_bytes\":%"PRIu64", "
+	       "\"lp_tmpbuf_bytes\":%"PRIu64", "
+	       "\"lp_tmpbuf_pool_bytes\":%"PRIu64", "
+	       "\"lp_chain\":[%s], "
+	       "\"seq\":%"PRIu64", "
+	       "\"cpu_usage\":%i, "
+	       "\"sample_rate\":%i, "
+	       "\"sampled_out\":%"PRIu64", "
+	       "\"kafka_inflight\":%"PRIu64", "
+	       "\"kafka_inflight_oldest_age\":%"PRIu64" "
+	       "} }\n",
+	       (unsigned long long)now,
+	       cnt.tx,
+	       cnt.txerr,
+	       cnt.kafka_drerr,
+	       cnt.trunc,
+	       cnt.scratch_toosmall,
+	       cnt.scratch_tmpbufs,
+	       cnt.scratch_tmpbuf_reuse,
+	       cnt.scratch_resize,
+	       conf.scratch_size,
+	       cnt.kafka_tx,
+	       cnt.kafka_records,
+	       cnt.kafka_tx ?
+	       (double)cnt.kafka_records / (double)cnt.kafka_tx : 0.0,
+	       cnt.batch_flush_cnt,
+	       cnt.batch_flush_bytes,
+	       cnt.batch_flush_age,
+	       cnt.batch_flush_key,
+	       cnt.batch_flush_topic,
+	       cnt.vsl_records,
+	       cnt.vsl_skipped,
+	       cnt.vsl_records ?
+	       (double)cnt.vsl_skipped / (double)cnt.vsl_records : 0.0,
+	       cnt.shard_skipped,
+	       cnt.vsl_wraps,
+	       cnt.vsl_recopy,
+	       cnt.vsl_overrun,
+	       cnt.join_matched,
+	       cnt.join_missed,
+	       cnt.join_evicted,
+	       cnt.capture_tx,
+	       cnt.capture_trunc,
+	       cnt.capture_err,
+	       cnt.log_dropped,
+	       cnt.reload,
+	       cnt.reload_err,
+	       cnt.reload_dropped,
+	       placement.cpu,
+	       placement.node,
+	       topicstats,
+	       prio_cnt[VK_PRIO_NORMAL].tx, prio_cnt[VK_PRIO_NORMAL].drop,
+	       prio_cnt[VK_PRIO_HIGH].tx, prio_cnt[VK_PRIO_HIGH].drop,
+	       logline_cnt,
+	       logline_inflight,
+	       ls.hit,
+	       ls.miss,
+	       ls.purge,
+	       ls.oldest_age,
+	       ls.scratch_bytes,
+	       tmpbuf_bytes,
+	       tmpbuf_pool_bytes,
+	       chain,
+	       conf.sequence_number,
+	       gov.usage,
+	       gov.rate,
+	       gov.sampled_out,
+	       inflight.total,
+	       inflight_oldest_age());
+
+	free(topicstats);
+}
 
-	/* Assign new matched string */
-	match_assign0(tag, lp, dst, (int)(d-dst));
 
-	return 0;
+/**
+ * Adds 'val' to log2 histogram 'hist' of 'size' entries.
+ */
+static inline void log2_hist_add (int *hist, int size, uint64_t val) {
+	int i = val ? 64 - __builtin_clzll(val) : 0;
+	hist[i < size ? i : size-1]++;
 }
 
 /**
- * Helper that allocates enough space in the scratch buffer to fit
- * the string produced by 'fmt...'.
+ * Dump logline cache internals (triggered by SIGUSR1).
+ * The dump is written as a JSON object to the statistics file, if enabled,
+ * else a summary is logged.
  */
-static inline int scratch_printf (const struct tag *tag, struct logline *lp,
-				  const char *fmt, ...) {
-	va_list ap, ap2;
-	int r;
-	char *dst;
+static void loglines_dump (void) {
+#define BUCKET_HIST_MAX 32
+	struct loglines_stats ls;
+	int hist[3][BUCKET_HIST_MAX] = {};
+	static const char *hnames[3] = { "hit", "miss", "purge" };
+	char *buf;
+	size_t size, of = 0;
+	int i, j;
+
+	conf.need_cache_dump = 0;
+
+	loglines_stats(&ls, time(NULL));
+
+	vk_log("CACHE", LOG_INFO,
+	       "Logline cache: %i loglines (%i in-flight) in %i buckets, "
+	       "hit %"PRIu64", miss %"PRIu64", purge %"PRIu64", "
+	       "oldest %"PRIu64"s, scratch %"PRIu64" bytes, "
+	       "tmpbufs %"PRIu64" bytes",
+	       logline_cnt, logline_inflight, conf.loglines_hsize,
+	       ls.hit, ls.miss, ls.purge, ls.oldest_age,
+	       ls.scratch_bytes, tmpbuf_bytes);
 
-	va_copy(ap2, ap);
-	va_start(ap2, fmt);
-	r = vsnprintf(NULL, 0, fmt, ap2);
-	va_end(ap2);
+	if (!conf.stats_fp)
+		return;
 
-	dst = scratch_alloc(tag, lp, r+1);
+	/* Typical size, the buffer is grown as needed. */
+	size = 1024 + (conf.loglines_hsize * 64);
+	buf = malloc(size);
+
+#define _DP(fmt...) do {						\
+		int _r;							\
+		while ((_r = snprintf(buf+of, size-of, fmt)) >=	\
+		       (int)(size-of)) {				\
+			size *= 2;					\
+			buf = realloc(buf, size);			\
+		}							\
+		of += _r;						\
+	} while (0)
+
+	_DP("{ \"logline_cache\": { \"time\":%llu, "
+	    "\"hsize\":%i, \"hmax\":%i, \"lp_curr\":%i, "
+	    "\"lp_inflight\":%i, \"oldest_age\":%"PRIu64", "
+	    "\"scratch_bytes\":%"PRIu64", \"tmpbuf_bytes\":%"PRIu64", ",
+	    (unsigned long long)time(NULL),
+	    conf.loglines_hsize, conf.loglines_hmax, logline_cnt,
+	    logline_inflight, ls.oldest_age,
+	    ls.scratch_bytes, tmpbuf_bytes);
+
+	_DP("\"chain\":[");
+	for (i = 0 ; i < CHAIN_HIST_MAX ; i++)
+		_DP("%s%i", i ? "," : "", ls.chain[i]);
+	_DP("], ");
+
+	/* Distribution of per-bucket hit/miss/purge counts (log2) */
+	for (i = 0 ; i < conf.loglines_hsize ; i++) {
+		log2_hist_add(hist[0], BUCKET_HIST_MAX, loglines[i].hit);
+		log2_hist_add(hist[1], BUCKET_HIST_MAX, loglines[i].miss);
+		log2_hist_add(hist[2], BUCKET_HIST_MAX, loglines[i].purge);
+	}
 
-	va_start(ap, fmt);
-	vsnprintf(dst, r+1, fmt, ap);
-	va_end(ap);
+	for (j = 0 ; j < 3 ; j++) {
+		_DP("\"%s_hist\":[", hnames[j]);
+		for (i = 0 ; i < BUCKET_HIST_MAX ; i++)
+			_DP("%s%i", i ? "," : "", hist[j][i]);
+		_DP("], ");
+	}
 
-	match_assign(tag, lp, dst, r);
+	/* Per bucket [cnt, hit, miss, purge] */
+	_DP("\"buckets\":[");
+	for (i = 0 ; i < conf.loglines_hsize ; i++)
+		_DP("%s[%i,%"PRIu64",%"PRIu64",%"PRIu64"]",
+		    i ? "," : "",
+		    loglines[i].cnt, loglines[i].hit,
+		    loglines[i].miss, loglines[i].purge);
+	_DP("] } }\n");
 
-	return r;
+#undef _DP
+
+	vk_log_stats("%s", buf);
+
+	free(buf);
 }
 
-static inline int scratch_printf (const struct tag *tag, struct logline *lp,
-				  const char *fmt, ...)
-	__attribute__((format(printf,3,4)));
 
 
+/**
+ * All constant strings in the format are placed in 'const_string' which
+ * hopefully will be small enough to fit a single cache line.
+ */
+static char  *const_string      = NULL;
+static size_t const_string_size = 0;
+static size_t const_string_len  = 0;
 
+/**
+ * Adds a constant string to the constant string area.
+ * If the string is already found in the area, return it instead.
+ */
+static char *const_string_add (const char *in, int inlen) {
+	char *ret;
+	const char *instr = strndupa(in, inlen);
 
-static inline void match_assign0 (const struct tag *tag, struct logline *lp,
-				  const char *ptr, int len) {
-	assert(len >= 0);
-	lp->match[tag->fid][tag->fmt->idx].ptr = ptr;
-	lp->match[tag->fid][tag->fmt->idx].len = len;
+	assert(inlen > 0);
+	if (!const_string || !(ret = strstr(const_string, instr))) {
+		if (const_string_len + inlen + 1 >= const_string_size) {
+			/* Reallocate buffer to fit new string (and more) */
+			const_string_size = (const_string_size + inlen + 64)*2;
+			const_string = realloc(const_string, const_string_size);
+		}
+
+		/* Append new string */
+		ret = const_string + const_string_len;
+		memcpy(ret, in, inlen);
+		ret[inlen] = '\0';
+		const_string_len += inlen;
+	}
+
+	return ret;
 }
 
 
+
 /**
- * Assign 'PTR' of size 'LEN' as a match for 'TAG' in logline 'LP'.
+ * Default main format, used unless 'format' is configured.
+ */
+static char fmt_main_default[] = "%l %n %t %{Varnish:time_firstbyte}x %h "
+	"%{Varnish:handling}x/%s %b %m http://%{Host}i%U%q - - "
+	"%{Referer}i %{X-Forwarded-For}i %{User-agent}i";
+
+
+/**
+ * Format generation: the configured formats and selector rules and
+ * everything parsed from them (tag buckets, fmt_confs, constant strings,
+ * compiled rule maps).
  *
- * 'PTR' must be a pointer to persistent memory:
- *   - either VSL shared memory (original VSL tag payload)
- *   - or to a buffer allocated in the 'LP' scratch buffer.
+ * The current generation lives in 'conf' (and the statics above).
+ * A configuration reload (SIGUSR2) moves it to 'gen_old' and parses
+ * the new one in its place: loglines already in flight keep accumulating
+ * and are rendered with 'gen_old' (their 'gen' is not conf.gen), new
+ * requests use the new generation. 'gen_old' is freed once its last
+ * in-flight logline is done, or after reload.timeout.ms.
  */
-static void match_assign (const struct tag *tag, struct logline *lp,
-			  const char *ptr, int len) {
+struct fmt_gen {
+	unsigned int     gen;            /* conf.gen of this generation */
+	char            *format[FMT_CONF_NUM];
+	struct fmt_conf  fconf[FMT_CONF_NUM];
+	int              fconf_cnt;
+	int              total_fmt_cnt;
+	struct tag     **tag;
+	char            *const_string;
+	size_t           const_string_size;
+	size_t           const_string_len;
+	struct vk_route *routes;
+	int              route_cnt;
+	struct valmap    topic_routes;
+	struct vk_route *prio_rules;
+	int              prio_rule_cnt;
+	struct valmap    prio_map;
+
+	int              inflight;       /* Loglines still on this generation */
+	uint64_t         t_retired;      /* Reload time (monotonic us) */
+};
 
-	if (unlikely(tag->fmt->flags & FMT_F_ESCAPE)) {
-		/* If 'ptr' is in the scratch pad; rewind the scratch pad
-		 * since we'll be re-writing the string escaped. */
-		if (is_scratch_ptr(lp, ptr)) {
-			const char *optr = ptr;
-			ptr = strndupa(ptr, len);
-			scratch_rewind(lp, optr, len);
-		}
-		scratch_write_escaped(tag, lp, ptr, len);
+static struct fmt_gen gen_old;   /* Previous generation, if .tag is set */
 
-	} else {
-		if (conf.datacopy) /* copy volatile data */
-			scratch_write0(tag, lp, ptr, len);
-		else  /* point to persistent data */
-			match_assign0(tag, lp, ptr, len);
-	}
+
+/**
+ * Move the current generation from 'conf' to 'gen', leaving 'conf' with
+ * an empty generation.
+ */
+static void gen_save (struct fmt_gen *gen) {
+	int i;
+
+	memset(gen, 0, sizeof(*gen));
+	gen->gen = conf.gen;
+
+	memcpy(gen->format, conf.format, sizeof(gen->format));
+	memcpy(gen->fconf, conf.fconf, sizeof(gen->fconf));
+	gen->fconf_cnt         = conf.fconf_cnt;
+	gen->total_fmt_cnt     = conf.total_fmt_cnt;
+	gen->tag               = conf.tag;
+	gen->const_string      = const_string;
+	gen->const_string_size = const_string_size;
+	gen->const_string_len  = const_string_len;
+	gen->routes            = conf.routes;
+	gen->route_cnt         = conf.route_cnt;
+	gen->topic_routes      = topic_routes;
+	gen->prio_rules        = conf.prio_rules;
+	gen->prio_rule_cnt     = conf.prio_rule_cnt;
+	gen->prio_map          = prio_rules;
+
+	memset(conf.format, 0, sizeof(conf.format));
+	memset(conf.fconf, 0, sizeof(conf.fconf));
+	for (i = 0 ; i < FMT_CONF_NUM ; i++)
+		conf.fconf[i].fid = i;
+	conf.fconf_cnt     = 0;
+	conf.total_fmt_cnt = 0;
+	conf.tag           = NULL;
+	const_string       = NULL;
+	const_string_size  = 0;
+	const_string_len   = 0;
+	conf.routes        = NULL;
+	conf.route_cnt     = 0;
+	memset(&topic_routes, 0, sizeof(topic_routes));
+	conf.prio_rules    = NULL;
+	conf.prio_rule_cnt = 0;
+	memset(&prio_rules, 0, sizeof(prio_rules));
 }
 
 
+/**
+ * Make 'gen' (saved by gen_save()) the current generation again.
+ * The current generation must be empty.
+ */
+static void gen_restore (const struct fmt_gen *gen) {
+	memcpy(conf.format, gen->format, sizeof(conf.format));
+	memcpy(conf.fconf, gen->fconf, sizeof(conf.fconf));
+	conf.fconf_cnt     = gen->fconf_cnt;
+	conf.total_fmt_cnt = gen->total_fmt_cnt;
+	conf.tag           = gen->tag;
+	const_string       = gen->const_string;
+	const_string_size  = gen->const_string_size;
+	const_string_len   = gen->const_string_len;
+	conf.routes        = gen->routes;
+	conf.route_cnt     = gen->route_cnt;
+	topic_routes       = gen->topic_routes;
+	conf.prio_rules    = gen->prio_rules;
+	conf.prio_rule_cnt = gen->prio_rule_cnt;
+	prio_rules         = gen->prio_map;
+}
+
 
-static char *strnchr (const char *s, int len, int c) {
-	const char *end = s + len;
-	while (s < end) {
-		if (*s == c)
-			return (char *)s;
-		s++;
+/**
+ * Free a list of selector value rules.
+ */
+static void rules_free (struct vk_route *route) {
+	struct vk_route *next;
+
+	for ( ; route ; route = next) {
+		next = route->next;
+		free(route->value);
+		free(route->target);
+		free(route);
 	}
-
-	return NULL;
 }
 
 
 /**
- * Looks for any matching character from 'match' in 's' and returns
- * a pointer to the first match, or NULL if none of 'match' matched 's'.
+ * Free all memory of generation 'gen' (saved by gen_save()).
  */
-static char *strnchrs (const char *s, int len, const char *match) {
-	const char *end = s + len;
-	char map[256] = {};
-	while (*match)
-		map[(int)*(match++)] = 1;
-	
-	while (s < end) {
-		if (map[(int)*s])
-			return (char *)s;
-		s++;
-	}
-
-	return NULL;
-}
-	
+static void gen_free (struct fmt_gen *gen) {
+	int i, j;
 
-/**
- * Splits 'ptr' (with length 'len') by delimiter 'delim' and assigns
- * the Nth ('col') column to '*dst' and '*dstlen'.
- * Does not modify the input data ('ptr'), only points to it.
- *
- * Returns 1 if the column was found, else 0.
- *
- * NOTE: Columns start at 1.
- */
-static int column_get (int col, char delim, const char *ptr, int len,
-		       const char **dst, int *dstlen) {
-	const char *s = ptr;
-	const char *b = s;
-	const char *end = s + len;
-	int i = 0;
+	for (i = 0 ; gen->tag && i < VSL_TAGS_MAX ; i++) {
+		struct tag *tag, *next;
 
-	while (s < end) {
-		if (*s != delim) {
-			s++;
-			continue;
+		for (tag = gen->tag[i] ; tag ; tag = next) {
+			next = tag->next;
+			free(tag->var);
+			free(tag);
 		}
+	}
+	free(gen->tag);
 
-		if (s != b && col == ++i) {
-			*dst = b;
-			*dstlen = (int)(s - b);
-			return 1;
+	for (i = 0 ; i < FMT_CONF_NUM ; i++) {
+		struct fmt_conf *fconf = &gen->fconf[i];
+
+		for (j = 0 ; j < fconf->fmt_cnt ; j++) {
+			free((char *)fconf->fmt[j].var);
+			free((char *)fconf->fmt[j].encname);
 		}
+		free(fconf->fmt);
+		free(fconf->schema);
+		free(fconf->format);
 
-		b = ++s;
+		if (gen->format[i] != fmt_main_default)
+			free(gen->format[i]);
 	}
 
-	if (s != b && col == ++i) {
-		*dst = b;
-		*dstlen = (int)(s - b);
-		return 1;
-	}
+	free(gen->const_string);
+	rules_free(gen->routes);
+	rules_free(gen->prio_rules);
 
-	return 0;
+	memset(gen, 0, sizeof(*gen));
 }
 
 
-
 /**
- *
- * Misc parsers for formatters
- *
+ * Returns the fmt_confs of the generation logline 'lp' is accumulating on.
  */
-static int parse_BackendOpen (const struct tag *tag, struct logline *lp,
-			      const char *ptr, int len) {
-	const char *s;
-	int slen;
-	const int deflen = strlen("default");
+static inline struct fmt_conf *logline_fconf (const struct logline *lp) {
+	return unlikely(lp->gen != conf.gen) ? gen_old.fconf : conf.fconf;
+}
 
-	if (unlikely(!column_get(1, ' ', ptr, len, &s, &slen)))
-		return 0;
 
-	if (slen == deflen && !strncmp(s, "default", slen))
-		column_get(2, ' ', ptr, len, &s, &slen);
+/**
+ * Returns the tag buckets of the generation logline 'lp' is
+ * accumulating on.
+ */
+static inline struct tag **logline_tags (const struct logline *lp) {
+	return unlikely(lp->gen != conf.gen) ? gen_old.tag : conf.tag;
+}
 
-	match_assign(tag, lp, s, slen);
 
-	return 0;
-}	
+/**
+ * Print parsed format string: formatters
+ */
+static __attribute__((unused)) void fmt_dump (const struct fmt_conf *fconf) {
+	int i;
 
-static int parse_U (const struct tag *tag, struct logline *lp,
-		    const char *ptr, int len) {
-	const char *qs;
-	int slen = len;
+	_DBG("%s %i/%i formats:",
+	     fmt_conf_names[fconf->fid], fconf->fmt_cnt, fconf->fmt_size);
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		_DBG(" #%-3i  fmt %i (%c)  var \"%s\", def (%i)\"%.*s\"%s",
+		     i,
+		     fconf->fmt[i].id,
+		     isprint(fconf->fmt[i].id) ? (char)fconf->fmt[i].id : ' ',
+		     fconf->fmt[i].var ? : "",
+		     fconf->fmt[i].deflen, fconf->fmt[i].deflen,
+		     fconf->fmt[i].def,
+		     fconf->fmt[i].flags & FMT_F_ESCAPE ? ", escape" : "");
+	}
+}
 
-	if ((qs = strnchr(ptr, len, '?')))
-		slen = (int)(qs - ptr);
+/**
+ * Print parser format string: tags
+ */
+static __attribute__((unused)) void tag_dump (void) {
+	int i;
 
-	match_assign(tag, lp, ptr, slen);
-	return slen;
+	_DBG("Tags:");
+	for (i = 0 ; i < VSL_TAGS_MAX ; i++) {
+		struct tag *tag;
+
+		for (tag = conf.tag[i] ; tag ; tag = tag->next) {
+			_DBG(" #%-3i  spec 0x%x, tag %s (%i), var \"%s\", "
+			     "parser %p, col %i, fmt #%i %i (%c)",
+			     i,
+			     tag->spec,
+			     VSL_tags[tag->tag], tag->tag,
+			     tag->var, tag->parser,
+			     tag->col,
+			     tag->fmt->idx,
+			     tag->fmt->id,
+			     isprint(tag->fmt->id) ?
+			     (char)tag->fmt->id : 0);
+		}
+	}
 }
 
-static int parse_q (const struct tag *tag, struct logline *lp,
-		    const char *ptr, int len) {
-	const char *qs;
-	int slen = len;
 
-	if (!(qs = strnchr(ptr, len, '?')))
-		return 0;
 
-	slen = len - (int)(qs - ptr);
+/**
+ * Build the tag subscription set from the parsed formats and, if possible,
+ * push it down to the VSL reader (as -i) so that unsubscribed records are
+ * never dispatched at all.
+ *
+ * Push-down is not done if the user specified their own tag filters
+ * (-i, -x, -I, -X) or -m regexps, since the latter must see the
+ * records they match on.
+ */
+static void tags_subscribe (void) {
+	static const enum VSL_tag_e track[] = {
+		/* Used by the VSL reader to tell client from backend,
+		 * and by join.backend. */
+		SLT_SessionOpen, SLT_ReqStart, SLT_BackendOpen,
+		SLT_BackendXID, SLT_BackendReuse, SLT_BackendClose,
+		SLT_StatSess,
+	};
+	char *list;
+	size_t of = 0, size = 4096;
+	int i, n = 0;
 
-	match_assign(tag, lp, qs, slen);
-	return slen;
-}
+	/* Captured requests carry all their records, not just the
+	 * ones used by the formats. */
+	for (i = 0 ; i < VSL_TAGS_MAX ; i++) {
+		tag_subscribed[i] = conf.passthrough == VK_PASSTHRU_ALL ||
+			conf.capture_max || conf.tag[i] != NULL ||
+			(gen_old.tag && gen_old.tag[i] != NULL);
+		n += tag_subscribed[i];
+	}
 
-static int parse_t (const struct tag *tag, struct logline *lp,
-		    const char *ptr, int len) {
-	struct tm tm;
-	char *dst;
-	const char *timefmt = "[%d/%b/%Y:%T %z]";
-	const int timelen   = 64;
-	int tlen;
+	/* Requests are completed and rendered on ReqEnd. */
+	if (!tag_subscribed[SLT_ReqEnd]) {
+		tag_subscribed[SLT_ReqEnd] = 1;
+		n++;
+	}
 
-	/* Use config-supplied time formatting */
-	if (tag->var)
-		timefmt = tag->var;
+	/* Client requests are indexed by the xid in ReqStart. */
+	if (conf.join_backend && !tag_subscribed[SLT_ReqStart]) {
+		tag_subscribed[SLT_ReqStart] = 1;
+		n++;
+	}
 
-	if (tag->tag == SLT_TxHeader) {
-		if (unlikely(!strptime(strndupa(ptr, len),
-				       "%a, %d %b %Y %T", &tm)))
-			return 0;
+#ifdef VK_VSLQ
+	/* VSLQ records are already limited to the translated tags. */
+	conf.tag_pushdown = 0;
+#endif
 
-	} else {
-		time_t t = strtoul(ptr, NULL, 10);
-		localtime_r(&t, &tm);
+	if (!conf.tag_pushdown || conf.passthrough == VK_PASSTHRU_ALL ||
+	    conf.capture_max || conf.m_flag || conf.ix_flag || conf.replay_path) {
+		vk_log("TAGS", LOG_INFO,
+		       "Subscribed to %i of %i VSL tags", n, VSL_TAGS_MAX);
+		return;
 	}
 
-	dst = scratch_alloc(tag, lp, timelen);
+	list = malloc(size);
+	list[0] = '\0';
 
-	/* Format time string */
-	tlen = strftime(dst, timelen, timefmt, &tm);
+	for (i = 0 ; i < VSL_TAGS_MAX ; i++) {
+		int j, inc = tag_subscribed[i];
 
-	/* Redeem unused space */
-	if (likely(tlen < timelen))
-		scratch_rewind(lp, dst, timelen-tlen);
+		for (j = 0 ; !inc && j < (int)(sizeof(track)/sizeof(*track)) ; j++)
+			inc = (i == (int)track[j]);
 
-	match_assign(tag, lp, dst, tlen);
+		if (!inc || !VSL_tags[i])
+			continue;
 
-	return tlen;
-}
+		of += snprintf(list+of, size-of, "%s%s",
+			       of ? "," : "", VSL_tags[i]);
+		if (of >= size) {
+			vk_log("TAGS", LOG_WARNING,
+			       "Tag subscription list too long: "
+			       "not pushed down to VSL");
+			free(list);
+			return;
+		}
+	}
 
-static int parse_auth_user (const struct tag *tag, struct logline *lp,
-			    const char *ptr, int len) {
-	int rlen = len - 6/*"basic "*/;
-	int ulen;
-	char *tmp;
-	char *q;
+#ifndef VK_VSLQ
+	for (i = 0 ; i < conf.instance_cnt ; i++) {
+		if (VSL_Arg(conf.instances[i].vd, 'i', list) != 1) {
+			vk_log("TAGS", LOG_WARNING,
+			       "Failed to push down tag subscription "
+			       "to VSL: %s", list);
+			free(list);
+			return;
+		}
+	}
+#endif
 
-	if (unlikely(rlen <= 0 || strncasecmp(ptr, "basic ", 6) || (rlen % 2)))
-		return 0;
+	vk_log("TAGS", LOG_INFO,
+	       "Subscribed to %i of %i VSL tags "
+	       "(pushed down to VSL reader)", n, VSL_TAGS_MAX);
 
-	/* Calculate base64 decoded length */
-	if (unlikely(!(ulen = (rlen * 4) / 3)))
-		return 0;
+	free(list);
+}
 
-	/* Protect our stack */
-	if (unlikely(ulen > 1000))
-		return 0;
 
-	tmp = alloca(ulen+1);
+/**
+ * Adds a parsed formatter to the list of formatters
+ */
+static int format_add (struct fmt_conf *fconf, int fmtr,
+		       const char *var, ssize_t varlen,
+		       const char *def, ssize_t deflen,
+		       int flags,
+		       char *errstr, size_t errstr_size) {
+	struct fmt *fmt;
 
-	if ((ulen = VB64_decode2(tmp, ulen, ptr+6, rlen)) <= 0)
-		return 0;
+	if (fconf->fmt_cnt >= fconf->fmt_size) {
+		fconf->fmt_size = (fconf->fmt_size ? : 32) * 2;
+		fconf->fmt = realloc(fconf->fmt,
+				     fconf->fmt_size * sizeof(*fconf->fmt));
+	}
 
-	/* Strip password */
-	if ((q = strnchr(tmp, ulen, ':')))
-		*q = '\0';
+	fmt = &fconf->fmt[fconf->fmt_cnt];
+	memset(fmt, 0, sizeof(*fmt));
 
-	return scratch_write(tag, lp, tmp, strlen(tmp));
-}
+	fmt->id    = fmtr;
+	fmt->idx   = fconf->fmt_cnt;
+	fmt->flags = flags;
+	if (var) {
+		if (varlen == -1)
+			varlen = strlen(var);
 
+		fmt->var = malloc(varlen+1);
+		memcpy((char *)fmt->var, var, varlen);
+		((char *)fmt->var)[varlen] = '\0';
+	} else
+		fmt->var = NULL;
 
-static int parse_hitmiss (const struct tag *tag, struct logline *lp,
-			  const char *ptr, int len) {
-	if (len == 3 && !strncmp(ptr, "hit", 3)) {
-		match_assign(tag, lp, ptr, len);
-		return len;
-	} else if (len == 4 &&
-		 (!strncmp(ptr, "miss", 4) ||
-		  !strncmp(ptr, "pass", 4))) {
-		match_assign(tag, lp, "miss", 4);
-		return 4;
-	}
+	if (!def)
+		def = "-";
 
-	return 0;
-}
+	if (deflen == -1)
+		deflen = strlen(def);
+	fmt->deflen = deflen;
+	fmt->def = const_string_add(def, deflen);
 
-static int parse_handling (const struct tag *tag, struct logline *lp,
-			   const char *ptr, int len) {
-	if ((len == 3 && !strncmp(ptr, "hit", 3)) ||
-	    (len == 4 && (!strncmp(ptr, "miss", 4) ||
-			  !strncmp(ptr, "pass", 4)))) {
-		match_assign(tag, lp, ptr, len);
-		return len;
-	}
-	return 0;
-}
+	fconf->fmt_cnt++;
 
-static int parse_seq (const struct tag *tag, struct logline *lp,
-		       const char *ptr, int len) {
-	return scratch_printf(tag, lp, "%"PRIu64, conf.sequence_number);
+	return fmt->idx;
 }
 
 
 
 /**
- * 'arr' is an array of tuples (const char *from, const char *to) with
- * replacements. 'arr' must be terminated with a NULL (from).
- *
- * Returns a new allocated string with strings replaced according to 'arr'.
- *
- * NOTE: 'arr' must be sorted by descending 'from' length.
+ * Adds a parsed tag to the list of tags
  */
-static char *string_replace_arr (const char *in, const char **arr) {
-	char  *out;
-	size_t inlen = strlen(in);
-	size_t outsize = (inlen + 64) * 2;
-	size_t of = 0;
-	const char *s, *sp;
+static int tag_add (struct fmt_conf *fconf, struct fmt *fmt,
+		    int spec, int tagid,
+		    const char *var, ssize_t varlen,
+		    int col,
+		    int (*parser) (const struct tag *tag, struct logline *lp,
+				   const char *ptr, int len),
+		    int tag_flags,
+		    char *errstr, size_t errstr_size) {
+	struct tag *tag;
 
-	out = malloc(outsize);
-	assert(out);
+	tag = calloc(1, sizeof(*tag));
 
-	s = sp = in;
-	while (*s) {
-		const char **a;
+	assert(tagid < VSL_TAGS_MAX);
 
-		for (a = arr ; *a ; a += 2) {
-			const char *from = a[0];
-			const char *to   = a[1];
-			size_t fromlen   = strlen(from);
-			size_t tolen;
-			ssize_t diff;
+	if (conf.tag[tagid])
+		tag->next = conf.tag[tagid];
 
-			if (strncmp(s, from, fromlen))
-				continue;
+	conf.tag[tagid] = tag;
 
-			tolen = strlen(to);
-			diff  = tolen - fromlen;
+	tag->spec   = spec;
+	tag->tag    = tagid;
+	tag->col    = col;
+	tag->fmt    = fmt;
+	tag->parser = parser;
+	tag->flags  = tag_flags;
+	tag->fid    = fconf->fid;
 
-			if (s > sp) {
-				memcpy(out+of, sp, (int)(s-sp));
-				of += (int)(s-sp);
-			}
-			sp = s += fromlen;
+	if (var) {
+		if (varlen == -1)
+			varlen = strlen(var);
 
-			if (of + tolen >= outsize) {
-				/* Not enough space in output buffer,
-				 * reallocate and make some headroom to
-				 * avoid future reallocs. */
-				outsize = (of + diff + 64) * 2;
-				out = realloc(out, outsize);
-				assert(out);
-			}
-			
-			memcpy(out+of, to, tolen);
-			of += tolen;
-			s--;
-			break;
-		}
-		s++;
-	}
+		tag->var = malloc(varlen+1);
+		tag->varlen = varlen;
+		memcpy(tag->var, var, varlen);
+		tag->var[varlen] = '\0';
+	} else
+		tag->var = NULL;
 
-	if (s > sp) {
-		if ( of + (int)(s-sp) >= outsize) {
-			outsize = ( of + (int)(s-sp) + 1 );
-			out = realloc(out, outsize);
-			assert(out);
-		}
-		memcpy(out+of, sp, (int)(s-sp));
-		of += (int)(s-sp);
-	}
+	return 0;
+}
+		     
+
+
+static inline void match_assign0 (const struct tag *tag, struct logline *lp,
+				  const char *ptr, int len);
+static void match_assign (const struct tag *tag, struct logline *lp,
+			  const char *ptr, int len);
 
-	out[of] = '\0';
 
-	return out;
-}
 
 
 /**
- * Parse the format string and build a parsing array.
+ * Returns true if 'ptr' is within 'lp's scratch pad, else false.
  */
-static int format_parse (struct fmt_conf *fconf, const char *format_orig,
-			 char *errstr, size_t errstr_size) {
-	/**
-	 * Maps a formatter %X to a VSL tag and column id, or parser, or both
-	 */
-	struct {
-		/* A formatter may be backed by multiple tags.
-		 * The first matching tag observed in the log will be used. */
-		struct {
-			/* VSL_S_CLIENT or VSL_S_BACKEND, or both */
-			int spec;
-			/* The SLT_.. tag id */
-			int tag;
-			/* For "Name: Value" tags (such as SLT_RxHeader),
-			 * this is the "Name" part. */
-			const char *var;
-			/* Special handling for non-name-value vars such as
-			 * %{Varnish:handling}x. fmtvar is "Varnish:handling" */
-			const char *fmtvar; 
-			/* Column to extract:
-			 * 0 for entire string, else 1, 2, .. */
-			int col;
-			/* Parser to manually extract and/or convert a
-			 * tag's content. */
-			int (*parser) (const struct tag *tag,
-				       struct logline *lp,
-				       const char *ptr, int len);
-			/* Optional tag->flags */
-			int tag_flags;
-		} f[4+1]; /* increase size when necessary (max used size + 1) */
-		
-		/* Default string if no matching tag was found or all
-		 * parsers failed, defaults to "-". */
-		const char *def;
+static inline int is_scratch_ptr (const struct logline *lp, const char *ptr) {
+	return (lp->scratch <= ptr && ptr < lp->scratch + lp->scratch_size);
+}
 
-	} map[256] = {
-		/* Indexed by formatter character as
-		 * specified by varnishncsa(1) */
-		['b'] = { {
-				{ VSL_S_CLIENT, SLT_Length },
-				{ VSL_S_BACKEND, SLT_RxHeader,
-				  var: "content-length" }
-			} },
-		['H'] = { {
-				{ VSL_S_CLIENT, SLT_RxProtocol },
-				{ VSL_S_BACKEND, SLT_TxProtocol },
-			}, def: "HTTP/1.0" },
-		['h'] = { {
-				{ VSL_S_CLIENT, SLT_ReqStart, col: 1 },
-				{ VSL_S_BACKEND, SLT_BackendOpen,
-				  parser: parse_BackendOpen }
-			} },
-		['i'] = { { 
-				{ VSL_S_CLIENT, SLT_RxHeader },
-			} },
-		['l'] = { {
-				{ VSL_S_CLIENT|VSL_S_BACKEND },
-			}, def: conf.logname },
-		['m'] = { {
-				{ VSL_S_CLIENT, SLT_RxRequest },
-				{ VSL_S_BACKEND, SLT_TxRequest },
-			} },
-		['q'] = { {
-				{ VSL_S_CLIENT, SLT_RxURL, parser: parse_q },
-				{ VSL_S_BACKEND, SLT_TxURL, parser: parse_q },
-			},  def: "" },
-		['o'] = { { 
-				{ VSL_S_CLIENT, SLT_TxHeader },
-			} },
-		['s'] = { {
-				{ VSL_S_CLIENT, SLT_TxStatus },
-				{ VSL_S_BACKEND, SLT_RxStatus },
-			} },
-		['t'] = { {
-				{ VSL_S_CLIENT, SLT_ReqEnd,
-				  parser: parse_t, col: 3,
-				  tag_flags: TAG_F_NOVARMATCH },
-				{ VSL_S_BACKEND, SLT_RxHeader,
-				  var: "date", parser: parse_t,
-				  tag_flags: TAG_F_NOVARMATCH },
-			} },
-		['U'] = { {
-				{ VSL_S_CLIENT, SLT_RxURL, parser: parse_U },
-				{ VSL_S_BACKEND, SLT_TxURL, parser: parse_U },
-			} },
-		['u'] = { {
-				{ VSL_S_CLIENT, SLT_RxHeader,
-				  var: "authorization",
-				  parser: parse_auth_user },
-				{ VSL_S_BACKEND, SLT_TxHeader,
-				  var: "authorization",
-				  parser: parse_auth_user },
-			} },
-		['x'] = { { 
-				{ VSL_S_CLIENT, SLT_ReqEnd,
-				  fmtvar: "Varnish:time_firstbyte", col: 5 },
-				{ VSL_S_CLIENT, SLT_ReqEnd,
-				  fmtvar: "Varnish:xid", col: 1 },
-				{ VSL_S_CLIENT, SLT_VCL_call,
-				  fmtvar: "Varnish:hitmiss",
-				  parser: parse_hitmiss },
-				{ VSL_S_CLIENT, SLT_VCL_call,
-				  fmtvar: "Varnish:handling",
-				  parser: parse_handling },
-				{ VSL_S_CLIENT, SLT_VCL_Log,
-				  fmtvar: "VCL_Log:*" },
+/**
+ * Rewinds (deallocates) the last allocation by 'len' bytes.
+ */
+static inline void scratch_rewind (struct logline *lp, const char *ptr,
+				   size_t len) {
 
-			} },
-		['n'] = { {
-				{ VSL_S_CLIENT|VSL_S_BACKEND, VSL_TAG__ONCE,
-				  parser: parse_seq },
-			} },
-	};
-	/* Replace legacy formatters */
-	static const char *replace[] = {
-		/* "legacy-formatter", "new-formatter(s)" */
-		"%r", "%m http://%{Host?localhost}i%U%q %H",
-		NULL, NULL
-	};
-	const char *s, *t;
-	const char *format;
-	int cnt = 0;
+	/* Can only rewind scratch buffer, not tmpbuffers */
+	if (!is_scratch_ptr(lp, ptr))
+		return;
 
-	/* Perform legacy replacements. */
-	format = string_replace_arr(format_orig, replace);
+	assert(lp->sof >= len);
+	lp->sof -= len;
+}
 
-	/* Parse the format string */
-	s = t = format;
-	while (*s) {
-		const char *begin;
-		const char *var = NULL;
-		int varlen = 0;
-		const char *def = NULL;
-		int deflen = -1;
-		const char *name = NULL;
-		int namelen = -1;
-		int fmtid;
-		int i;
-		int flags = 0;
-		int type = FMT_TYPE_STRING;
 
-		if (*s != '%') {
-			s++;
-			continue;
-		}
+/**
+ * Returns a tmpbuf of at least 'len' bytes, from the pool if possible.
+ */
+static struct tmpbuf *tmpbuf_get (int len) {
+	struct tmpbuf *tmpbuf;
+	size_t bsize = TMPBUF_SIZE_MIN;
+	int class = 0;
 
-		/* ".....%... "
-		 *  ^---^  add this part as verbatim string */
-		if (s > t)
+	while (bsize < len && class < TMPBUF_CLASSES-1) {
+		bsize <<= 1;
+		class++;
+	}
+
+	if (bsize < len) {
+		/* Larger than the largest class: not pooled. */
+		bsize = len;
+	} else if ((tmpbuf = tmpbuf_pool[class].free)) {
+		tmpbuf_pool[class].free = tmpbuf->next;
+		tmpbuf_pool[class].cnt--;
+		tmpbuf_pool_bytes -= tmpbuf->size;
+		cnt.scratch_tmpbuf_reuse++;
+		goto done;
+	}
+
+	tmpbuf = malloc(sizeof(*tmpbuf) + bsize);
+	tmpbuf->size = bsize;
+	cnt.scratch_tmpbufs++;
+
+done:
+	tmpbuf->of = 0;
+	tmpbuf_bytes += tmpbuf->size;
+	return tmpbuf;
+}
+
+/**
+ * Returns a tmpbuf to the pool, or frees it if the pool is full or
+ * the buffer is not of a pooled size class.
+ */
+static void tmpbuf_put (struct tmpbuf *tmpbuf) {
+	int class = __builtin_ctzll(tmpbuf->size / TMPBUF_SIZE_MIN);
+
+	tmpbuf_bytes -= tmpbuf->size;
+
+	if ((tmpbuf->size & (tmpbuf->size - 1)) ||
+	    tmpbuf->size < TMPBUF_SIZE_MIN ||
+	    class >= TMPBUF_CLASSES ||
+	    tmpbuf_pool[class].cnt >= TMPBUF_POOL_MAX) {
+		free(tmpbuf);
+		return;
+	}
+
+	tmpbuf->next = tmpbuf_pool[class].free;
+	tmpbuf_pool[class].free = tmpbuf;
+	tmpbuf_pool[class].cnt++;
+	tmpbuf_pool_bytes += tmpbuf->size;
+}
+
+/**
+ * Free all pooled tmpbufs.
+ */
+static void tmpbuf_pool_term (void) {
+	int i;
+
+	for (i = 0 ; i < TMPBUF_CLASSES ; i++) {
+		struct tmpbuf *tmpbuf;
+		while ((tmpbuf = tmpbuf_pool[i].free)) {
+			tmpbuf_pool[i].free = tmpbuf->next;
+			free(tmpbuf);
+		}
+		tmpbuf_pool[i].cnt = 0;
+	}
+	tmpbuf_pool_bytes = 0;
+}
+
+
+/**
+ * Allocate persistent memory space ('len' bytes) in 
+ * logline 'lp's scratch buffer.
+ */
+static inline char *scratch_alloc (const struct tag *tag, struct logline *lp,
+				   int len) {
+	char *ptr;
+
+	if (unlikely(lp->sof + len > lp->scratch_size)) {
+		struct tmpbuf *tmpbuf;
+
+		cnt.scratch_toosmall++;
+
+		/* Scratch pad is too small: walk tmpbuffers to find
+		 * one with enough free space. */
+		tmpbuf = lp->tmpbuf;
+		while (tmpbuf) {
+			if (tmpbuf->of + len < tmpbuf->size)
+				break;
+			tmpbuf = tmpbuf->next;
+		}
+
+		/* No (usable) tmpbuf found, get a new one. */
+		if (!tmpbuf) {
+			tmpbuf = tmpbuf_get(len);
+			/* Insert at head of tmpbuf list */
+			tmpbuf->next = lp->tmpbuf;
+			lp->tmpbuf = tmpbuf;
+		}
+
+		ptr = tmpbuf->buf + tmpbuf->of;
+		assert(tmpbuf->of + len > tmpbuf->of); /* integer overflow */
+		tmpbuf->of += len;
+		return ptr;
+	}
+
+	ptr = lp->scratch + lp->sof;
+	assert(lp->sof + len > lp->sof); /* integer overflow */
+	lp->sof += len;
+	return ptr;
+}
+
+
+/**
+ * Adapt the scratch pad size to the 99th percentile of the observed
+ * per-request usage plus the configured headroom.
+ * Loglines are resized to the new size as they become idle.
+ */
+static void scratch_adapt (void) {
+	uint64_t thres = (scratch_usage.samples * 99) / 100;
+	uint64_t sum = 0;
+	size_t size;
+	int i;
+
+	for (i = 0 ; i < SCRATCH_HIST_SIZE - 1 ; i++) {
+		sum += scratch_usage.hist[i];
+		if (sum > thres)
+			break;
+	}
+
+	size = ((i + 1) * SCRATCH_HIST_GRAN *
+		(100 + conf.scratch_headroom)) / 100;
+	size = (size + SCRATCH_HIST_GRAN - 1) & ~(SCRATCH_HIST_GRAN - 1);
+
+	if (size < SCRATCH_SIZE_MIN)
+		size = SCRATCH_SIZE_MIN;
+	else if (size > conf.scratch_max)
+		size = conf.scratch_max;
+
+	if (size != conf.scratch_size) {
+		vk_log("SCRATCH", LOG_INFO,
+		       "Adapting logline scratch size from %zd to %zd bytes "
+		       "(p99 usage %i bytes)",
+		       conf.scratch_size, size, (i + 1) * SCRATCH_HIST_GRAN);
+		conf.scratch_size = size;
+		cnt.scratch_resize++;
+	}
+
+	memset(&scratch_usage, 0, sizeof(scratch_usage));
+}
+
+/**
+ * Account the total scratch usage of a completed logline.
+ */
+static inline void scratch_usage_add (const struct logline *lp) {
+	const struct tmpbuf *tmpbuf;
+	size_t used = lp->sof;
+	int i;
+
+	for (tmpbuf = lp->tmpbuf ; tmpbuf ; tmpbuf = tmpbuf->next)
+		used += tmpbuf->of;
+
+	i = used / SCRATCH_HIST_GRAN;
+	scratch_usage.hist[i < SCRATCH_HIST_SIZE ? i : SCRATCH_HIST_SIZE-1]++;
+
+	if (unlikely(++scratch_usage.samples >= SCRATCH_ADAPT_SAMPLES))
+		scratch_adapt();
+}
+
+
+/**
+ * Helper that allocates 'len' bytes in the scratch buffer and
+ * writes the contents of 'src' there.
+ */
+static inline int scratch_write (const struct tag *tag, struct logline *lp,
+				 const char *src, int len) {
+	char *dst;
+
+	dst = scratch_alloc(tag, lp, len);
+	memcpy(dst, src, len);
+
+	match_assign(tag, lp, dst, len);
+
+	return len;
+}
+
+/**
+ * Same as scratch_write0() but calls match_assign0() directly, thus
+ * not supporting escaping.
+ */
+static inline int scratch_write0 (const struct tag *tag, struct logline *lp,
+				 const char *src, int len) {
+	char *dst;
+
+	dst = scratch_alloc(tag, lp, len);
+
+	memcpy(dst, src, len);
+
+	match_assign0(tag, lp, dst, len);
+
+	return len;
+}
+
+
+/**
+ * Writes 'src' of 'len' bytes to scratch buffer, escaping
+ * all unprintable characters as well as the ones defined in 'map' below.
+ * Returns -1 on error.
+ */
+static inline int scratch_write_escaped (const struct tag *tag,
+					 struct logline *lp,
+					 const char *src, int len) {
+	static const char *map[256] = {
+		['\t'] = "\\t",
+		['\n'] = "\\n",
+		['\r'] = "\\r",
+		['\v'] = "\\v",
+		['\f'] = "\\f",
+		['"']  = "\\\"",
+		[' ']  = "\\ ",
+	};
+	char *dst;
+	char *dstend;
+	char *d;
+	const char *s, *srcend = src + len;
+
+	/* Allocate initial space for escaped string.
+	 * The maximum expansion size per character is 5 (octal coding). */
+	dst = scratch_alloc(tag, lp, len * 5);
+	dstend = dst + (len * 5);
+
+	s = src;
+	d = dst;
+	while (s < srcend) {
+		int outlen = 1;
+		const char *out;
+		char tmp[6];
+
+		if (unlikely((out = map[(int)*s]) != NULL)) {
+			/* Escape from 'map' */
+			outlen = 2;
+
+		} else if (unlikely(!isprint(*s))) {
+			/* Escape non-printables as \<octal> */
+			sprintf(tmp, "\%04o", (int)*s);
+			out = tmp;
+			outlen = 5;
+
+		} else {
+			/* No escaping */
+			out = s;
+		}
+
+		assert(d + outlen < dstend);
+
+		if (likely(outlen == 1))
+			*(d++) = *out;
+		else {
+			memcpy(d, out, outlen);
+			d += outlen;
+		}
+
+		s++;
+	}
+
+	/* Rewind scratch pad to reclaim unused memory. */
+	scratch_rewind(lp, dst, (int)(dstend-d));
+
+	/* Assign new matched string */
+	match_assign0(tag, lp, dst, (int)(d-dst));
+
+	return 0;
+}
+
+/**
+ * Helper that allocates enough space in the scratch buffer to fit
+ * the string produced by 'fmt...'.
+ */
+static inline int scratch_printf (const struct tag *tag, struct logline *lp,
+				  const char *fmt, ...) {
+	va_list ap, ap2;
+	int r;
+	char *dst;
+
+	va_copy(ap2, ap);
+	va_start(ap2, fmt);
+	r = vsnprintf(NULL, 0, fmt, ap2);
+	va_end(ap2);
+
+	dst = scratch_alloc(tag, lp, r+1);
+
+	va_start(ap, fmt);
+	vsnprintf(dst, r+1, fmt, ap);
+	va_end(ap);
+
+	match_assign(tag, lp, dst, r);
+
+	return r;
+}
+
+static inline int scratch_printf (const struct tag *tag, struct logline *lp,
+				  const char *fmt, ...)
+	__attribute__((format(printf,3,4)));
+
+
+
+
+static inline void match_assign0 (const struct tag *tag, struct logline *lp,
+				  const char *ptr, int len) {
+	assert(len >= 0);
+	lp->match[tag->fid][tag->fmt->idx].ptr = ptr;
+	lp->match[tag->fid][tag->fmt->idx].len = len;
+}
+
+
+/**
+ * Assign 'PTR' of size 'LEN' as a match for 'TAG' in logline 'LP'.
+ *
+ * 'PTR' must be a pointer to persistent memory:
+ *   - either VSL shared memory (original VSL tag payload)
+ *   - or to a buffer allocated in the 'LP' scratch buffer.
+ */
+static void match_assign (const struct tag *tag, struct logline *lp,
+			  const char *ptr, int len) {
+
+	if (unlikely(tag->fmt->flags & FMT_F_ESCAPE)) {
+		/* If 'ptr' is in the scratch pad; rewind the scratch pad
+		 * since we'll be re-writing the string escaped. */
+		if (is_scratch_ptr(lp, ptr)) {
+			const char *optr = ptr;
+			ptr = strndupa(ptr, len);
+			scratch_rewind(lp, optr, len);
+		}
+		scratch_write_escaped(tag, lp, ptr, len);
+
+	} else {
+		if (conf.datacopy) /* copy volatile data */
+			scratch_write0(tag, lp, ptr, len);
+		else  /* point to persistent data */
+			match_assign0(tag, lp, ptr, len);
+	}
+}
+
+
+
+static char *strnchr (const char *s, int len, int c) {
+	const char *end = s + len;
+	while (s < end) {
+		if (*s == c)
+			return (char *)s;
+		s++;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Returns the unsigned integer at the start of 's' (not nul-terminated).
+ */
+static unsigned int strntou (const char *s, int len) {
+	unsigned int v = 0;
+
+	while (len-- > 0 && *s >= '0' && *s <= '9')
+		v = (v * 10) + (*(s++) - '0');
+
+	return v;
+}
+
+
+/**
+ * Looks for any matching character from 'match' in 's' and returns
+ * a pointer to the first match, or NULL if none of 'match' matched 's'.
+ */
+static char *strnchrs (const char *s, int len, const char *match) {
+	const char *end = s + len;
+	char map[256] = {};
+	while (*match)
+		map[(int)*(match++)] = 1;
+	
+	while (s < end) {
+		if (map[(int)*s])
+			return (char *)s;
+		s++;
+	}
+
+	return NULL;
+}
+	
+
+/**
+ * Splits 'ptr' (with length 'len') by delimiter 'delim' and assigns
+ * the Nth ('col') column to '*dst' and '*dstlen'.
+ * Does not modify the input data ('ptr'), only points to it.
+ *
+ * Returns 1 if the column was found, else 0.
+ *
+ * NOTE: Columns start at 1.
+ */
+static int column_get (int col, char delim, const char *ptr, int len,
+		       const char **dst, int *dstlen) {
+	const char *s = ptr;
+	const char *b = s;
+	const char *end = s + len;
+	int i = 0;
+
+	while (s < end) {
+		if (*s != delim) {
+			s++;
+			continue;
+		}
+
+		if (s != b && col == ++i) {
+			*dst = b;
+			*dstlen = (int)(s - b);
+			return 1;
+		}
+
+		b = ++s;
+	}
+
+	if (s != b && col == ++i) {
+		*dst = b;
+		*dstlen = (int)(s - b);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+
+/**
+ *
+ * Misc parsers for formatters
+ *
+ */
+static int parse_BackendOpen (const struct tag *tag, struct logline *lp,
+			      const char *ptr, int len) {
+	const char *s;
+	int slen;
+	const int deflen = strlen("default");
+
+	if (unlikely(!column_get(1, ' ', ptr, len, &s, &slen)))
+		return 0;
+
+	if (slen == deflen && !strncmp(s, "default", slen))
+		column_get(2, ' ', ptr, len, &s, &slen);
+
+	match_assign(tag, lp, s, slen);
+
+	return 0;
+}	
+
+static int parse_U (const struct tag *tag, struct logline *lp,
+		    const char *ptr, int len) {
+	const char *qs;
+	int slen = len;
+
+	if ((qs = strnchr(ptr, len, '?')))
+		slen = (int)(qs - ptr);
+
+	match_assign(tag, lp, ptr, slen);
+	return slen;
+}
+
+static int parse_q (const struct tag *tag, struct logline *lp,
+		    const char *ptr, int len) {
+	const char *qs;
+	int slen = len;
+
+	if (!(qs = strnchr(ptr, len, '?')))
+		return 0;
+
+	slen = len - (int)(qs - ptr);
+
+	match_assign(tag, lp, qs, slen);
+	return slen;
+}
+
+static int parse_t (const struct tag *tag, struct logline *lp,
+		    const char *ptr, int len) {
+	struct tm tm;
+	char *dst;
+	const char *timefmt = "[%d/%b/%Y:%T %z]";
+	const int timelen   = 64;
+	int tlen;
+
+	/* Use config-supplied time formatting */
+	if (tag->var)
+		timefmt = tag->var;
+
+	if (tag->tag == SLT_TxHeader) {
+		if (unlikely(!strptime(strndupa(ptr, len),
+				       "%a, %d %b %Y %T", &tm)))
+			return 0;
+
+	} else {
+		time_t t = strtoul(ptr, NULL, 10);
+		localtime_r(&t, &tm);
+	}
+
+	dst = scratch_alloc(tag, lp, timelen);
+
+	/* Format time string */
+	tlen = strftime(dst, timelen, timefmt, &tm);
+
+	/* Redeem unused space */
+	if (likely(tlen < timelen))
+		scratch_rewind(lp, dst, timelen-tlen);
+
+	match_assign(tag, lp, dst, tlen);
+
+	return tlen;
+}
+
+static int parse_auth_user (const struct tag *tag, struct logline *lp,
+			    const char *ptr, int len) {
+	int rlen = len - 6/*"basic "*/;
+	int ulen;
+	char *tmp;
+	char *q;
+
+	if (unlikely(rlen <= 0 || strncasecmp(ptr, "basic ", 6) || (rlen % 2)))
+		return 0;
+
+	/* Calculate base64 decoded length */
+	if (unlikely(!(ulen = (rlen * 4) / 3)))
+		return 0;
+
+	/* Protect our stack */
+	if (unlikely(ulen > 1000))
+		return 0;
+
+	tmp = alloca(ulen+1);
+
+	if ((ulen = VB64_decode2(tmp, ulen, ptr+6, rlen)) <= 0)
+		return 0;
+
+	/* Strip password */
+	if ((q = strnchr(tmp, ulen, ':')))
+		*q = '\0';
+
+	return scratch_write(tag, lp, tmp, strlen(tmp));
+}
+
+
+static int parse_hitmiss (const struct tag *tag, struct logline *lp,
+			  const char *ptr, int len) {
+	if (len == 3 && !strncmp(ptr, "hit", 3)) {
+		match_assign(tag, lp, ptr, len);
+		return len;
+	} else if (len == 4 &&
+		 (!strncmp(ptr, "miss", 4) ||
+		  !strncmp(ptr, "pass", 4))) {
+		match_assign(tag, lp, "miss", 4);
+		return 4;
+	}
+
+	return 0;
+}
+
+static int parse_handling (const struct tag *tag, struct logline *lp,
+			   const char *ptr, int len) {
+	if ((len == 3 && !strncmp(ptr, "hit", 3)) ||
+	    (len == 4 && (!strncmp(ptr, "miss", 4) ||
+			  !strncmp(ptr, "pass", 4)))) {
+		match_assign(tag, lp, ptr, len);
+		return len;
+	}
+	return 0;
+}
+
+static int parse_seq (const struct tag *tag, struct logline *lp,
+		       const char *ptr, int len) {
+	return scratch_printf(tag, lp, "%"PRIu64, conf.sequence_number);
+}
+
+static int parse_instance (const struct tag *tag, struct logline *lp,
+			   const char *ptr, int len) {
+	const char *name = conf.instances[lp->inst].name;
+	int nlen;
+
+	if (!name)
+		return 0;
+
+	nlen = strlen(name);
+	match_assign(tag, lp, name, nlen);
+	return nlen;
+}
+
+static int parse_sample_rate (const struct tag *tag, struct logline *lp,
+			      const char *ptr, int len) {
+	return scratch_printf(tag, lp, "%i", gov.rate);
+}
+
+
+
+/**
+ * 'arr' is an array of tuples (const char *from, const char *to) with
+ * replacements. 'arr' must be terminated with a NULL (from).
+ *
+ * Returns a new allocated string with strings replaced according to 'arr'.
+ *
+ * NOTE: 'arr' must be sorted by descending 'from' length.
+ */
+static char *string_replace_arr (const char *in, const char **arr) {
+	char  *out;
+	size_t inlen = strlen(in);
+	size_t outsize = (inlen + 64) * 2;
+	size_t of = 0;
+	const char *s, *sp;
+
+	out = malloc(outsize);
+	assert(out);
+
+	s = sp = in;
+	while (*s) {
+		const char **a;
+
+		for (a = arr ; *a ; a += 2) {
+			const char *from = a[0];
+			const char *to   = a[1];
+			size_t fromlen   = strlen(from);
+			size_t tolen;
+			ssize_t diff;
+
+			if (strncmp(s, from, fromlen))
+				continue;
+
+			tolen = strlen(to);
+			diff  = tolen - fromlen;
+
+			if (s > sp) {
+				memcpy(out+of, sp, (int)(s-sp));
+				of += (int)(s-sp);
+			}
+			sp = s += fromlen;
+
+			if (of + tolen >= outsize) {
+				/* Not enough space in output buffer,
+				 * reallocate and make some headroom to
+				 * avoid future reallocs. */
+				outsize = (of + diff + 64) * 2;
+				out = realloc(out, outsize);
+				assert(out);
+			}
+			
+			memcpy(out+of, to, tolen);
+			of += tolen;
+			s--;
+			break;
+		}
+		s++;
+	}
+
+	if (s > sp) {
+		if ( of + (int)(s-sp) >= outsize) {
+			outsize = ( of + (int)(s-sp) + 1 );
+			out = realloc(out, outsize);
+			assert(out);
+		}
+		memcpy(out+of, sp, (int)(s-sp));
+		of += (int)(s-sp);
+	}
+
+	out[of] = '\0';
+
+	return out;
+}
+
+
+/**
+ * MessagePack encoding helpers.
+ * All writers assume the destination has enough room for the
+ * encoded object, see MSGPACK_HDR_MAX.
+ */
+#define MSGPACK_HDR_MAX  9  /* Maximum type header size (excl. payload) */
+
+static inline char *msgpack_put_be (char *d, uint64_t v, int bytes) {
+	while (bytes-- > 0)
+		*(d++) = (char)(v >> (bytes * 8));
+	return d;
+}
+
+/**
+ * Write string header for a string of 'len' bytes.
+ */
+static inline char *msgpack_put_strhdr (char *d, size_t len) {
+	if (len < 32)
+		*(d++) = (char)(0xa0 | len);
+	else if (len < 0x100) {
+		*(d++) = (char)0xd9;
+		d = msgpack_put_be(d, len, 1);
+	} else if (len < 0x10000) {
+		*(d++) = (char)0xda;
+		d = msgpack_put_be(d, len, 2);
+	} else {
+		*(d++) = (char)0xdb;
+		d = msgpack_put_be(d, len, 4);
+	}
+	return d;
+}
+
+static inline char *msgpack_put_maphdr (char *d, int cnt) {
+	if (cnt < 16)
+		*(d++) = (char)(0x80 | cnt);
+	else {
+		*(d++) = (char)0xde;
+		d = msgpack_put_be(d, cnt, 2);
+	}
+	return d;
+}
+
+static inline char *msgpack_put_int (char *d, int64_t v) {
+	if (v >= 0) {
+		if (v < 0x80)
+			*(d++) = (char)v;
+		else if (v < 0x100) {
+			*(d++) = (char)0xcc;
+			d = msgpack_put_be(d, v, 1);
+		} else if (v < 0x10000) {
+			*(d++) = (char)0xcd;
+			d = msgpack_put_be(d, v, 2);
+		} else if (v < 0x100000000ll) {
+			*(d++) = (char)0xce;
+			d = msgpack_put_be(d, v, 4);
+		} else {
+			*(d++) = (char)0xcf;
+			d = msgpack_put_be(d, v, 8);
+		}
+	} else if (v >= -32)
+		*(d++) = (char)v;
+	else if (v >= INT8_MIN) {
+		*(d++) = (char)0xd0;
+		d = msgpack_put_be(d, v, 1);
+	} else if (v >= INT16_MIN) {
+		*(d++) = (char)0xd1;
+		d = msgpack_put_be(d, v, 2);
+	} else if (v >= INT32_MIN) {
+		*(d++) = (char)0xd2;
+		d = msgpack_put_be(d, v, 4);
+	} else {
+		*(d++) = (char)0xd3;
+		d = msgpack_put_be(d, v, 8);
+	}
+	return d;
+}
+
+static inline char *msgpack_put_double (char *d, double v) {
+	union { double d; uint64_t u; } u = { d: v };
+	*(d++) = (char)0xcb;
+	return msgpack_put_be(d, u.u, 8);
+}
+
+
+/**
+ * Number parsing result, see number_parse()
+ */
+typedef enum {
+	NUM_NONE,    /* Not a number */
+	NUM_INT,
+	NUM_DOUBLE,
+} num_type_t;
+
+/**
+ * Parse the number in 'ptr' (of 'len' bytes) as an integer or,
+ * if that fails, a double.
+ */
+static num_type_t number_parse (const char *ptr, int len,
+				int64_t *ip, double *dp) {
+	char tmp[64];
+	char *end;
+
+	if (len == 0 || len >= sizeof(tmp))
+		return NUM_NONE;
+
+	memcpy(tmp, ptr, len);
+	tmp[len] = '\0';
+
+	*ip = strtoll(tmp, &end, 10);
+	if (end == tmp + len)
+		return NUM_INT;
+
+	*dp = strtod(tmp, &end);
+	if (end == tmp + len && !isnan(*dp))
+		return NUM_DOUBLE;
+
+	return NUM_NONE;
+}
+
+
+/**
+ * Pre-encode MessagePack field names for all formatters in 'fconf'.
+ */
+static void msgpack_names_encode (struct fmt_conf *fconf) {
+	int i;
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		struct fmt *fmt = &fconf->fmt[i];
+		char name = (char)fmt->id;
+		const char *n = fmt->name ? fmt->name : &name;
+		int nlen = fmt->name ? fmt->namelen : 1;
+		char *d;
+
+		if (fmt->id == 0)
+			continue;
+
+		d = malloc(MSGPACK_HDR_MAX + nlen);
+		fmt->encname = d;
+		d = msgpack_put_strhdr(d, nlen);
+		memcpy(d, n, nlen);
+		fmt->encnamelen = (int)(d - fmt->encname) + nlen;
+	}
+}
+
+
+/**
+ * Avro binary encoding helpers.
+ */
+#define AVRO_VARINT_MAX  10  /* Maximum encoded long size */
+
+/**
+ * Write 'v' as a zig-zag varint encoded Avro long.
+ */
+static inline char *avro_put_long (char *d, int64_t v) {
+	uint64_t n = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+
+	while (n & ~0x7fllu) {
+		*(d++) = (char)((n & 0x7f) | 0x80);
+		n >>= 7;
+	}
+	*(d++) = (char)n;
+	return d;
+}
+
+static inline char *avro_put_double (char *d, double v) {
+	union { double d; uint64_t u; } u = { d: v };
+	int i;
+
+	for (i = 0 ; i < 8 ; i++)
+		*(d++) = (char)(u.u >> (i * 8));
+	return d;
+}
+
+
+/**
+ * Avro schema fingerprint (CRC-64-AVRO) of 'buf'.
+ */
+static uint64_t avro_fingerprint (const char *buf, size_t len) {
+	static const uint64_t empty = 0xc15d213aa4d7a795llu;
+	static uint64_t table[256];
+	uint64_t fp = empty;
+	size_t i;
+
+	if (!table[1]) {
+		for (i = 0 ; i < 256 ; i++) {
+			uint64_t f = i;
+			int j;
+			for (j = 0 ; j < 8 ; j++)
+				f = (f >> 1) ^ (empty & -(f & 1));
+			table[i] = f;
+		}
+	}
+
+	for (i = 0 ; i < len ; i++)
+		fp = (fp >> 8) ^ table[(fp ^ (uint8_t)buf[i]) & 0xff];
+
+	return fp;
+}
+
+
+/**
+ * Frees an array returned by fmt_field_names()
+ */
+static void fmt_field_names_free (const struct fmt_conf *fconf,
+				  char **names) {
+	int i;
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++)
+		free(names[i]);
+	free(names);
+}
+
+/**
+ * Returns field names for all formatters in 'fconf' sanitized to
+ * the [A-Za-z_][A-Za-z0-9_]* charset shared by Avro and protobuf,
+ * constant strings have a NULL name.
+ * Returns NULL on duplicate field names.
+ * The returned array must be freed with fmt_field_names_free().
+ */
+static char **fmt_field_names (const struct fmt_conf *fconf,
+			       char *errstr, size_t errstr_size) {
+	char **names;
+	int i, j;
+
+	names = calloc(fconf->fmt_cnt, sizeof(*names));
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const struct fmt *fmt = &fconf->fmt[i];
+		char *name;
+		int nlen = fmt->name ? fmt->namelen : 1;
+
+		if (fmt->id == 0)
+			continue;
+
+		name = names[i] = malloc(nlen + 2);
+		if (fmt->name)
+			memcpy(name, fmt->name, nlen);
+		else
+			name[0] = (char)fmt->id;
+		name[nlen] = '\0';
+
+		for (j = 0 ; j < nlen ; j++)
+			if (!isalnum((int)name[j]) && name[j] != '_')
+				name[j] = '_';
+		if (isdigit((int)name[0])) {
+			memmove(name+1, name, nlen+1);
+			name[0] = '_';
+		}
+
+		for (j = 0 ; j < i ; j++) {
+			if (names[j] && !strcmp(names[j], name)) {
+				snprintf(errstr, errstr_size,
+					 "Duplicate field name \"%s\": "
+					 "use %%{@name}X to name fields",
+					 name);
+				fmt_field_names_free(fconf, names);
+				return NULL;
+			}
+		}
+	}
+
+	return names;
+}
+
+
+/**
+ * Derive an Avro record schema from the formatters in 'fconf'.
+ * The schema is emitted in Parsing Canonical Form so that its
+ * fingerprint can be calculated directly.
+ *
+ * !num fields are encoded as the union ["null","long","double"],
+ * all other fields as "string".
+ */
+static int avro_schema_build (struct fmt_conf *fconf,
+			      char *errstr, size_t errstr_size) {
+	size_t size = 128;
+	size_t of = 0;
+	char *schema;
+	char **names;
+	int i;
+
+	if (!(names = fmt_field_names(fconf, errstr, errstr_size)))
+		return -1;
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++)
+		size += 64 + fconf->fmt[i].namelen;
+
+	schema = malloc(size);
+
+	of += snprintf(schema+of, size-of,
+		       "{\"name\":\"varnishkafka\",\"type\":\"record\","
+		       "\"fields\":[");
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		if (!names[i])
+			continue;
+
+		of += snprintf(schema+of, size-of,
+			       "%s{\"name\":\"%s\",\"type\":%s}",
+			       schema[of-1] == '}' ? "," : "",
+			       names[i],
+			       fconf->fmt[i].type == FMT_TYPE_NUMBER ?
+			       "[\"null\",\"long\",\"double\"]" :
+			       "\"string\"");
+	}
+
+	of += snprintf(schema+of, size-of, "]}");
+
+	fconf->schema    = schema;
+	fconf->schema_fp = avro_fingerprint(schema, of);
+
+	fmt_field_names_free(fconf, names);
+
+	return 0;
+}
+
+
+/**
+ * Protobuf wire format helpers.
+ */
+#define PB_WIRE_VARINT  0
+#define PB_WIRE_FIXED64 1
+#define PB_WIRE_LEN     2
+#define PB_VARINT_MAX   10
+
+static inline int pb_varint_len (uint64_t v) {
+	int len = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		len++;
+	}
+	return len;
+}
+
+static inline char *pb_put_varint (char *d, uint64_t v) {
+	while (v >= 0x80) {
+		*(d++) = (char)((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	*(d++) = (char)v;
+	return d;
+}
+
+static inline char *pb_put_double (char *d, double v) {
+	union { double d; uint64_t u; } u = { .d = v };
+	int i;
+
+	/* Little endian */
+	for (i = 0 ; i < 8 ; i++)
+		*(d++) = (char)(u.u >> (i * 8));
+	return d;
+}
+
+
+/**
+ * Assign protobuf field numbers, pre-encode the field tags and
+ * derive a .proto message definition from the formatters in 'fconf'.
+ * Fields without an explicit "@NAME#N" field number are numbered
+ * by their position among the fields in the format.
+ *
+ * !num fields are doubles (fixed64) so that both integer and
+ * fractional values (e.g. time_firstbyte) are kept, all other fields
+ * are strings.
+ */
+static int protobuf_schema_build (struct fmt_conf *fconf,
+				  char *errstr, size_t errstr_size) {
+	size_t size = 256;
+	size_t of = 0;
+	char **names;
+	char *schema;
+	int fieldnum = 0;
+	int i, j;
+
+	if (!(names = fmt_field_names(fconf, errstr, errstr_size)))
+		return -1;
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		struct fmt *fmt = &fconf->fmt[i];
+
+		if (fmt->id == 0)
+			continue;
+
+		fieldnum++;
+		if (!fmt->fieldnum)
+			fmt->fieldnum = fieldnum;
+
+		size += 64 + strlen(names[i]);
+	}
+
+	/* Check for field number collisions */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		if (!fconf->fmt[i].fieldnum)
+			continue;
+		for (j = 0 ; j < i ; j++) {
+			if (fconf->fmt[j].fieldnum != fconf->fmt[i].fieldnum)
+				continue;
+			snprintf(errstr, errstr_size,
+				 "Protobuf field number %i used by both "
+				 "\"%s\" and \"%s\": use %%{@name#N}X to "
+				 "number fields",
+				 fconf->fmt[i].fieldnum, names[j], names[i]);
+			fmt_field_names_free(fconf, names);
+			return -1;
+		}
+	}
+
+	schema = malloc(size);
+	of += snprintf(schema+of, size-of,
+		       "syntax = \"proto3\";\n\n"
+		       "message VarnishKafka {\n");
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		struct fmt *fmt = &fconf->fmt[i];
+		int wire = fmt->type == FMT_TYPE_NUMBER ?
+			PB_WIRE_FIXED64 : PB_WIRE_LEN;
+		char *d;
+
+		if (fmt->id == 0)
+			continue;
+
+		/* Pre-encode field tag */
+		d = malloc(PB_VARINT_MAX);
+		fmt->encname = d;
+		fmt->encnamelen = (int)(pb_put_varint(d, ((uint64_t)
+							  fmt->fieldnum << 3) |
+						      wire) - d);
+
+		of += snprintf(schema+of, size-of, "  %s %s = %i;\n",
+			       fmt->type == FMT_TYPE_NUMBER ?
+			       "double" : "string",
+			       names[i], fmt->fieldnum);
+	}
+
+	of += snprintf(schema+of, size-of, "}\n");
+
+	fconf->schema = schema;
+
+	fmt_field_names_free(fconf, names);
+
+	return 0;
+}
+
+
+/**
+ * Log derived schemas and write them to their configured files:
+ *  Avro:     conf.avro_schema_file
+ *  protobuf: conf.proto_file
+ * The key schema (if any) is written to "<file>.key".
+ */
+static int schema_write (char *errstr, size_t errstr_size) {
+	int i;
+
+	for (i = 0 ; i < FMT_CONF_NUM ; i++) {
+		const struct fmt_conf *fconf = &conf.fconf[i];
+		const char *file, *suffix;
+		char path[1024];
+		FILE *fp;
+
+		if (!fconf->schema)
+			continue;
+
+		if (fconf->encoding == VK_ENC_AVRO) {
+			vk_log("AVRO", LOG_INFO,
+			       "%s Avro schema (fingerprint 0x%016"PRIx64"): "
+			       "%s",
+			       fmt_conf_names[i], fconf->schema_fp,
+			       fconf->schema);
+			file = conf.avro_schema_file;
+		} else {
+			_DBG("%s protobuf message definition:\n%s",
+			     fmt_conf_names[i], fconf->schema);
+			file = conf.proto_file;
+		}
+
+		if (!file)
+			continue;
+
+		suffix = i == FMT_CONF_KEY ? ".key" : "";
+		if (snprintf(path, sizeof(path), "%s%s",
+			     file, suffix) >= (int)sizeof(path)) {
+			snprintf(errstr, errstr_size,
+				 "Schema file path too long: %s%s",
+				 file, suffix);
+			return -1;
+		}
+
+		if (!(fp = fopen(path, "w"))) {
+			snprintf(errstr, errstr_size,
+				 "Failed to open %s%s: %s",
+				 file, suffix, strerror(errno));
+			return -1;
+		}
+
+		fprintf(fp, "%s\n", fconf->schema);
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Parse the format string and build a parsing array.
+ */
+static int format_parse (struct fmt_conf *fconf, const char *format_orig,
+			 char *errstr, size_t errstr_size) {
+	/**
+	 * Maps a formatter %X to a VSL tag and column id, or parser, or both
+	 */
+	struct {
+		/* A formatter may be backed by multiple tags.
+		 * The first matching tag observed in the log will be used. */
+		struct {
+			/* VSL_S_CLIENT or VSL_S_BACKEND, or both */
+			int spec;
+			/* The SLT_.. tag id */
+			int tag;
+			/* For "Name: Value" tags (such as SLT_RxHeader),
+			 * this is the "Name" part. */
+			const char *var;
+			/* Special handling for non-name-value vars such as
+			 * %{Varnish:handling}x. fmtvar is "Varnish:handling" */
+			const char *fmtvar; 
+			/* Column to extract:
+			 * 0 for entire string, else 1, 2, .. */
+			int col;
+			/* Parser to manually extract and/or convert a
+			 * tag's content. */
+			int (*parser) (const struct tag *tag,
+				       struct logline *lp,
+				       const char *ptr, int len);
+			/* Optional tag->flags */
+			int tag_flags;
+		} f[7+1]; /* increase size when necessary (max used size + 1) */
+		
+		/* Default string if no matching tag was found or all
+		 * parsers failed, defaults to "-". */
+		const char *def;
+
+	} map[256] = {
+		/* Indexed by formatter character as
+		 * specified by varnishncsa(1) */
+		['b'] = { {
+				{ VSL_S_CLIENT, SLT_Length },
+				{ VSL_S_BACKEND, SLT_RxHeader,
+				  var: "content-length" }
+			} },
+		['H'] = { {
+				{ VSL_S_CLIENT, SLT_RxProtocol },
+				{ VSL_S_BACKEND, SLT_TxProtocol },
+			}, def: "HTTP/1.0" },
+		['h'] = { {
+				{ VSL_S_CLIENT, SLT_ReqStart, col: 1 },
+				{ VSL_S_BACKEND, SLT_BackendOpen,
+				  parser: parse_BackendOpen }
+			} },
+		['i'] = { { 
+				{ VSL_S_CLIENT, SLT_RxHeader },
+				{ VSL_S_BACKEND, SLT_TxHeader },
+			} },
+		['l'] = { {
+				{ VSL_S_CLIENT|VSL_S_BACKEND },
+			}, def: conf.logname },
+		['m'] = { {
+				{ VSL_S_CLIENT, SLT_RxRequest },
+				{ VSL_S_BACKEND, SLT_TxRequest },
+			} },
+		['q'] = { {
+				{ VSL_S_CLIENT, SLT_RxURL, parser: parse_q },
+				{ VSL_S_BACKEND, SLT_TxURL, parser: parse_q },
+			},  def: "" },
+		['o'] = { { 
+				{ VSL_S_CLIENT, SLT_TxHeader },
+				{ VSL_S_BACKEND, SLT_RxHeader },
+			} },
+		['s'] = { {
+				{ VSL_S_CLIENT, SLT_TxStatus },
+				{ VSL_S_BACKEND, SLT_RxStatus },
+			} },
+		['t'] = { {
+				{ VSL_S_CLIENT, SLT_ReqEnd,
+				  parser: parse_t, col: 3,
+				  tag_flags: TAG_F_NOVARMATCH },
+				{ VSL_S_BACKEND, SLT_RxHeader,
+				  var: "date", parser: parse_t,
+				  tag_flags: TAG_F_NOVARMATCH },
+			} },
+		['U'] = { {
+				{ VSL_S_CLIENT, SLT_RxURL, parser: parse_U },
+				{ VSL_S_BACKEND, SLT_TxURL, parser: parse_U },
+			} },
+		['u'] = { {
+				{ VSL_S_CLIENT, SLT_RxHeader,
+				  var: "authorization",
+				  parser: parse_auth_user },
+				{ VSL_S_BACKEND, SLT_TxHeader,
+				  var: "authorization",
+				  parser: parse_auth_user },
+			} },
+		['x'] = { { 
+				{ VSL_S_CLIENT, SLT_ReqEnd,
+				  fmtvar: "Varnish:time_firstbyte", col: 5 },
+				{ VSL_S_CLIENT, SLT_ReqEnd,
+				  fmtvar: "Varnish:xid", col: 1 },
+				{ VSL_S_CLIENT, SLT_VCL_call,
+				  fmtvar: "Varnish:hitmiss",
+				  parser: parse_hitmiss },
+				{ VSL_S_CLIENT, SLT_VCL_call,
+				  fmtvar: "Varnish:handling",
+				  parser: parse_handling },
+				{ VSL_S_CLIENT, SLT_VCL_Log,
+				  fmtvar: "VCL_Log:*" },
+				{ VSL_S_CLIENT, VSL_TAG__ONCE,
+				  fmtvar: "Varnish:sample_rate",
+				  parser: parse_sample_rate },
+				{ VSL_S_CLIENT, VSL_TAG__ONCE,
+				  fmtvar: "Varnish:instance",
+				  parser: parse_instance },
+
+			} },
+		['n'] = { {
+				{ VSL_S_CLIENT|VSL_S_BACKEND, VSL_TAG__ONCE,
+				  parser: parse_seq },
+			} },
+	};
+	/* Replace legacy formatters */
+	static const char *replace[] = {
+		/* "legacy-formatter", "new-formatter(s)" */
+		"%r", "%m http://%{Host?localhost}i%U%q %H",
+		NULL, NULL
+	};
+	const char *s, *t;
+	const char *format;
+	int cnt = 0;
+
+	/* Perform legacy replacements. */
+	format = fconf->format = string_replace_arr(format_orig, replace);
+
+	/* Parse the format string */
+	s = t = format;
+	while (*s) {
+		const char *begin;
+		const char *var = NULL;
+		int varlen = 0;
+		const char *def = NULL;
+		int deflen = -1;
+		const char *name = NULL;
+		int namelen = -1;
+		int fmtid;
+		int i;
+		int flags = 0;
+		int type = FMT_TYPE_STRING;
+		int fieldnum = 0;
+		int spec = VSL_S_CLIENT;
+		int spec_cnt = 0;
+		const char *hp;
+
+		if (*s != '%') {
+			s++;
+			continue;
+		}
+
+		/* ".....%... "
+		 *  ^---^  add this part as verbatim string */
+		if (s > t)
 			if (format_add(fconf, 0,
 				       NULL, 0,
 				       t, (int)(s - t),
 				       0, errstr, errstr_size) == -1)
 				return -1;
 
-		begin = s;
-		s++;
+		begin = s;
+		s++;
+
+		/* Parse '{VAR}X': '*s' will be set to X, and 'var' to VAR.
+		 * varnishkafka also adds the following features:
+		 *
+		 *  VAR?DEF    where DEF is a default value, in this mode
+		 *             VAR can be empty, and {?DEF} may be applied to
+		 *             any formatter.
+		 *             I.e.: %{Content-type?text/html}o
+		 *                   %{?no-user}u
+		 *
+		 *  VAR!OPTION Various formatting options, see below.
+		 *
+		 * Where OPTION is one of:
+		 *  escape     Escape rogue characters in the value.
+		 *             VAR can be empty and {!escape} may be applied to
+		 *             any formatter.
+		 *             I.e. %{User-Agent!escape}i
+		 *                  %{?nouser!escape}u
+		 *  backend    Match the formatter's backend variant
+		 *             (join.backend), formatters match client records
+		 *             by default.
+		 *             I.e. %{@origin_status!backend}s
+		 *
+		 * ?DEF and !OPTIONs can be combined.
+		 */
+		if (*s == '{') {
+			const char *a = s+1;
+			const char *b = strchr(a, '}');
+			const char *q;
+
+			if (!b) {
+				snprintf(errstr, errstr_size,
+					 "Expecting '}' after \"%.*s...\"",
+					 30, begin);
+				return -1;
+			}
+
+			if (a == b) {
+				snprintf(errstr, errstr_size,
+					 "Empty {} identifier at \"%.*s...\"",
+					 30, begin);
+				return -1;
+			}
+
+			if (!*(b+1)) {
+				snprintf(errstr, errstr_size,
+					 "No formatter following "
+					 "identifier at \"%.*s...\"",
+					 30, begin);
+				return -1;
+			}
+
+			var = a;
+
+			/* Check for @NAME, ?DEF and !OPTIONs */
+			if ((q = strnchrs(a, (int)(b-a), "@?!"))) {
+				const char *q2 = q;
+
+				varlen = (int)(q - a);
+				if (varlen == 0)
+					var = NULL;
+
+				/* Scan all ?DEF and !OPTIONs */
+				do {
+					int qlen;
+
+					q++;
+
+					if ((q2 = strnchrs(q, (int)(b-q2-1),
+							   "@?!")))
+						qlen = (int)(q2-q);
+					else
+						qlen = (int)(b-q);
+
+					switch (*(q-1))
+					{
+					case '@':
+						/* Output format field name */
+						name = q;
+						namelen = qlen;
+
+						/* Optional field number:
+						 * "@NAME#N" */
+						if ((hp = strnchr(q, qlen,
+								  '#'))) {
+							namelen = (int)(hp-q);
+							fieldnum = atoi(hp+1);
+							if (fieldnum <= 0 ||
+							    fieldnum >=
+							    (1 << 29)) {
+								snprintf(errstr,
+									 errstr_size,
+									 "Invalid "
+									 "field "
+									 "number at "
+									 "\"%.*s...\"",
+									 30, a);
+								return -1;
+							}
+						}
+						break;
+					case '?':
+						/* Default value */
+						def = q;
+						deflen = qlen;
+						break;
+					case '!':
+						/* Options */
+						if (!strncasecmp(q, "escape",
+								 qlen))
+							flags |= FMT_F_ESCAPE;
+						else if (!strncasecmp(q, "num",
+								      qlen))
+							type = FMT_TYPE_NUMBER;
+						else if (!strncasecmp(q, "backend",
+								      qlen))
+							spec = VSL_S_BACKEND;
+						else {
+							snprintf(errstr,
+								 errstr_size,
+								 "Unknown "
+								 "formatter "
+								 "option "
+								 "\"%.*s\" at "
+								 "\"%.*s...\"",
+								 qlen, q,
+								 30, a);
+							return -1;
+						}
+						break;
+					}
+
+				} while ((q = q2));
+
+			} else
+				varlen = (int)(b-a);			
+
+			s = b+1;
+		}
+
+		if (!map[(int)*s].f[0].spec) {
+			snprintf(errstr, errstr_size,
+				 "Unknown formatter '%c' at \"%.*s...\"",
+				 *s, 30, begin);
+			return -1;
+		}
+
+		if (!def) {
+			if (type == FMT_TYPE_NUMBER)
+				def = "0";
+			else
+				def = map[(int)*s].def;
+		}
+
+		/* Add formatter to ordered list of formatters */
+		if ((fmtid = format_add(fconf, *s, var, varlen,
+					def, deflen, flags,
+					errstr, errstr_size)) == -1)
+			return -1;
+
+		fconf->fmt[fmtid].type = type;
+		fconf->fmt[fmtid].fieldnum = fieldnum;
+
+		if (name) {
+			fconf->fmt[fmtid].name = name;
+			fconf->fmt[fmtid].namelen = namelen;
+		}
+
+		cnt++;
+
+		/* Now add the matched tags specification to the
+		 * list of parse tags */
+		for (i = 0 ; map[(int)*s].f[i].spec ; i++) {
+			if (map[(int)*s].f[i].tag == 0)
+				continue;
+
+			/* Client or backend variant */
+			if (!(map[(int)*s].f[i].spec & spec))
+				continue;
+
+			spec_cnt++;
+
+			/* mapping has fmtvar specified, make sure it 
+			 * matches the format's variable. */
+			if (map[(int)*s].f[i].fmtvar) {
+				const char *iswc;
+
+				if (!var)
+					continue;
+
+				/* Match "xxxx:<key>".
+				 * If format definition's key is wildcarded
+				 * ("*") then use the configured key as var.
+				 * I.e., "%{VCL_Log:hit}x" will put "hit" in
+				 * var since VCL_Log is defined as wildcard:
+				 * "VCL_Log:*". */
+				if ((iswc = strstr(map[(int)*s].f[i].fmtvar,
+						   ":*"))) {
+					/* Wildcard definition */
+					int fvlen = (int)(iswc -
+							  map[(int)*s].
+							  f[i].fmtvar) + 1;
+
+					/* Check that var matches prefix.
+					 * I.e.: "VCL_Log:" cmp "VCL_Log:" */
+					if (varlen <= fvlen ||
+					    strncmp(map[(int)*s].f[i].fmtvar,
+						    var, fvlen))
+						continue;
+
+					/* set format var to "..:<key>" */
+					var = var + fvlen;
+					varlen -= fvlen;
+
+
+				} else {
+					/* Non-wildcard definition.
+					 * Var must match exactly. */
+					if (varlen != strlen(map[(int)*s].
+							     f[i].fmtvar) ||
+					    strncmp(map[(int)*s].f[i].fmtvar,
+						    var, varlen))
+						continue;
+
+					/* fmtvar's resets the format var */
+					var = NULL;
+					varlen = 0;
+				}
+			}
+
+			if (tag_add(fconf, &fconf->fmt[fmtid],
+				    map[(int)*s].f[i].spec,
+				    map[(int)*s].f[i].tag,
+				    var ? var : map[(int)*s].f[i].var,
+				    var ? varlen : -1,
+				    map[(int)*s].f[i].col,
+				    map[(int)*s].f[i].parser,
+				    map[(int)*s].f[i].tag_flags,
+				    errstr, errstr_size) == -1)
+				return -1;
+		}
+
+		if (spec == VSL_S_BACKEND && !spec_cnt) {
+			snprintf(errstr, errstr_size,
+				 "Formatter '%c' has no backend variant "
+				 "at \"%.*s...\"", *s, 30, begin);
+			return -1;
+		}
+
+
+		t = ++s;
+	}
+
+	/* "..%x....."
+	 *      ^---^  add this part as verbatim string */
+	if (s > t)
+		if (format_add(fconf, 0, NULL, 0,
+			       t, (int)(s - t), 0,
+			       errstr, errstr_size) == -1)
+			return -1;
+
+	/* Pre-encode field names for binary encodings. */
+	fconf->field_cnt = cnt;
+	if (fconf->encoding == VK_ENC_MSGPACK)
+		msgpack_names_encode(fconf);
+	else if (fconf->encoding == VK_ENC_AVRO &&
+		 avro_schema_build(fconf, errstr, errstr_size) == -1)
+		return -1;
+	else if (fconf->encoding == VK_ENC_PROTOBUF &&
+		 protobuf_schema_build(fconf, errstr, errstr_size) == -1)
+		return -1;
+
+	/* Dump parsed format string. */
+	if (conf.log_level >= 7)
+		fmt_dump(fconf);
+
+
+	if (fconf->fmt_cnt == 0) {
+		snprintf(errstr, errstr_size,
+			 "%s format string is empty",
+			 fmt_conf_names[fconf->fid]);
+		return -1;
+	} else if (cnt == 0) {
+		snprintf(errstr, errstr_size,
+			 "No %%.. formatters in %s format",
+			 fmt_conf_names[fconf->fid]);
+		return -1;
+	}
+
+	return fconf->fmt_cnt;
+}
+
+
+
+/**
+ * Simple rate limiter used to limit the amount of error syslogs.
+ * Controlled through the "log.rate.max" and "log.rate.period" properties.
+ */
+typedef enum {
+	RL_KAFKA_PRODUCE_ERR,
+	RL_KAFKA_ERROR_CB,
+	RL_KAFKA_DR_ERR,
+	RL_NUM,
+} rl_type_t;
+
+
+static struct rate_limiter {
+	uint64_t total;        /* Total number of events in current period */
+	uint64_t suppressed;   /* Suppressed events in current period */
+	const char *name;      /* Rate limiter log message summary */
+	const char *fac;       /* Log facility */
+	const char *id;        /* Statistics identifier */
+} rate_limiters[RL_NUM] = {
+	[RL_KAFKA_PRODUCE_ERR] = { name: "Kafka produce errors",
+				   fac: "PRODUCE", id: "kafka_produce_err" },
+	[RL_KAFKA_ERROR_CB] = { name: "Kafka errors", fac: "KAFKAERR",
+				id: "kafka_error" },
+	[RL_KAFKA_DR_ERR] = { name: "Kafka message delivery failures",
+			      fac: "KAFKADR", id: "kafka_dr_err" }
+};
+
+static time_t rate_limiter_t_curr; /* Current period */
+
+
+/**
+ * Roll over all rate limiters to a new period.
+ */
+static void rate_limiters_rollover (time_t now) {
+	int i;
+
+	for (i = 0 ; i < RL_NUM ; i++) {
+		struct rate_limiter *rl = &rate_limiters[i];
+		if (rl->suppressed > 0)
+			vk_log(rl->fac, LOG_WARNING,
+			       "Suppressed %"PRIu64" (out of %"PRIu64") %s",
+			       rl->suppressed, rl->total, rl->name);
+		rl->total = 0;
+		rl->suppressed = 0;
+	}
+
+	rate_limiter_t_curr = now;
+}
+
+
+/**
+ * Rate limiter.
+ * Returns 1 if the threshold has been reached (DROP), or 0 if not (PASS)
+ */
+static inline int rate_limit (rl_type_t type) {
+	struct rate_limiter *rl = &rate_limiters[type];
+
+	if (++rl->total > conf.log_rate) {
+		rl->suppressed++;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Returns the total number of messages in all producers' out queues.
+ */
+static int kafka_outq_len (void) {
+	int len = 0;
+	int i;
+
+	if (!rks)
+		return 0;
+
+	for (i = 0 ; i < conf.producers ; i++)
+		len += rd_kafka_outq_len(rks[i]);
+
+	return len;
+}
+
+/**
+ * Serve delivery reports and callbacks of all producers,
+ * waiting at most 'timeout_ms' for the first producer.
+ */
+static void kafka_poll (int timeout_ms) {
+	int i;
+
+	for (i = 0 ; i < conf.producers ; i++)
+		rd_kafka_poll(rks[i], i == 0 ? timeout_ms : 0);
+}
+
+/**
+ * Sum the key librdkafka statistics of all producers into 'kt'.
+ */
+static void kafka_stats_total (struct kafka_stats *kt) {
+	int i;
+
+	memset(kt, 0, sizeof(*kt));
+
+	if (!kstats)
+		return;
+
+	for (i = 0 ; i < conf.producers ; i++) {
+		kt->replyq   += kstats[i].replyq;
+		kt->msg_cnt  += kstats[i].msg_cnt;
+		kt->msg_size += kstats[i].msg_size;
+		kt->msg_max  += kstats[i].msg_max;
+	}
+}
+
+
+/**
+ * Replace characters not valid in metric names (such as in topic names)
+ * with '_'.
+ */
+static void stats_name_sanitize (char *name) {
+	for ( ; *name ; name++)
+		if (!isalnum((int)*name) && *name != '_')
+			*name = '_';
+}
+
+
+/**
+ * Format the counter name into 'name' of 'size' bytes.
+ * Names that do not fit (such as long topic names) are cut short and
+ * suffixed with a hash of the full name to keep them unique.
+ */
+static void stats_name_set (char *name, size_t size, const char *fmt, ...) {
+	char full[512];
+	unsigned int h = 5381;
+	const char *s;
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(full, sizeof(full), fmt, ap);
+	va_end(ap);
+
+	if (r < (int)size) {
+		memcpy(name, full, r+1);
+	} else {
+		for (s = full ; *s ; s++)
+			h = (h * 33) ^ (unsigned char)*s;
+		snprintf(name, size, "%.*s_%08x", (int)size - 10, full, h);
+	}
+
+	stats_name_sanitize(name);
+}
+
+/**
+ * Warn about counters in 'cnts' sharing the same name.
+ */
+static void stats_name_collisions (const struct vk_shm_cnt *cnts, int cnt) {
+	int i, j;
+
+	for (i = 0 ; i < cnt ; i++)
+		for (j = i + 1 ; j < cnt ; j++)
+			if (!strcmp(cnts[i].name, cnts[j].name))
+				vk_log("STATS", LOG_WARNING,
+				       "Counters #%i and #%i share the name "
+				       "\"%s\": values will be ambiguous",
+				       i, j, cnts[i].name);
+}
+
+
+/* Topics in the statistics segment: topics added by a reload
+ * are only reported in the JSON statistics. */
+static int stats_topic_cnt;
+
+/**
+ * Collects all counters and gauges into 'cnts', or just counts them
+ * if 'cnts' is NULL.
+ * The set of counters must not change during the lifetime of
+ * the statistics segment.
+ *
+ * Returns the number of counters.
+ */
+static int stats_collect (struct vk_shm_cnt *cnts) {
+	struct loglines_stats ls = {};
+	struct kafka_stats kt = {};
+	int named = 0;
+	int n = 0;
+	int i;
+
+#define _ST(TYPE,VAL,NAME...) do {					\
+		if (cnts) {						\
+			if (!cnts[n].name[0]) {				\
+				stats_name_set(cnts[n].name,		\
+					       sizeof(cnts[n].name), NAME); \
+				named = 1;				\
+			}						\
+			cnts[n].type = TYPE;				\
+			cnts[n].val  = (uint64_t)(VAL);			\
+		}							\
+		n++;							\
+	} while (0)
+
+	if (cnts) {
+		loglines_stats(&ls, time(NULL));
+		kafka_stats_total(&kt);
+	}
+
+	_ST(VK_SHM_T_COUNTER, cnt.tx, "tx");
+	_ST(VK_SHM_T_COUNTER, cnt.txerr, "txerr");
+	_ST(VK_SHM_T_COUNTER, cnt.kafka_drerr, "kafka_drerr");
+	_ST(VK_SHM_T_COUNTER, cnt.trunc, "trunc");
+	_ST(VK_SHM_T_COUNTER, cnt.vsl_records, "vsl_records");
+	_ST(VK_SHM_T_COUNTER, cnt.vsl_skipped, "vsl_skipped");
+	_ST(VK_SHM_T_COUNTER, cnt.shard_skipped, "shard_skipped");
+	_ST(VK_SHM_T_COUNTER, cnt.vsl_wraps, "vsl_wraps");
+	_ST(VK_SHM_T_COUNTER, cnt.vsl_recopy, "vsl_recopy");
+	_ST(VK_SHM_T_COUNTER, cnt.vsl_overrun, "vsl_overrun");
+	_ST(VK_SHM_T_COUNTER, cnt.join_matched, "join_matched");
+	_ST(VK_SHM_T_COUNTER, cnt.join_missed, "join_missed");
+	_ST(VK_SHM_T_COUNTER, cnt.join_evicted, "join_evicted");
+	_ST(VK_SHM_T_COUNTER, cnt.capture_tx, "capture_tx");
+	_ST(VK_SHM_T_COUNTER, cnt.capture_trunc, "capture_trunc");
+	_ST(VK_SHM_T_COUNTER, cnt.capture_err, "capture_err");
+	_ST(VK_SHM_T_COUNTER, cnt.log_dropped, "log_dropped");
+	_ST(VK_SHM_T_COUNTER, cnt.reload, "reload");
+	_ST(VK_SHM_T_COUNTER, cnt.reload_err, "reload_err");
+	_ST(VK_SHM_T_COUNTER, cnt.reload_dropped, "reload_dropped");
+	_ST(VK_SHM_T_GAUGE, placement.cpu, "cpu");
+	_ST(VK_SHM_T_GAUGE, placement.node, "numa_node");
+	_ST(VK_SHM_T_COUNTER, cnt.scratch_toosmall, "scratch_toosmall");
+	_ST(VK_SHM_T_COUNTER, cnt.scratch_tmpbufs, "scratch_tmpbufs");
+	_ST(VK_SHM_T_COUNTER, cnt.scratch_tmpbuf_reuse, "scratch_tmpbuf_reuse");
+	_ST(VK_SHM_T_COUNTER, cnt.scratch_resize, "scratch_resize");
+	_ST(VK_SHM_T_GAUGE, conf.scratch_size, "scratch_size");
+	_ST(VK_SHM_T_COUNTER, cnt.kafka_tx, "kafka_tx");
+	_ST(VK_SHM_T_COUNTER, cnt.kafka_records, "kafka_records");
+	_ST(VK_SHM_T_COUNTER, cnt.batch_flush_cnt, "batch_flush_cnt");
+	_ST(VK_SHM_T_COUNTER, cnt.batch_flush_bytes, "batch_flush_bytes");
+	_ST(VK_SHM_T_COUNTER, cnt.batch_flush_age, "batch_flush_age");
+	_ST(VK_SHM_T_COUNTER, cnt.batch_flush_key, "batch_flush_key");
+	_ST(VK_SHM_T_COUNTER, cnt.batch_flush_topic, "batch_flush_topic");
+	for (i = 0 ; i < VK_PRIO_NUM ; i++) {
+		_ST(VK_SHM_T_COUNTER, prio_cnt[i].tx,
+		    "priority_%s_tx", prio_names[i]);
+		_ST(VK_SHM_T_COUNTER, prio_cnt[i].drop,
+		    "priority_%s_drop", prio_names[i]);
+	}
+	for (i = 0 ; i < stats_topic_cnt ; i++) {
+		_ST(VK_SHM_T_COUNTER, topics[i]->tx,
+		    "topic_%s_tx", topics[i]->name);
+		_ST(VK_SHM_T_COUNTER, topics[i]->txerr,
+		    "topic_%s_txerr", topics[i]->name);
+	}
+	_ST(VK_SHM_T_GAUGE, logline_cnt, "lp_curr");
+	_ST(VK_SHM_T_GAUGE, conf.sequence_number, "seq");
+	_ST(VK_SHM_T_GAUGE, gov.usage, "cpu_usage_percent");
+	_ST(VK_SHM_T_GAUGE, gov.rate, "sample_rate");
+	_ST(VK_SHM_T_COUNTER, gov.sampled_out, "sampled_out");
+	_ST(VK_SHM_T_GAUGE, kafka_outq_len(), "kafka_outq");
+	_ST(VK_SHM_T_GAUGE, kt.replyq, "kafka_replyq");
+	_ST(VK_SHM_T_GAUGE, kt.msg_cnt, "kafka_msg_cnt");
+	_ST(VK_SHM_T_GAUGE, kt.msg_size, "kafka_msg_size");
+	_ST(VK_SHM_T_GAUGE, kt.msg_max, "kafka_msg_max");
+	_ST(VK_SHM_T_GAUGE, inflight.total, "kafka_inflight");
+	_ST(VK_SHM_T_GAUGE, inflight_oldest_age(),
+	    "kafka_inflight_oldest_age_seconds");
+
+	_ST(VK_SHM_T_COUNTER, ls.hit, "logline_hit");
+	_ST(VK_SHM_T_COUNTER, ls.miss, "logline_miss");
+	_ST(VK_SHM_T_COUNTER, ls.purge, "logline_purge");
+	_ST(VK_SHM_T_GAUGE, logline_inflight, "logline_inflight");
+	_ST(VK_SHM_T_GAUGE, ls.oldest_age, "logline_oldest_age_seconds");
+	_ST(VK_SHM_T_GAUGE, ls.scratch_bytes, "logline_scratch_bytes");
+	_ST(VK_SHM_T_GAUGE, tmpbuf_bytes, "logline_tmpbuf_bytes");
+	_ST(VK_SHM_T_GAUGE, tmpbuf_pool_bytes, "logline_tmpbuf_pool_bytes");
+	for (i = 0 ; i < CHAIN_HIST_MAX ; i++)
+		_ST(VK_SHM_T_GAUGE, ls.chain[i], "logline_chain_len_%i%s",
+		    i, i == CHAIN_HIST_MAX-1 ? "_plus" : "");
+
+	for (i = 0 ; i < RL_NUM ; i++) {
+		_ST(VK_SHM_T_GAUGE, rate_limiters[i].total,
+		    "ratelimit_%s_total", rate_limiters[i].id);
+		_ST(VK_SHM_T_GAUGE, rate_limiters[i].suppressed,
+		    "ratelimit_%s_suppressed", rate_limiters[i].id);
+	}
+
+#undef _ST
+
+	if (named)
+		stats_name_collisions(cnts, n);
+
+	return n;
+}
+
+
+/**
+ * Create the statistics shared memory segment, if configured.
+ * The metrics listener uses the segment as its lock-free snapshot source,
+ * so an anonymous segment is created for it if no shm file is configured.
+ */
+static int stats_shm_init (char *errstr, size_t errstr_size) {
+	if (!conf.stats_shm_path && !conf.metrics_listen)
+		return 0;
+
+	stats_topic_cnt = topic_cnt;
+
+	if (!(conf.stats_shm = vk_shm_create(conf.stats_shm_path,
+					     stats_collect(NULL),
+					     conf.loglines_hsize,
+					     HIST_NUM,
+					     errstr, errstr_size)))
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * Publish current counters to the statistics shared memory segment.
+ */
+static void stats_shm_update (time_t now) {
+	struct vk_shm_hdr *hdr = conf.stats_shm;
+	struct vk_shm_bucket *b;
+	int i;
+
+	placement_get();
+
+	vk_shm_write_begin(hdr);
+
+	stats_collect(VK_SHM_CNTS(hdr));
+
+	b = VK_SHM_BUCKETS(hdr);
+	for (i = 0 ; i < conf.loglines_hsize ; i++) {
+		b[i].hit   = loglines[i].hit;
+		b[i].miss  = loglines[i].miss;
+		b[i].purge = loglines[i].purge;
+		b[i].cnt   = loglines[i].cnt;
+	}
+
+	memcpy(VK_SHM_HISTS(hdr), hists, sizeof(hists));
+
+	hdr->t_update = now;
+
+	vk_shm_write_end(hdr);
+
+	conf.t_last_shm = now;
+}
+
+
+/**
+ * Render selector format 'fconf' of logline 'lp' as a string.
+ * Single formatter selectors are returned without copying, else
+ * the formatters are concatenated into 'buf' of 'size' bytes.
+ *
+ * Returns a pointer to the value and its length in '*lenp'.
+ */
+static const char *sel_render (const struct fmt_conf *fconf,
+			       const struct logline *lp,
+			       char *buf, int size, int *lenp) {
+	int of = 0;
+	int i;
+
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const char *ptr;
+		int len = lp->match[fconf->fid][i].len;
+
+		if (len) {
+			ptr = lp->match[fconf->fid][i].ptr;
+		} else {
+			ptr = fconf->fmt[i].def;
+			len = fconf->fmt[i].deflen;
+		}
+
+		if (fconf->fmt_cnt == 1) {
+			*lenp = len;
+			return ptr;
+		}
+
+		if (of + len > size)
+			len = size - of;
+
+		memcpy(buf+of, ptr, len);
+		of += len;
+	}
+
+	*lenp = of;
+	return buf;
+}
+
+
+/**
+ * Returns the value map hash bucket for 'value' of 'len' bytes.
+ */
+static inline unsigned int valmap_hkey (const char *value, int len) {
+	unsigned int h = 5381;
+
+	while (len-- > 0)
+		h = (h * 33) ^ (unsigned char)*(value++);
+
+	return h % VALMAP_HSIZE;
+}
+
+/**
+ * Returns the exact (prefix == 0) or prefix rule for 'value' in 'map',
+ * or NULL if there is none.
+ */
+static inline const struct vk_route *valmap_find (const struct valmap *map,
+						  const char *value, int len,
+						  int prefix) {
+	const struct vk_route *route;
+
+	for (route = map->hash[valmap_hkey(value, len)] ; route ;
+	     route = route->hnext)
+		if (route->len == len && route->prefix == prefix &&
+		    !memcmp(route->value, value, len))
+			return route;
+
+	return NULL;
+}
+
+/**
+ * Returns the rule in 'map' matching 'value', or NULL if none does.
+ * Exact rules are tried first, then prefix rules from the longest
+ * prefix to the shortest.
+ */
+static const struct vk_route *valmap_lookup (const struct valmap *map,
+					     const char *value, int len) {
+	const struct vk_route *route;
+	int i;
+
+	if ((route = valmap_find(map, value, len, 0)))
+		return route;
+
+	for (i = 0 ; i < map->prefix_cnt ; i++)
+		if (map->prefix_lens[i] <= len &&
+		    (route = valmap_find(map, value, map->prefix_lens[i], 1)))
+			return route;
+
+	return NULL;
+}
+
+/**
+ * Add rule 'route' to 'map'.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int valmap_add (struct valmap *map, struct vk_route *route,
+		       char *errstr, size_t errstr_size) {
+	unsigned int hkey = valmap_hkey(route->value, route->len);
+	int i;
+
+	if (valmap_find(map, route->value, route->len, route->prefix)) {
+		snprintf(errstr, errstr_size,
+			 "Duplicate rule for \"%s%s\"",
+			 route->value, route->prefix ? "*" : "");
+		return -1;
+	}
+
+	route->hnext = map->hash[hkey];
+	map->hash[hkey] = route;
+
+	if (!route->prefix)
+		return 0;
+
+	/* Maintain descending list of distinct prefix lengths */
+	for (i = 0 ; i < map->prefix_cnt ; i++)
+		if (map->prefix_lens[i] <= route->len)
+			break;
+
+	if (i < map->prefix_cnt && map->prefix_lens[i] == route->len)
+		return 0;
+
+	if (map->prefix_cnt == VALMAP_PREFIX_MAX) {
+		snprintf(errstr, errstr_size,
+			 "Too many distinct rule prefix lengths (max %i)",
+			 VALMAP_PREFIX_MAX);
+		return -1;
+	}
+
+	memmove(&map->prefix_lens[i+1], &map->prefix_lens[i],
+		(map->prefix_cnt - i) * sizeof(*map->prefix_lens));
+	map->prefix_lens[i] = route->len;
+	map->prefix_cnt++;
+
+	return 0;
+}
+
+
+/**
+ * Returns the destination topic for logline 'lp'.
+ */
+static struct vk_topic *topic_route (const struct logline *lp) {
+	const struct vk_route *route;
+	const char *value;
+	char buf[256];
+	int len;
+
+	int old = lp->gen != conf.gen;
+
+	/* Selector tags are not matched in passthrough mode */
+	if (!(old ? gen_old.route_cnt : conf.route_cnt) || conf.passthrough)
+		return topics[0];
+
+	value = sel_render(&logline_fconf(lp)[FMT_CONF_ROUTE], lp,
+			   buf, sizeof(buf), &len);
+
+	if ((route = valmap_lookup(old ? &gen_old.topic_routes : &topic_routes,
+				   value, len)))
+		return topics[route->idx];
+
+	return topics[0];
+}
+
+
+/**
+ * Returns the topics[] index of topic 'name', adding it if necessary.
+ */
+static int topic_add (const char *name) {
+	int i;
+
+	for (i = 0 ; i < topic_cnt ; i++)
+		if (!strcmp(topics[i]->name, name))
+			return i;
+
+	topics = realloc(topics, sizeof(*topics) * (topic_cnt + 1));
+	topics[topic_cnt] = calloc(1, sizeof(**topics));
+	topics[topic_cnt]->name = strdup(name);
+
+	return topic_cnt++;
+}
+
+
+/**
+ * Set up the default topic and compile the topic routing rules.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int routes_init (char *errstr, size_t errstr_size) {
+	struct vk_route *route;
+	char tmp[256];
+	int i;
+
+	topic_add(conf.topic);
+
+	if (conf.route_cnt && !conf.format[FMT_CONF_ROUTE]) {
+		snprintf(errstr, errstr_size,
+			 "topic.route.<value> rules require a "
+			 "topic.route selector format");
+		return -1;
+	}
+
+	for (route = conf.routes ; route ; route = route->next) {
+		route->idx = topic_add(route->target);
+		if (valmap_add(&topic_routes, route, tmp, sizeof(tmp)) == -1) {
+			snprintf(errstr, errstr_size, "topic.route: %s", tmp);
+			return -1;
+		}
+	}
+
+	for (i = 0 ; i < topic_cnt ; i++)
+		_DBG("Topic #%i: %s", i, topics[i]->name);
+
+	return 0;
+}
+
+
+/**
+ * Compile the priority class rules.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int prio_init (char *errstr, size_t errstr_size) {
+	struct vk_route *route;
+	char tmp[256];
+
+	if (conf.prio_rule_cnt && !conf.format[FMT_CONF_PRIO]) {
+		snprintf(errstr, errstr_size,
+			 "priority.match.<value> rules require a "
+			 "priority selector format");
+		return -1;
+	}
+
+	for (route = conf.prio_rules ; route ; route = route->next) {
+		for (route->idx = 0 ; route->idx < VK_PRIO_NUM ; route->idx++)
+			if (!strcmp(route->target, prio_names[route->idx]))
+				break;
+
+		if (route->idx == VK_PRIO_NUM) {
+			snprintf(errstr, errstr_size,
+				 "priority.match.%s%s: unknown priority "
+				 "class \"%s\": try \"high\" or \"normal\"",
+				 route->value, route->prefix ? "*" : "",
+				 route->target);
+			return -1;
+		}
+
+		if (valmap_add(&prio_rules, route, tmp, sizeof(tmp)) == -1) {
+			snprintf(errstr, errstr_size, "priority: %s", tmp);
+			return -1;
+		}
+	}
+
+	/* Out queue limit for normal priority messages */
+	prio_normal_outq_max = (int)(((uint64_t)conf.kafka_queue_max *
+				      conf.producers *
+				      (100 - conf.prio_high_reserve)) / 100);
+
+	return 0;
+}
+
+
+/**
+ * Parse the configured formats into the current (empty) generation and
+ * compile its topic routing and priority class rules.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int formats_init (char *errstr, size_t errstr_size) {
+	char tmp[512];
+	int i;
+
+	/* Space is the most common format separator so add it first
+	 * the the const string, followed by the typical default value "-". */
+	const_string_add(" -", 2);
+
+	/* Allocate room for format tag buckets. */
+	conf.tag = calloc(VSL_TAGS_MAX, sizeof(*conf.tag));
+
+	/* Parse the format strings */
+	for (i = 0 ; i < FMT_CONF_NUM ; i++) {
+		if (!conf.format[i])
+			continue;
+
+		if (format_parse(&conf.fconf[i], conf.format[i],
+				 tmp, sizeof(tmp)) == -1) {
+			snprintf(errstr, errstr_size,
+				 "Failed to parse %s format string: %s\n%s",
+				 fmt_conf_names[i], conf.format[i], tmp);
+			return -1;
+		}
+
+		conf.fconf_cnt++;
+		conf.total_fmt_cnt += conf.fconf[i].fmt_cnt;
+	}
+
+	if (conf.fconf_cnt == 0) {
+		snprintf(errstr, errstr_size, "No formats defined");
+		return -1;
+	}
+
+	/* Compile topic routing rules */
+	if (routes_init(errstr, errstr_size) == -1)
+		return -1;
+
+	/* Compile priority class rules */
+	if (prio_init(errstr, errstr_size) == -1)
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * Returns the priority class of logline 'lp'.
+ */
+static inline int prio_get (const struct logline *lp) {
+	const struct vk_route *route;
+	const char *value;
+	char buf[256];
+	int len;
+
+	int old = lp->gen != conf.gen;
+
+	/* Selector tags are not matched in passthrough mode */
+	if (!(old ? gen_old.prio_rule_cnt : conf.prio_rule_cnt) ||
+	    conf.passthrough)
+		return VK_PRIO_NORMAL;
+
+	value = sel_render(&logline_fconf(lp)[FMT_CONF_PRIO], lp,
+			   buf, sizeof(buf), &len);
+
+	if ((route = valmap_lookup(old ? &gen_old.prio_map : &prio_rules,
+				   value, len)))
+		return route->idx;
+
+	return VK_PRIO_NORMAL;
+}
+
+
+/**
+ * Account an enqueued message for 'partition' of 'topic'.
+ */
+static inline void partition_enq_add (struct vk_topic *topic,
+				      int32_t partition) {
+	if (unlikely(partition < 0))
+		return;
+
+	if (unlikely(partition >= topic->part_max))
+		topic->part_max = partition < VK_TOPIC_PARTITIONS_MAX ?
+			partition + 1 : VK_TOPIC_PARTITIONS_MAX;
+
+	topic->part_enq[partition < VK_TOPIC_PARTITIONS_MAX ?
+			partition : VK_TOPIC_PARTITIONS_MAX-1]++;
+}
+
+
+/**
+ * Sticky and roundrobin partitioners: all messages go to the current
+ * partition until kafka.partitioner.batch.messages messages have been
+ * sent to it or kafka.partitioner.batch.ms has passed, after which
+ * a new available partition is picked: at random (sticky) or the next
+ * one (roundrobin).
+ * This makes librdkafka's per-partition batches fill up faster, improving
+ * compression and reducing the number of produce requests.
+ */
+static int32_t partitioner_sticky (struct vk_topic_inst *topic,
+				   const rd_kafka_topic_t *rkt,
+				   int32_t partition_cnt) {
+	uint64_t now = vk_clock_us();
+	int32_t p;
+	int i;
+
+	if (likely(topic->part_curr != -1 &&
+		   topic->part_curr < partition_cnt &&
+		   topic->part_msgs < conf.part_batch_msgs &&
+		   now - topic->t_part < (uint64_t)conf.part_batch_ms * 1000 &&
+		   rd_kafka_topic_partition_available(rkt, topic->part_curr))) {
+		topic->part_msgs++;
+		return topic->part_curr;
+	}
+
+	if (conf.partitioner == VK_PART_ROUNDROBIN && topic->part_curr != -1)
+		p = (topic->part_curr + 1) % partition_cnt;
+	else
+		p = rand() % partition_cnt;
+
+	/* Pick the first available partition from 'p' and on */
+	for (i = 0 ; i < partition_cnt ; i++) {
+		if (rd_kafka_topic_partition_available(rkt,
+						       (p + i) % partition_cnt))
+			break;
+	}
+	p = (p + (i < partition_cnt ? i : 0)) % partition_cnt;
+
+	topic->part_curr = p;
+	topic->part_msgs = 1;
+	topic->t_part    = now;
+
+	return p;
+}
+
+
+/**
+ * Kafka partitioner callback, see kafka.partitioner.
+ * NOTE: Messages produced before the topic's metadata is known are
+ *       partitioned later from a librdkafka thread, the partitioner
+ *       state is not protected against that since it only affects
+ *       the distribution of those first messages.
+ */
+static int32_t kafka_partitioner (const rd_kafka_topic_t *rkt,
+				  const void *key, size_t keylen,
+				  int32_t partition_cnt,
+				  void *rkt_opaque, void *msg_opaque) {
+	struct vk_topic_inst *inst = rkt_opaque;
+	int32_t p;
+
+	switch (conf.partitioner)
+	{
+	case VK_PART_HASH:
+		if (keylen) {
+			p = crc32(0, key, keylen) % partition_cnt;
+			break;
+		}
+		/* Messages without a key are partitioned randomly */
+		/* FALLTHRU */
+	default:
+	case VK_PART_RANDOM:
+		p = rd_kafka_msg_partitioner_random(rkt, key, keylen,
+						    partition_cnt,
+						    rkt_opaque, msg_opaque);
+		break;
+	case VK_PART_STICKY:
+	case VK_PART_ROUNDROBIN:
+		p = partitioner_sticky(inst, rkt, partition_cnt);
+		break;
+	}
+
+	partition_enq_add(inst->topic, p);
+
+	return p;
+}
+
+
+/**
+ * Create Kafka topic handles on all producers for all topics that do
+ * not have them yet: all topics at startup, topics added by new routing
+ * rules on reload.
+ *
+ * Returns 0 on success or -1 on error.
+ */
+static int topics_start (char *errstr, size_t errstr_size) {
+	int i, j;
+
+	for (i = 0 ; i < topic_cnt ; i++) {
+		if (topics[i]->inst)
+			continue;
+
+		topics[i]->inst = calloc(conf.producers,
+					sizeof(*topics[i]->inst));
+
+		for (j = 0 ; j < conf.producers ; j++) {
+			struct vk_topic_inst *inst = &topics[i]->inst[j];
+			rd_kafka_topic_conf_t *topic_conf;
+
+			inst->topic = topics[i];
+			inst->part_curr = -1;
+
+			topic_conf = rd_kafka_topic_conf_dup(conf.topic_conf);
+			rd_kafka_topic_conf_set_opaque(topic_conf, inst);
+			rd_kafka_topic_conf_set_partitioner_cb(topic_conf,
+							       kafka_partitioner);
+
+			if (!(inst->rkt = rd_kafka_topic_new(rks[j],
+							     topics[i]->name,
+							     topic_conf))) {
+				snprintf(errstr, errstr_size, "%s: %s",
+					 topics[i]->name, strerror(errno));
+				while (j-- > 0)
+					rd_kafka_topic_destroy(topics[i]->
+							       inst[j].rkt);
+				free(topics[i]->inst);
+				topics[i]->inst = NULL;
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Destroy all topic handles.
+ */
+static void topics_stop (void) {
+	int i, j;
+
+	for (i = 0 ; i < topic_cnt ; i++) {
+		if (!topics[i]->inst)
+			continue;
+		for (j = 0 ; j < conf.producers ; j++)
+			rd_kafka_topic_destroy(topics[i]->inst[j].rkt);
+		free(topics[i]->inst);
+		topics[i]->inst = NULL;
+	}
+}
+
+
+/**
+ * Returns the producer to use for a message with key 'key'.
+ * Messages with the same key always use the same producer, preserving
+ * their relative order, keyless messages are spread round-robin.
+ */
+static inline int producer_select (const char *key, size_t key_len) {
+	static unsigned int rr;
+
+	if (conf.producers == 1)
+		return 0;
+
+	if (key_len)
+		return crc32(0, (const Bytef *)key, key_len) % conf.producers;
+
+	return rr++ % conf.producers;
+}
+
+
+/**
+ * Produce a single Kafka message to 'topic'.
+ *
+ * 'records' is the number of records coalesced into the message.
+ *
+ * Returns 0 on success or -1 if the message could not be enqueued.
+ */
+static int kafka_produce (struct vk_topic *topic,
+			   const char *buf, size_t len,
+			   const char *key, size_t key_len, uint64_t seq,
+			   int records) {
+	int pi = producer_select(key, key_len);
+	uint64_t t_produce;
+	int ret = 0;
+
+	/* The produce time is passed as the message opaque (see
+	 * produce_opaque()) to track delivery latency in the delivery
+	 * report callback. */
+	t_produce = vk_clock_us();
+
+	if (rd_kafka_produce(topic->inst[pi].rkt, conf.partition,
+			     RD_KAFKA_MSG_F_COPY,
+			     (void *)buf, len,
+			     key, key_len,
+			     produce_opaque(t_produce)) == -1) {
+		cnt.txerr++;
+		topic->txerr++;
+		ret = -1;
+		if (!rate_limit(RL_KAFKA_PRODUCE_ERR))
+			vk_log("PRODUCE", LOG_WARNING,
+			       "Failed to produce Kafka message to %s "
+			       "(seq %"PRIu64"): %s (%i messages in outq)",
+			       topic->name, seq, strerror(errno),
+			       kafka_outq_len());
+	} else {
+		cnt.kafka_tx++;
+		cnt.kafka_records += records;
+		topic->tx++;
+		inflight_add(t_produce);
+		/* Partitioner callback is not called for fixed partitions */
+		if (conf.partition != RD_KAFKA_PARTITION_UA)
+			partition_enq_add(topic, conf.partition);
+	}
+
+	if (conf.stats_shm)
+		vk_hist_add(&hists[HIST_PRODUCE], vk_clock_us() - t_produce);
+
+	rd_kafka_poll(rks[pi], 0);
+
+	return ret;
+}
+
+
+/**
+ * Produce the current batch, if any, as one Kafka message.
+ */
+static void batch_flush (void) {
+	int failed, i;
+
+	if (!batch.cnt)
+		return;
+
+	failed = kafka_produce(batch.topic, batch.buf, batch.len,
+			       conf.batch_key == VK_BATCH_KEY_NONE ?
+			       NULL : batch.key,
+			       conf.batch_key == VK_BATCH_KEY_NONE ?
+			       0 : batch.key_len,
+			       conf.sequence_number, batch.cnt) == -1;
+
+	for (i = 0 ; i < VK_PRIO_NUM ; i++) {
+		if (failed)
+			prio_cnt[i].drop += batch.prio_cnt[i];
+		else
+			prio_cnt[i].tx += batch.prio_cnt[i];
+		batch.prio_cnt[i] = 0;
+	}
+
+	batch.len = 0;
+	batch.cnt = 0;
+	batch.key_len = 0;
+}
+
+
+/**
+ * Flush the current batch if its first record is older than
+ * message.batch.age.ms.
+ */
+static inline void batch_age_check (uint64_t now) {
+	if (batch.cnt &&
+	    now - batch.t_first >= (uint64_t)conf.batch_age_ms * 1000) {
+		cnt.batch_flush_age++;
+		batch_flush();
+	}
+}
+
+
+/**
+ * Add a rendered record to the current batch, flushing it as needed.
+ */
+static void batch_add (struct vk_topic *topic, struct logline *lp,
+		       int prio, const char *buf, size_t len) {
+	fmt_enc_t enc = logline_fconf(lp)[FMT_CONF_MAIN].encoding;
+	int binary = conf.passthrough ||
+		(enc != VK_ENC_STRING && enc != VK_ENC_JSON);
+	size_t need = len + PB_VARINT_MAX;
+
+	/* Records of different format generations may not share
+	 * the record framing (after a reload). */
+	if (batch.cnt && batch.binary != binary)
+		batch_flush();
+
+	/* A message has a single topic. */
+	if (batch.cnt && batch.topic != topic) {
+		cnt.batch_flush_topic++;
+		batch_flush();
+	}
+
+	/* Keep records with different keys in separate messages. */
+	if (batch.cnt && conf.batch_key == VK_BATCH_KEY_SPLIT &&
+	    (batch.key_len != lp->key_len ||
+	     (lp->key_len && memcmp(batch.key, lp->key, lp->key_len)))) {
+		cnt.batch_flush_key++;
+		batch_flush();
+	}
+
+	if (batch.cnt && batch.len + need > conf.batch_bytes) {
+		cnt.batch_flush_bytes++;
+		batch_flush();
+	}
+
+	if (unlikely(batch.len + need > batch.size)) {
+		batch.size = batch.len + need > conf.batch_bytes ?
+			batch.len + need : conf.batch_bytes;
+		batch.buf = realloc(batch.buf, batch.size);
+	}
+
+	if (!batch.cnt) {
+		batch.t_first = vk_clock_us();
+		batch.topic = topic;
+		batch.binary = binary;
+		if (lp->key_len > batch.key_size) {
+			batch.key_size = lp->key_len;
+			batch.key = realloc(batch.key, batch.key_size);
+		}
+		if (lp->key_len)
+			memcpy(batch.key, lp->key, lp->key_len);
+		batch.key_len = lp->key_len;
+	}
+
+	if (binary)
+		batch.len = pb_put_varint(batch.buf + batch.len, len) -
+			batch.buf;
+	else if (batch.cnt)
+		batch.buf[batch.len++] = '\n';
+
+	memcpy(batch.buf + batch.len, buf, len);
+	batch.len += len;
+	batch.prio_cnt[prio]++;
+
+	if (++batch.cnt >= conf.batch_records) {
+		cnt.batch_flush_cnt++;
+		batch_flush();
+	} else if (batch.len >= conf.batch_bytes) {
+		cnt.batch_flush_bytes++;
+		batch_flush();
+	}
+}
+
+
+/**
+ * Kafka outputter
+ */
+void out_kafka (struct fmt_conf *fconf, struct logline *lp,
+		const char *buf, size_t len) {
+	struct vk_topic *topic;
+	int prio;
+
+	/* If 'buf' is the key we simply store it for later use
+	 * when the message is produced. */
+	if (fconf->fid == FMT_CONF_KEY) {
+		assert(!lp->key);
+		lp->key = malloc(len);
+		lp->key_len = len;
+		memcpy(lp->key, buf, len);
+		return;
+	}
+
+	/* Priority lanes: normal priority messages are shed first
+	 * when the out queue reaches its share of the queue capacity. */
+	prio = prio_get(lp);
+	if (prio == VK_PRIO_NORMAL && conf.prio_rule_cnt &&
+	    unlikely(kafka_outq_len() >= prio_normal_outq_max)) {
+		prio_cnt[prio].drop++;
+		return;
+	}
+
+	topic = topic_route(lp);
+
+	if (conf.batch_records > 1) {
+		batch_add(topic, lp, prio, buf, len);
+		batch_age_check(vk_clock_us());
+		return;
+	}
+
+	if (kafka_produce(topic, buf, len, lp->key, lp->key_len,
+			  lp->seq, 1) == -1)
+		prio_cnt[prio].drop++;
+	else
+		prio_cnt[prio].tx++;
+}
+
+
+/**
+ * Stdout outputter
+ */
+void out_stdout (struct fmt_conf *fconf, struct logline *lp,
+		 const char *buf, size_t len) {
+	printf("%.*s\n", (int)len, buf);
+}
+
+/**
+ * Null outputter
+ */
+void out_null (struct fmt_conf *fconf, struct logline *lp,
+	       const char *buf, size_t len) {
+}
+
+
+/**
+ * Currently selected outputter.
+ */
+void (*outfunc) (struct fmt_conf *fconf, struct logline *lp,
+		 const char *buf, size_t len) = out_kafka;
+
+
+/**
+ * Kafka error callback
+ */
+static void kafka_error_cb (rd_kafka_t *rk, int err,
+			    const char *reason, void *opaque) {
+	if (!rate_limit(RL_KAFKA_ERROR_CB))
+		vk_log("KAFKAERR", LOG_ERR,
+		       "Kafka error (%i): %s", err, reason);
+}
+
+
+/**
+ * Kafka message delivery report callback.
+ * Called for each delivered (or failed delivery) message.
+ * NOTE: If the dr callback is not to be used it can be turned off to
+ *       improve performance.
+ */
+static void kafka_dr_cb (rd_kafka_t *rk,
+			 void *payload, size_t len,
+			 int error_code,
+			 void *opaque, void *msg_opaque) {
+	uint64_t now = vk_clock_us();
+	uint64_t t_produce = produce_time(msg_opaque, now);
+
+	_DBG("Kafka delivery report: error=%i, size=%zd", error_code, len);
+
+	inflight_del(t_produce);
+
+	if (conf.stats_shm && !error_code)
+		vk_hist_add(&hists[HIST_RENDER_ACK], now - t_produce);
+	if (unlikely(error_code)) {
+		cnt.kafka_drerr++;
+		if (conf.log_kafka_msg_error && !rate_limit(RL_KAFKA_DR_ERR))
+			vk_log("KAFKADR", LOG_NOTICE,
+			       "Kafka message delivery error: %s",
+			       rd_kafka_err2str(error_code));
+	}
+}
+
+/**
+ * Extracts the integer value of the first occurence of "'key':" in 'json'.
+ * librdkafka emits its top level fields before any nested objects so
+ * the first occurence is the top level one.
+ */
+static uint64_t json_int_get (const char *json, const char *key) {
+	char tmp[64];
+	const char *t;
+
+	snprintf(tmp, sizeof(tmp), "\"%s\":", key);
+	if (!(t = strstr(json, tmp)))
+		return 0;
+
+	return strtoull(t + strlen(tmp), NULL, 10);
+}
+
+/**
+ * Kafka statistics callback.
+ */
+static int kafka_stats_cb (rd_kafka_t *rk, char *json, size_t json_len,
+			    void *opaque) {
+	struct kafka_stats *ks = opaque;  /* This producer's kstats[] */
+
+	vk_log_stats("{ \"kafka\": %s }\n", json);
+
+	if (conf.stats_shm) {
+		ks->replyq   = json_int_get(json, "replyq");
+		ks->msg_cnt  = json_int_get(json, "msg_cnt");
+		ks->msg_size = json_int_get(json, "msg_size");
+		ks->msg_max  = json_int_get(json, "msg_max");
+	}
+
+	return 0;
+}
+
+
+static void render_match_string (struct fmt_conf *fconf, struct logline *lp) {
+	char buf[8192];
+	int  of = 0;
+	int  i;
+
+	/* Render each formatter in order. */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const void *ptr;
+		int len = lp->match[fconf->fid][i].len;
+
+		/* Either use accumulated value, or the default value. */
+		if (len) {
+			ptr = lp->match[fconf->fid][i].ptr;
+		} else {
+			ptr = fconf->fmt[i].def;
+			len = fconf->fmt[i].deflen;
+		}
+
+		if (of + len >= sizeof(buf))
+			break;
+
+		memcpy(buf+of, ptr, len);
+		of += len;
+	}
+
+	/* Pass rendered log line to outputter function */
+	cnt.tx++;
+	outfunc(fconf, lp, buf, of);
+}
+
+
+static void render_match_json (struct fmt_conf *fconf, struct logline *lp) {
+	yajl_gen g;
+	int      i;
+	const unsigned char *buf;
+#if YAJL_MAJOR < 2
+	unsigned int buflen;
+#else
+	size_t   buflen;
+#endif
+
+#if YAJL_MAJOR < 2
+	g = yajl_gen_alloc(NULL, NULL);
+#else
+	g = yajl_gen_alloc(NULL);
+#endif
+	yajl_gen_map_open(g);
+
+	/* Render each formatter in order. */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const void *ptr;
+		int len = lp->match[fconf->fid][i].len;
+
+		/* Skip constant strings */
+		if (fconf->fmt[i].id == 0)
+			continue;
+
+		/* Either use accumulated value, or the default value. */
+		if (len) {
+			ptr = lp->match[fconf->fid][i].ptr;
+		} else {
+			ptr = fconf->fmt[i].def;
+			len = fconf->fmt[i].deflen;
+		}
+
+		/* Field name */
+		if (likely(fconf->fmt[i].name != NULL))
+			yajl_gen_string(g, (unsigned char *)fconf->fmt[i].name,
+					fconf->fmt[i].namelen);
+		else {
+			char name = (char)fconf->fmt[i].id;
+			yajl_gen_string(g, (unsigned char *)&name, 1);
+		}
+
+		/* Value */
+		switch (fconf->fmt[i].type)
+		{
+		case FMT_TYPE_STRING:
+			yajl_gen_string(g, ptr, len);
+			break;
+		case FMT_TYPE_NUMBER:
+			if (len == 3 && !strncasecmp(ptr, "nan", 3)) {
+				/* There is no NaN in JSON, encode as null */
+				ptr = "null";
+				len = 4;
+			}
+			yajl_gen_number(g, ptr, len);
+			break;
+		}
+	}
+
+	yajl_gen_map_close(g);
+
+	yajl_gen_get_buf(g, &buf, &buflen);
+
+	/* Pass rendered log line to outputter function */
+	cnt.tx++;
+	outfunc(fconf, lp, (const char *)buf, buflen);
+
+	yajl_gen_clear(g);
+	yajl_gen_free(g);
+}
+
+static void render_match_msgpack (struct fmt_conf *fconf,
+				  struct logline *lp) {
+	char stackbuf[8192];
+	char *buf = stackbuf;
+	size_t size = 3; /* map header */
+	char *d;
+	int  i;
+
+	/* Calculate upper bound of encoded size */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		if (fconf->fmt[i].id == 0)
+			continue;
+		size += fconf->fmt[i].encnamelen + MSGPACK_HDR_MAX +
+			(lp->match[fconf->fid][i].len ? :
+			 fconf->fmt[i].deflen);
+	}
+
+	if (unlikely(size > sizeof(stackbuf)))
+		buf = malloc(size);
+
+	d = msgpack_put_maphdr(buf, fconf->field_cnt);
+
+	/* Render each formatter in order. */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const char *ptr;
+		int len = lp->match[fconf->fid][i].len;
+		int64_t ival;
+		double dval;
+
+		/* Skip constant strings */
+		if (fconf->fmt[i].id == 0)
+			continue;
+
+		/* Either use accumulated value, or the default value. */
+		if (len) {
+			ptr = lp->match[fconf->fid][i].ptr;
+		} else {
+			ptr = fconf->fmt[i].def;
+			len = fconf->fmt[i].deflen;
+		}
+
+		/* Pre-encoded field name */
+		memcpy(d, fconf->fmt[i].encname, fconf->fmt[i].encnamelen);
+		d += fconf->fmt[i].encnamelen;
+
+		/* Value */
+		switch (fconf->fmt[i].type)
+		{
+		case FMT_TYPE_NUMBER:
+			switch (number_parse(ptr, len, &ival, &dval))
+			{
+			case NUM_INT:
+				d = msgpack_put_int(d, ival);
+				break;
+			case NUM_DOUBLE:
+				d = msgpack_put_double(d, dval);
+				break;
+			case NUM_NONE:
+				/* Not a number (e.g., "nan"): encode as nil */
+				*(d++) = (char)0xc0;
+				break;
+			}
+			break;
+
+		case FMT_TYPE_STRING:
+			d = msgpack_put_strhdr(d, len);
+			memcpy(d, ptr, len);
+			d += len;
+			break;
+		}
+	}
+
+	/* Pass rendered log line to outputter function */
+	cnt.tx++;
+	outfunc(fconf, lp, buf, (size_t)(d - buf));
+
+	if (unlikely(buf != stackbuf))
+		free(buf);
+}
+
+
+static void render_match_avro (struct fmt_conf *fconf, struct logline *lp) {
+	char stackbuf[8192];
+	char *buf = stackbuf;
+	size_t size = 10; /* Single object encoding header */
+	char *d;
+	int  i;
+
+	/* Calculate upper bound of encoded size */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++)
+		size += AVRO_VARINT_MAX + 1 +
+			(lp->match[fconf->fid][i].len ? :
+			 fconf->fmt[i].deflen);
+
+	if (unlikely(size > sizeof(stackbuf)))
+		buf = malloc(size);
+
+	/* A record without fields encodes to nothing. */
+	d = buf;
+	*d = '\0';
+
+	/* Avro single object encoding header:
+	 * 0xC3 0x01 followed by the little-endian schema fingerprint */
+	if (conf.avro_fingerprint) {
+		int j;
+		*(d++) = (char)0xc3;
+		*(d++) = (char)0x01;
+		for (j = 0 ; j < 8 ; j++)
+			*(d++) = (char)(fconf->schema_fp >> (j * 8));
+	}
+
+	/* Render each formatter in schema order. */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const char *ptr;
+		int len = lp->match[fconf->fid][i].len;
+		int64_t ival;
+		double dval;
+
+		/* Skip constant strings */
+		if (fconf->fmt[i].id == 0)
+			continue;
+
+		/* Either use accumulated value, or the default value. */
+		if (len) {
+			ptr = lp->match[fconf->fid][i].ptr;
+		} else {
+			ptr = fconf->fmt[i].def;
+			len = fconf->fmt[i].deflen;
+		}
+
+		switch (fconf->fmt[i].type)
+		{
+		case FMT_TYPE_NUMBER:
+			/* Union ["null","long","double"] branch + value */
+			switch (number_parse(ptr, len, &ival, &dval))
+			{
+			case NUM_INT:
+				*(d++) = 2; /* zig-zag encoded 1 */
+				d = avro_put_long(d, ival);
+				break;
+			case NUM_DOUBLE:
+				*(d++) = 4; /* zig-zag encoded 2 */
+				d = avro_put_double(d, dval);
+				break;
+			case NUM_NONE:
+				*(d++) = 0;
+				break;
+			}
+			break;
+
+		case FMT_TYPE_STRING:
+			d = avro_put_long(d, len);
+			memcpy(d, ptr, len);
+			d += len;
+			break;
+		}
+	}
+
+	/* Pass rendered log line to outputter function */
+	cnt.tx++;
+	outfunc(fconf, lp, buf, (size_t)(d - buf));
+
+	if (unlikely(buf != stackbuf))
+		free(buf);
+}
+
+
+static void render_match_protobuf (struct fmt_conf *fconf,
+				   struct logline *lp) {
+	char stackbuf[8192];
+	char *buf = stackbuf;
+	double *dvals = alloca(fconf->fmt_cnt * sizeof(*dvals));
+	size_t size = 0;
+	char *d;
+	int  i;
+
+	/* Calculate exact encoded size, numbers are parsed only once. */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const char *ptr;
+		int len = lp->match[fconf->fid][i].len;
+		int64_t ival;
+
+		if (fconf->fmt[i].id == 0)
+			continue;
+
+		if (len) {
+			ptr = lp->match[fconf->fid][i].ptr;
+		} else {
+			ptr = fconf->fmt[i].def;
+			len = fconf->fmt[i].deflen;
+		}
+
+		if (fconf->fmt[i].type == FMT_TYPE_NUMBER) {
+			switch (number_parse(ptr, len, &ival, &dvals[i]))
+			{
+			case NUM_INT:
+				dvals[i] = (double)ival;
+				break;
+			case NUM_DOUBLE:
+				break;
+			case NUM_NONE:
+				/* Not a number: field is omitted */
+				dvals[i] = 0.0;
+				break;
+			}
+
+			/* Zero is the protobuf default: omitted */
+			if (dvals[i] != 0.0)
+				size += fconf->fmt[i].encnamelen + 8;
+		} else
+			size += fconf->fmt[i].encnamelen +
+				pb_varint_len(len) + len;
+	}
+
+	if (unlikely(size > sizeof(stackbuf)))
+		buf = malloc(size);
+
+	/* A message with only default values encodes to nothing. */
+	d = buf;
+	*d = '\0';
+
+	/* Encode each field in format order. */
+	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
+		const char *ptr;
+		int len = lp->match[fconf->fid][i].len;
+
+		if (fconf->fmt[i].id == 0)
+			continue;
+
+		if (fconf->fmt[i].type == FMT_TYPE_NUMBER) {
+			/* Zero is the protobuf default: omit */
+			if (dvals[i] == 0.0)
+				continue;
+			memcpy(d, fconf->fmt[i].encname,
+			       fconf->fmt[i].encnamelen);
+			d += fconf->fmt[i].encnamelen;
+			d = pb_put_double(d, dvals[i]);
+			continue;
+		}
+
+		if (len) {
+			ptr = lp->match[fconf->fid][i].ptr;
+		} else {
+			ptr = fconf->fmt[i].def;
+			len = fconf->fmt[i].deflen;
+		}
+
+		memcpy(d, fconf->fmt[i].encname, fconf->fmt[i].encnamelen);
+		d += fconf->fmt[i].encnamelen;
+		d = pb_put_varint(d, len);
+		memcpy(d, ptr, len);
+		d += len;
+	}
+
+	/* Pass rendered log line to outputter function */
+	cnt.tx++;
+	outfunc(fconf, lp, buf, (size_t)(d - buf));
+
+	if (unlikely(buf != stackbuf))
+		free(buf);
+}
+
+
+/**
+ * Render an accumulated logline to string and pass it to the output function.
+ */
+static void render_match (struct logline *lp, uint64_t seq) {
+	uint64_t t_start = 0;
+	int i;
+
+	lp->seq = seq;
+
+	if (conf.stats_shm) {
+		t_start = vk_clock_us();
+
+		if (lp->t_reqend) {
+			uint64_t now = vk_wallclock_us();
+			vk_hist_add(&hists[HIST_REQ_RENDER],
+				    now > lp->t_reqend ?
+				    now - lp->t_reqend : 0);
+		}
+	}
+
+	/* Render fmt_confs in reverse order so KEY is available for MAIN.
+	 * Selector formats are not rendered here. */
+	for (i = FMT_CONF_OUT_NUM-1 ; i >= 0 ; i--) {
+		struct fmt_conf *fconf = &logline_fconf(lp)[i];
+
+		if (!fconf->fmt_cnt)
+			continue;
+
+		switch (fconf->encoding)
+		{
+		case VK_ENC_STRING:
+			render_match_string(fconf, lp);
+			break;
+		case VK_ENC_JSON:
+			render_match_json(fconf, lp);
+			break;
+		case VK_ENC_MSGPACK:
+			render_match_msgpack(fconf, lp);
+			break;
+		case VK_ENC_AVRO:
+			render_match_avro(fconf, lp);
+			break;
+		case VK_ENC_PROTOBUF:
+			render_match_protobuf(fconf, lp);
+			break;
+		}
+	}
+
+	if (t_start)
+		vk_hist_add(&hists[HIST_RENDER], vk_clock_us() - t_start);
+}
+
+
+
+/**
+ * Initialize log line lookup hash
+ */
+static void loglines_init (void) {
+	loglines = calloc(sizeof(*loglines), conf.loglines_hsize);
+}
+
+/**
+ * Returns the hash key (bucket) for a given log id
+ */
+#define logline_hkey(inst,id) (((id) + ((inst) * 65599)) % conf.loglines_hsize)
+
+
+/**
+ * Resets the given logline and makes it ready for accumulating a new request.
+ */
+static void logline_reset (struct logline *lp) {
+	int i;
+	struct tmpbuf *tmpbuf;
+
+	/* Clear logline, except for scratch pad since it will be overwritten.
+	 * Matches are only assigned to in-flight loglines, whose
+	 * generation may be the previous one. */
+	if (lp->t_first) {
+		const struct fmt_conf *fconf = logline_fconf(lp);
+
+		for (i = 0 ; i < FMT_CONF_NUM ; i++)
+			memset(lp->match[i], 0,
+			       fconf[i].fmt_cnt * sizeof(*lp->match[i]));
+	}
+
+	/* Return temporary buffers to the pool */
+	while ((tmpbuf = lp->tmpbuf)) {
+		lp->tmpbuf = tmpbuf->next;
+		tmpbuf_put(tmpbuf);
+	}
+	
+	if (lp->key) {
+		free(lp->key);
+		lp->key = NULL;
+		lp->key_len = 0;
+	}
+
+	if (lp->t_first) {
+		logline_inflight--;
+		if (unlikely(lp->gen != conf.gen))
+			gen_old.inflight--;
+		lp->t_first = 0;
+	}
+
+	lp->seq       = 0;
+	lp->capture_cnt = 0;
+	lp->status    = 0;
+	lp->xid       = 0;
+	lp->t_reqend  = 0;
+	lp->sof       = 0;
+	lp->raw_len   = 0;
+	lp->skip      = 0;
+	lp->overrun   = 0;
+	lp->tags_seen = 0;
+	lp->t_last    = time(NULL);
+}
+
+
+/**
+ * Free a logline previously reset with logline_reset().
+ */
+static void logline_free (struct logline *lp) {
+	if (lp->raw)
+		free(lp->raw);
+	free(lp);
+}
+
+
+/**
+ * Free up all loglines.
+ */
+static void loglines_term (void) {
+	unsigned int hkey;
+	for (hkey = 0 ; hkey < conf.loglines_hsize ; hkey++) {
+		struct logline *lp;
+		while ((lp = LIST_FIRST(&loglines[hkey].lps))) {
+			logline_reset(lp);
+			LIST_REMOVE(lp, link);
+			logline_free(lp);
+			logline_cnt--;
+		}
+	}
+	free(loglines);
+
+	tmpbuf_pool_term();
+}
+
+
+/**
+ * Allocate and set up a new logline with the current scratch size.
+ */
+static struct logline *logline_new (int inst, unsigned int id) {
+	struct logline *lp;
+	char *ptr;
+	int i;
+
+	lp = malloc(sizeof(*lp) + conf.scratch_size +
+		    (conf.total_fmt_cnt * sizeof(*lp->match[0])) +
+		    (conf.capture_max * sizeof(*lp->capture)));
+	memset(lp, 0, sizeof(*lp));
+	lp->id = id;
+	lp->inst = inst;
+	lp->gen = conf.gen;
+	lp->scratch_size = conf.scratch_size;
+	ptr = (char *)(lp+1) + lp->scratch_size;
+	for (i = 0 ; i < FMT_CONF_NUM ; i++) {
+		size_t msize = conf.fconf[i].fmt_cnt * sizeof(*lp->match[i]);
+		lp->match[i] = (struct match *)ptr;
+		memset(lp->match[i], 0, msize);
+		ptr += msize;
+	}
+	if (conf.capture_max)
+		lp->capture = (struct capture_rec *)ptr;
+
+	return lp;
+}
+
+
+/**
+ * Replace idle logline 'lp' in bucket 'hkey' with a logline of the
+ * current scratch size and format generation.
+ */
+static struct logline *logline_resize (unsigned int hkey,
+				       struct logline *lp) {
+	struct logline *nlp;
+
+	nlp = logline_new(lp->inst, lp->id);
+	nlp->t_last = lp->t_last;
+
+	LIST_REMOVE(lp, link);
+	LIST_INSERT_HEAD(&loglines[hkey].lps, nlp, link);
+	logline_free(lp);
+
+	return nlp;
+}
+
+
+/**
+ * Returns the existing logline for id 'id' of Varnish instance 'inst',
+ * or NULL if there is none.
+ */
+static inline struct logline *logline_find (int inst, unsigned int id) {
+	struct logline *lp;
+
+	LIST_FOREACH(lp, &loglines[logline_hkey(inst, id)].lps, link)
+		if (lp->id == id && lp->inst == inst)
+			return lp;
+
+	return NULL;
+}
+
+
+/**
+ * Returns the logline for id 'id' of Varnish instance 'inst'.
+ */
+static inline struct logline *logline_get (int inst, unsigned int id) {
+	struct logline *lp, *oldest = NULL;
+	unsigned int hkey = logline_hkey(inst, id);
+
+	LIST_FOREACH(lp, &loglines[hkey].lps, link) {
+		if (lp->id == id && lp->inst == inst) {
+			/* Cache hit: return existing logline */
+			loglines[hkey].hit++;
+
+			/* Resize idle logline if scratch size was adapted
+			 * or the formats were reloaded. */
+			if (unlikely((lp->scratch_size != conf.scratch_size ||
+				      lp->gen != conf.gen) && !lp->t_first))
+				lp = logline_resize(hkey, lp);
+
+			return lp;
+		} else if (loglines[hkey].cnt > conf.loglines_hmax &&
+			   lp->tags_seen &&
+			   (!oldest || lp->t_last < oldest->t_last))
+			oldest = lp;
+	}
+
+	/* Cache miss */
+	loglines[hkey].miss++;
+
+	if (oldest) {
+		/* Remove oldest entry.
+		 * We will not loose a log record here since this only
+		 * matches when 'tags_seen' is zero. */
+		LIST_REMOVE(oldest, link);
+		loglines[hkey].cnt--;
+		loglines[hkey].purge++;
+		logline_reset(oldest);
+		logline_free(oldest);
+		logline_cnt--;
+	}
+
+	/* Allocate and set up new logline */
+	lp = logline_new(inst, id);
+
+	LIST_INSERT_HEAD(&loglines[hkey].lps, lp, link);
+	loglines[hkey].cnt++;
+	logline_cnt++;
+
+	return lp;
+}
+
+
+
+
+
+/**
+ * Given a single tag 'tagid' with its data 'ptr' and 'len';
+ * try to match it to the registered format tags.
+ *
+ * Returns 1 if the line is done and can be rendered, else 0.
+ */
+static int tag_match (struct logline *lp, int spec, enum VSL_tag_e tagid,
+		      const char *ptr, int len) {
+	const struct tag *tag;
+
+	/* Iterate through all handlers for this tag. */
+	for (tag = logline_tags(lp)[tagid] ; tag ; tag = tag->next) {
+		const char *ptr2;
+		int len2;
+
+		/* Value already assigned */
+		if (lp->match[tag->fid][tag->fmt->idx].ptr)
+			continue;
+
+		/* Match spec (client or backend) */
+		if (!(tag->spec & spec))
+			continue;
+
+		if (tag->var && !(tag->flags & TAG_F_NOVARMATCH)) {
+			const char *t;
+			
+			/* Variable match ("Varname: value") */
+			if (!(t = strnchr(ptr, len, ':')))
+				continue;
+			
+			if (tag->varlen != (int)(t-ptr) ||
+			    strncasecmp(ptr, tag->var, tag->varlen))
+				continue;
+
+			if (likely(len > tag->varlen + 1 /* ":" */)) {
+				ptr2 = t+1; /* ":" */
+                                /* Strip leading whitespaces */
+                                while (*ptr2 == ' ' && ptr2 < ptr+len)
+                                        ptr2++;
+				len2 = len - (int)(ptr2-ptr);
+			} else {
+				/* Empty value */
+				len2 = 0;
+				ptr2 = NULL;
+			}
+
+		} else {
+			ptr2 = ptr;
+			len2 = len;
+		}
+
+		/* Get specified column if specified. */
+		if (tag->col)
+			if (!column_get(tag->col, ' ', ptr2, len2,
+					&ptr2, &len2))
+				continue;
+
+		if (tag->parser) {
+			/* Pass value to parser which will assign it. */
+			tag->parser(tag, lp, ptr2, len2);
+			
+		} else {
+			/* Fallback to verbatim field. */
+			match_assign(tag, lp, ptr2, len2);
+		}
+
+	}
+
+	/* Request end: render the match string. */
+	if (tagid == SLT_ReqEnd) {
+		const char *t;
+		int tlen;
+
+		/* Request end timestamp (3rd column) for lag tracking. */
+		if (conf.stats_shm &&
+		    column_get(3, ' ', ptr, len, &t, &tlen))
+			lp->t_reqend = (uint64_t)(strtod(t, NULL) * 1000000.0);
+
+		return 1;
+	}
+	else
+		return 0;
+}
+
+
+/**
+ * CPU governor: measure the process' CPU usage (all threads) every
+ * cpu.governor.interval.ms and double the sample rate while it exceeds
+ * cpu.budget, halving it again when usage falls below 70% of the budget.
+ */
+static void governor_check (uint64_t now) {
+	struct rusage ru;
+	uint64_t cpu;
+	int rate = gov.rate;
+
+	if (likely(now - gov.t_last < (uint64_t)conf.cpu_interval_ms * 1000))
+		return;
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ((uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+	       1000000) + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+
+	if (gov.t_last) {
+		gov.usage = (int)(((cpu - gov.cpu_last) * 100) /
+				  (now - gov.t_last));
+
+		if (gov.usage > conf.cpu_budget) {
+			if (rate < conf.sample_rate_max)
+				rate = rate * 2 > conf.sample_rate_max ?
+					conf.sample_rate_max : rate * 2;
+		} else if (gov.usage < (conf.cpu_budget * 7) / 10 && rate > 1)
+			rate /= 2;
+
+		if (rate != gov.rate) {
+			vk_log("GOVERNOR", LOG_NOTICE,
+			       "CPU usage %i%% (budget %i%%): "
+			       "sample rate changed from 1/%i to 1/%i",
+			       gov.usage, conf.cpu_budget, gov.rate, rate);
+			gov.rate = rate;
+		}
+	}
+
+	gov.t_last   = now;
+	gov.cpu_last = cpu;
+}
+
+
+/**
+ * Passthrough mode: append tag to the logline's raw frame.
+ *
+ * Returns 1 if the request is done and the frame can be output, else 0.
+ */
+static int raw_tag_add (struct logline *lp, int spec, enum VSL_tag_e tagid,
+			const char *ptr, unsigned int len) {
+	size_t need;
+
+	if (conf.passthrough == VK_PASSTHRU_FORMAT &&
+	    !logline_tags(lp)[tagid] && tagid != SLT_ReqEnd)
+		return 0;
+
+	if (unlikely(len > VK_RAW_REC_LEN_MAX))
+		len = VK_RAW_REC_LEN_MAX;
+
+	/* Leave room for the frame header */
+	if (!lp->raw_len)
+		lp->raw_len = VK_RAW_HDR_SIZE;
+
+	need = lp->raw_len + VK_RAW_REC_HDR_SIZE + len;
+	if (unlikely(need > lp->raw_size)) {
+		lp->raw_size = need < 1024 ? 1024 : need * 2;
+		lp->raw = realloc(lp->raw, lp->raw_size);
+	}
+
+	lp->raw_len = vk_raw_rec_write(lp->raw + lp->raw_len, tagid, spec,
+				       ptr, len) - lp->raw;
+
+	return tagid == SLT_ReqEnd;
+}
+
+
+/**
+ * Passthrough mode: output the logline's raw frame.
+ */
+static void raw_render (struct logline *lp, uint64_t seq) {
+	lp->seq = seq;
+
+	vk_raw_hdr_write(lp->raw, (uint32_t)(lp->raw_len - VK_RAW_HDR_SIZE),
+			 seq);
+
+	cnt.tx++;
+	outfunc(&logline_fconf(lp)[FMT_CONF_MAIN], lp, lp->raw, lp->raw_len);
+}
+
+
+/**
+ * Capture of all records of slow or failed requests (capture.*).
+ *
+ * While a request is in flight its records are remembered as pointers
+ * into the VSL, regardless of logline.data.copy, so requests that do not
+ * match the capture predicate cost little more than the bookkeeping.
+ * The VSL wrap watcher (vsl_overrun_check()) re-copies the records of
+ * in-flight requests before varnishd overwrites them.
+ * Records are only copied to the scratch pad when the VSL is not
+ * persistent (capture_copy: offline files, the VSLQ API).
+ * Matching requests are output as a raw frame (see vkraw.h) to
+ * capture.topic and/or the capture.file ring.
+ */
+static struct {
+	int     topic;    /* topics[] index of capture.topic, -1 if none */
+	struct vk_raw_ring *ring; /* capture.file */
+	char   *buf;      /* Frame buffer */
+	size_t  size;
+} capture = { .topic = -1 };
+
+
+/**
+ * Remember record 'tag' for logline 'lp'.
+ */
+static void capture_add (struct logline *lp, int spec, enum VSL_tag_e tag,
+			 const char *ptr, unsigned int len) {
+	struct capture_rec *c;
+
+	if (tag == SLT_TxStatus && (spec & VSL_S_CLIENT))
+		lp->status = (int)strntou(ptr, len);
+
+	if (unlikely(lp->capture_cnt == conf.capture_max)) {
+		/* Counted once when the request is captured. */
+		return;
+	}
+
+	if (len > VK_RAW_REC_LEN_MAX)
+		len = VK_RAW_REC_LEN_MAX;
+
+	if (conf.capture_copy) {
+		char *t = scratch_alloc(NULL, lp, len);
+		memcpy(t, ptr, len);
+		ptr = t;
+	}
+
+	c = &lp->capture[lp->capture_cnt++];
+	c->ptr  = ptr;
+	c->len  = len;
+	c->tag  = (unsigned char)tag;
+	c->spec = (unsigned char)spec;
+}
+
+
+/**
+ * Output the captured records of completed logline 'lp' if the request
+ * was slow (ReqEnd 'ptr' ttfb column) or failed.
+ */
+static void capture_check (struct logline *lp, uint64_t seq,
+			   const char *ptr, unsigned int len) {
+	const char *t;
+	int tlen, i;
+	size_t need = VK_RAW_HDR_SIZE;
+	char *d;
+
+	if (!(conf.capture_status && lp->status >= conf.capture_status) &&
+	    !(conf.capture_ttfb_ms &&
+	      column_get(5, ' ', ptr, len, &t, &tlen) &&
+	      strtod(t, NULL) * 1000.0 > (double)conf.capture_ttfb_ms))
+		return;
+
+	if (lp->capture_cnt == conf.capture_max)
+		cnt.capture_trunc++;
+
+	for (i = 0 ; i < lp->capture_cnt ; i++)
+		need += VK_RAW_REC_HDR_SIZE + lp->capture[i].len;
+
+	if (need > capture.size) {
+		capture.size = need < 65536 ? 65536 : need;
+		capture.buf = realloc(capture.buf, capture.size);
+	}
+
+	d = capture.buf + VK_RAW_HDR_SIZE;
+	for (i = 0 ; i < lp->capture_cnt ; i++)
+		d = vk_raw_rec_write(d, lp->capture[i].tag,
+				     lp->capture[i].spec,
+				     lp->capture[i].ptr, lp->capture[i].len);
+
+	vk_raw_hdr_write(capture.buf, (uint32_t)(need - VK_RAW_HDR_SIZE), seq);
+
+	if (capture.ring &&
+	    vk_raw_ring_write(capture.ring, capture.buf, need) == -1) {
+		cnt.capture_err++;
+		return;
+	}
+
+	if (capture.topic != -1 &&
+	    kafka_produce(topics[capture.topic], capture.buf, need,
+			  NULL, 0, seq, 1) == -1) {
+		cnt.capture_err++;
+		return;
+	}
+
+	cnt.capture_tx++;
+}
+
+
+#ifndef VK_VSLQ
+/**
+ * Look up the VSL log segment of instance 'inst' (after VSL_Open() and
+ * whenever the shared memory is remapped).
+ */
+static void vsl_segment_get (struct vk_instance *inst) {
+	void *end = NULL;
+
+	inst->vsm_seq = VSM_Seq(inst->vd);
+	inst->vsl_start = VSM_Find_Chunk(inst->vd, VSL_CLASS, "", "", &end);
+	inst->vsl_end = end;
+	if (inst->vsl_start)
+		inst->vsl_wrap = inst->vsl_start[0];
+}
+
+
+/**
+ * Copy all of 'lp's matches that point into VSL segment 'inst'
+ * to the logline's scratch pad.
+ */
+static void logline_recopy (struct logline *lp,
+			    const struct vk_instance *inst) {
+	const struct fmt_conf *fconf = logline_fconf(lp);
+	const char *start = (const char *)inst->vsl_start;
+	int i, j;
+
+	for (i = 0 ; i < FMT_CONF_NUM ; i++) {
+		for (j = 0 ; j < fconf[i].fmt_cnt ; j++) {
+			struct match *m = &lp->match[i][j];
+			char *dst;
+
+			if (!m->ptr || m->ptr < start || m->ptr >= inst->vsl_end)
+				continue;
+
+			dst = scratch_alloc(NULL, lp, m->len);
+			memcpy(dst, m->ptr, m->len);
+			m->ptr = dst;
+		}
+	}
+
+	for (i = 0 ; i < lp->capture_cnt ; i++) {
+		struct capture_rec *c = &lp->capture[i];
+		char *dst;
+
+		if (c->ptr < start || c->ptr >= inst->vsl_end)
+			continue;
+
+		dst = scratch_alloc(NULL, lp, c->len);
+		memcpy(dst, c->ptr, c->len);
+		c->ptr = dst;
+	}
+}
+
+
+/**
+ * Zero-copy mode (logline.data.copy=false): matches point directly into
+ * the VSL shared memory which varnishd overwrites when the log wraps.
+ * The same goes for captured records (capture.*) in either mode.
+ *
+ * When the log has wrapped the writer has just started over from the
+ * beginning of the segment, so the in-flight loglines of the instance
+ * are re-copied to their scratch pads before their data is overwritten.
+ * If the shared memory was remapped (varnishd restart) the old segment
+ * is gone and in-flight loglines are flagged to be dropped, or with
+ * logline.data.copy just their captured records.
+ */
+static void vsl_overrun_check (struct vk_instance *inst) {
+	unsigned int hkey;
+	int remapped;
+	struct logline *lp;
+
+	remapped = VSM_Seq(inst->vd) != inst->vsm_seq;
+	if (likely(!remapped &&
+		   (!inst->vsl_start || *inst->vsl_start == inst->vsl_wrap)))
+		return;
+
+	if (!remapped) {
+		inst->vsl_wrap = *inst->vsl_start;
+		cnt.vsl_wraps++;
+	}
+
+	for (hkey = 0 ; hkey < conf.loglines_hsize ; hkey++) {
+		LIST_FOREACH(lp, &loglines[hkey].lps, link) {
+			if (!lp->t_first || lp->inst != inst->idx ||
+			    lp->overrun)
+				continue;
+
+			if (remapped)
+				lp->overrun = 1;
+			else {
+				logline_recopy(lp, inst);
+				cnt.vsl_recopy++;
+			}
+		}
+	}
+
+	if (remapped) {
+		vk_log("VSL", LOG_NOTICE,
+		       "Varnish shared memory remapped: "
+		       "dropping in-flight VSL references");
+		vsl_segment_get(inst);
+	}
+}
+#endif
+
+
+/**
+ * Drop the loglines still in flight on the previous format generation.
+ */
+static void gen_old_drop (void) {
+	unsigned int hkey;
+	struct logline *lp;
+
+	for (hkey = 0 ; hkey < conf.loglines_hsize ; hkey++) {
+		LIST_FOREACH(lp, &loglines[hkey].lps, link) {
+			if (!lp->t_first || lp->gen == conf.gen)
+				continue;
 
-		/* Parse '{VAR}X': '*s' will be set to X, and 'var' to VAR.
-		 * varnishkafka also adds the following features:
-		 *
-		 *  VAR?DEF    where DEF is a default value, in this mode
-		 *             VAR can be empty, and {?DEF} may be applied to
-		 *             any formatter.
-		 *             I.e.: %{Content-type?text/html}o
-		 *                   %{?no-user}u
-		 *
-		 *  VAR!OPTION Various formatting options, see below.
-		 *
-		 * Where OPTION is one of:
-		 *  escape     Escape rogue characters in the value.
-		 *             VAR can be empty and {!escape} may be applied to
-		 *             any formatter.
-		 *             I.e. %{User-Agent!escape}i
-		 *                  %{?nouser!escape}u
-		 *
-		 * ?DEF and !OPTIONs can be combined.
-		 */
-		if (*s == '{') {
-			const char *a = s+1;
-			const char *b = strchr(a, '}');
-			const char *q;
+			logline_reset(lp);
+			cnt.reload_dropped++;
+		}
+	}
 
-			if (!b) {
-				snprintf(errstr, errstr_size,
-					 "Expecting '}' after \"%.*s...\"",
-					 30, begin);
-				return -1;
-			}
+#ifdef VK_VSLQ
+	{
+		int i;
 
-			if (a == b) {
-				snprintf(errstr, errstr_size,
-					 "Empty {} identifier at \"%.*s...\"",
-					 30, begin);
-				return -1;
-			}
+		for (i = 0 ; i < conf.instance_cnt ; i++) {
+			lp = conf.instances[i].lp;
+			if (!lp || !lp->t_first || lp->gen == conf.gen)
+				continue;
 
-			if (!*(b+1)) {
-				snprintf(errstr, errstr_size,
-					 "No formatter following "
-					 "identifier at \"%.*s...\"",
-					 30, begin);
-				return -1;
-			}
+			logline_reset(lp);
+			cnt.reload_dropped++;
+		}
+	}
+#endif
+}
 
-			var = a;
 
-			/* Check for @NAME, ?DEF and !OPTIONs */
-			if ((q = strnchrs(a, (int)(b-a), "@?!"))) {
-				const char *q2 = q;
+/**
+ * Free the previous format generation once its loglines are done,
+ * dropping those that are not done after reload.timeout.ms.
+ */
+static void gen_old_retire (void) {
+	if (gen_old.inflight > 0) {
+		vk_log("RELOAD", LOG_WARNING,
+		       "Dropping %i logline(s) still in flight on format "
+		       "generation %u after %ims",
+		       gen_old.inflight, gen_old.gen, conf.reload_timeout_ms);
+		gen_old_drop();
+	}
 
-				varlen = (int)(q - a);
-				if (varlen == 0)
-					var = NULL;
+	vk_log("RELOAD", LOG_INFO,
+	       "Format generation %u retired", gen_old.gen);
 
-				/* Scan all ?DEF and !OPTIONs */
-				do {
-					int qlen;
+	gen_free(&gen_old);
 
-					q++;
+	/* Unsubscribe from the tags only used by the previous generation */
+	tags_subscribe();
+}
 
-					if ((q2 = strnchrs(q, (int)(b-q2-1),
-							   "@?!")))
-						qlen = (int)(q2-q);
-					else
-						qlen = (int)(b-q);
 
-					switch (*(q-1))
-					{
-					case '@':
-						/* Output format field name */
-						name = q;
-						namelen = qlen;
-						break;
-					case '?':
-						/* Default value */
-						def = q;
-						deflen = qlen;
-						break;
-					case '!':
-						/* Options */
-						if (!strncasecmp(q, "escape",
-								 qlen))
-							flags |= FMT_F_ESCAPE;
-						else if (!strncasecmp(q, "num",
-								      qlen))
-							type = FMT_TYPE_NUMBER;
-						else {
-							snprintf(errstr,
-								 errstr_size,
-								 "Unknown "
-								 "formatter "
-								 "option "
-								 "\"%.*s\" at "
-								 "\"%.*s...\"",
-								 qlen, q,
-								 30, a);
-							return -1;
-						}
-						break;
-					}
+/**
+ * Re-read the configuration file (SIGUSR2) and parse its formats and
+ * selector rules into a new format generation.
+ * Loglines in flight finish on the previous generation, see fmt_gen.
+ * Topic handles are kept: topics added by new routing rules get theirs
+ * created on all existing producers.
+ * On error the current generation is kept.
+ */
+static void conf_reload (void) {
+	struct fmt_gen cur, failed;
+	char errstr[1024];
+
+	gen_save(&cur);
+	conf.format[FMT_CONF_MAIN] = fmt_main_default;
+
+	if (conf_file_reload(conf_file_path,
+			     errstr, sizeof(errstr)) == -1 ||
+	    formats_init(errstr, sizeof(errstr)) == -1 ||
+	    (rks && topics_start(errstr, sizeof(errstr)) == -1)) {
+		vk_log("RELOAD", LOG_ERR,
+		       "Failed to reload configuration from %s, "
+		       "keeping the current one: %s",
+		       conf_file_path, errstr);
+		gen_save(&failed);
+		gen_free(&failed);
+		gen_restore(&cur);
+		cnt.reload_err++;
+		return;
+	}
+
+	gen_old = cur;
+	gen_old.inflight  = logline_inflight;
+	gen_old.t_retired = vk_clock_us();
+	conf.gen++;
+	cnt.reload++;
+
+	if (conf.log_level >= 7)
+		tag_dump();
+
+	/* Subscribe to the tags of both generations while
+	 * the previous one drains. */
+	tags_subscribe();
+
+	if (schema_write(errstr, sizeof(errstr)) == -1)
+		vk_log("SCHEMA", LOG_WARNING, "%s", errstr);
+
+	vk_log("RELOAD", LOG_NOTICE,
+	       "Configuration reloaded from %s: format generation %u, "
+	       "%i in-flight logline(s) finish on generation %u",
+	       conf_file_path, conf.gen, gen_old.inflight, gen_old.gen);
+
+	if (!gen_old.inflight)
+		gen_old_retire();
+}
+
+
+/**
+ * Configuration reload housekeeping, called between requests:
+ * retires the previous format generation when it has drained and
+ * performs a requested reload. A reload requested while the previous
+ * generation is still draining is performed once it is retired.
+ */
+static void reload_check (void) {
+	if (gen_old.tag) {
+		if (gen_old.inflight > 0 &&
+		    vk_clock_us() - gen_old.t_retired <
+		    (uint64_t)conf.reload_timeout_ms * 1000)
+			return;
+
+		gen_old_retire();
+	}
+
+	if (conf.need_reload) {
+		conf.need_reload = 0;
+		conf_reload();
+	}
+}
+
+
+/**
+ * Returns the shard for VSL id 'id'.
+ * All records of a request share the same id and thus the same shard.
+ */
+static inline int shard_of (unsigned int id) {
+	id ^= id >> 16;
+	id *= 0x45d9f3b;
+	id ^= id >> 16;
+	return (int)(id % (unsigned int)conf.shard_cnt);
+}
+
+
+/**
+ * Returns the next sequence number.
+ * With sharding each shard steps by the shard count from its own offset
+ * so that sequence numbers are unique across all shards.
+ */
+static inline uint64_t seq_next (void) {
+	return conf.sequence_number += conf.shard_cnt;
+}
+
+
+/**
+ * Returns 1 if the record with 'id' and 'tag' is not of interest to
+ * this process and can be skipped, else 0.
+ */
+static inline int tag_skip (enum VSL_tag_e tag, unsigned id,
+			    uint64_t bitmap) {
+	/* Requests of other shards are handled by other processes. */
+	if (conf.shard_cnt > 1 && shard_of(id) != conf.shard_idx) {
+		cnt.shard_skipped++;
+		return 1;
+	}
+
+	cnt.vsl_records++;
+
+	/* Skip unsubscribed tags before the logline lookup, unless the
+	 * record matched a -m regexp. */
+	if (!tag_subscribed[tag] && !bitmap) {
+		cnt.vsl_skipped++;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Accumulate tag 'tag' in logline 'lp' and render and output the
+ * logline when it is complete.
+ */
+static int parse_logline (const struct vk_instance *inst, struct logline *lp,
+			  enum VSL_tag_e tag, unsigned len, unsigned spec,
+			  const char *ptr, uint64_t bitmap) {
+	int    is_complete = 0;
+	uint64_t seq;
+
+	/* First tag for this request */
+	if (unlikely(!lp->t_first)) {
+		lp->t_first = time(NULL);
+		logline_inflight++;
+
+		/* CPU governor sampling: skip the entire request */
+		if (unlikely(gov.rate > 1) && (gov.seq++ % gov.rate))
+			lp->skip = 1;
+	}
+
+	if (unlikely(lp->skip)) {
+		if (tag == SLT_ReqEnd) {
+			gov.sampled_out++;
+			logline_reset(lp);
+		}
+		return conf.pret;
+	}
+
+	/* Update bitfield of seen tags (-m regexp) */
+	lp->tags_seen |= bitmap;
+
+	/* Truncate data if exceeding configured max */
+	if (unlikely(len > conf.tag_size_max)) {
+		cnt.trunc++;
+		len = conf.tag_size_max;
+	}
+
+	if (conf.capture_max)
+		capture_add(lp, spec, tag, ptr, len);
+
+	/* Accumulate matched tag content, or raw tags in passthrough mode */
+	if (unlikely(conf.passthrough))
+		is_complete = raw_tag_add(lp, spec, tag, ptr, len);
+	else
+		is_complete = tag_match(lp, spec, tag, ptr, len);
+
+	if (likely(!is_complete))
+		return conf.pret;
+
+	/* Zero-copy data was lost in a VSL overrun */
+	if (unlikely(lp->overrun) && !conf.datacopy) {
+		cnt.vsl_overrun++;
+		logline_reset(lp);
+		return conf.pret;
+	}
+
+#ifndef VK_VSLQ
+	/* Match tag regexp, if any */
+	if (conf.m_flag && !VSL_Matched(inst->vd, lp->tags_seen)) {
+		logline_reset(lp);
+		return conf.pret;
+	}
+#endif
+	
+	/* Log line is complete: render & output */
+	seq = seq_next();
+	if (unlikely(conf.passthrough))
+		raw_render(lp, seq);
+	else
+		render_match(lp, seq);
+
+	if (conf.capture_max) {
+		/* Captured records were lost in a VSL overrun */
+		if (unlikely(lp->overrun))
+			cnt.capture_err++;
+		else
+			capture_check(lp, seq, ptr, len);
+	}
+
+	if (conf.scratch_adaptive)
+		scratch_usage_add(lp);
+
+	/* clean up */
+	logline_reset(lp);
+
+	/* Reuse fresh timestamp lp->t_last from logline_reset() */
+	if (unlikely(lp->t_last >= rate_limiter_t_curr + conf.log_rate_period))
+		rate_limiters_rollover(lp->t_last);
+
+	/* Stats output */
+	if (conf.stats_interval) {
+		if (unlikely(conf.need_logrotate)) {
+			logrotate();
+		}
+		if (unlikely(lp->t_last >= conf.t_last_stats + conf.stats_interval)) {
+			print_stats();
+			conf.t_last_stats = lp->t_last;
+		}
+	}
+
+	if (unlikely(conf.need_cache_dump))
+		loglines_dump();
+
+	if (unlikely(conf.need_reload || gen_old.tag))
+		reload_check();
+
+	if (conf.cpu_budget)
+		governor_check(vk_clock_us());
+
+	/* Shared memory statistics are updated every second. */
+	if (conf.stats_shm && lp->t_last != conf.t_last_shm)
+		stats_shm_update(lp->t_last);
+
+	return conf.pret;
+}
+
+
+#ifndef VK_VSLQ
+/**
+ * Client/backend join (join.backend).
+ *
+ * Varnish 3 logs a backend transaction under the backend connection's
+ * fd, where its BackendXID record names the xid of the client request
+ * it fetches for. Client requests are indexed by the xid in their
+ * ReqStart record and backend connections by fd, both in fixed size
+ * tables where an entry is overwritten by a colliding key and a client
+ * entry expires after join.timeout.ms.
+ * Backend records are matched straight into the joined client logline
+ * with the VSL_S_BACKEND spec (only !backend formatters match these),
+ * since the backend transaction completes before the client's ReqEnd.
+ */
+#define JOIN_OPEN_MAX  128  /* Max saved BackendOpen record size */
+
+static struct {
+	struct join_client {
+		uint64_t     t;       /* Time added (monotonic us), 0 if unused */
+		int          inst;
+		unsigned int xid;
+		unsigned int fd;      /* Client fd (logline id) */
+	} *clients;
+
+	struct join_backend {
+		uint64_t     t;       /* Last use (monotonic us), 0 if unused */
+		int          inst;
+		unsigned int fd;      /* Backend connection fd */
+		unsigned int xid;     /* Joined client xid, 0 if none */
+		unsigned int client;  /* Joined client fd */
+		int          open_len;/* Saved BackendOpen record, for %h */
+		char         open[JOIN_OPEN_MAX];
+	} *backends;
+} join;
+
+#define join_hkey(inst,key) (((key) + ((inst) * 65599)) % conf.join_size)
+
+
+static void join_init (void) {
+	join.clients = calloc(conf.join_size, sizeof(*join.clients));
+	join.backends = calloc(conf.join_size, sizeof(*join.backends));
+}
+
+
+static void join_term (void) {
+	free(join.clients);
+	free(join.backends);
+}
+
+
+static inline int join_live (uint64_t t, uint64_t now) {
+	return t && now - t < (uint64_t)conf.join_timeout_ms * 1000;
+}
+
+
+/**
+ * Index client logline 'lp' by the xid of its ReqStart record
+ * ("ip port xid").
+ */
+static void join_client_add (const struct vk_instance *inst,
+			     struct logline *lp,
+			     const char *ptr, unsigned int len) {
+	struct join_client *jc;
+	const char *s;
+	int slen;
+	uint64_t now;
+
+	if (!column_get(3, ' ', ptr, len, &s, &slen) ||
+	    !(lp->xid = strntou(s, slen)))
+		return;
+
+	now = vk_clock_us();
+	jc = &join.clients[join_hkey(inst->idx, lp->xid)];
+
+	if (join_live(jc->t, now))
+		cnt.join_evicted++;
+
+	jc->t    = now;
+	jc->inst = inst->idx;
+	jc->xid  = lp->xid;
+	jc->fd   = lp->id;
+}
+
+
+/**
+ * Returns the client logline joined to backend connection 'jb',
+ * or NULL if it is not joined or the client request is gone.
+ */
+static struct logline *join_logline (const struct join_backend *jb) {
+	struct logline *lp;
+
+	if (!jb->xid ||
+	    !(lp = logline_find(jb->inst, jb->client)) ||
+	    lp->xid != jb->xid || !lp->t_first)
+		return NULL;
 
-				} while ((q = q2));
+	return lp;
+}
 
-			} else
-				varlen = (int)(b-a);			
 
-			s = b+1;
-		}
+/**
+ * Add backend record to joined client logline 'lp'.
+ */
+static void join_feed (struct logline *lp, enum VSL_tag_e tag,
+		       const char *ptr, unsigned int len) {
+	if (unlikely(lp->skip))
+		return;
 
-		if (!map[(int)*s].f[0].spec) {
-			snprintf(errstr, errstr_size,
-				 "Unknown formatter '%c' at \"%.*s...\"",
-				 *s, 30, begin);
-			return -1;
-		}
+	if (unlikely(len > conf.tag_size_max)) {
+		cnt.trunc++;
+		len = conf.tag_size_max;
+	}
 
-		if (!def) {
-			if (type == FMT_TYPE_NUMBER)
-				def = "0";
-			else
-				def = map[(int)*s].def;
-		}
+	if (conf.capture_max)
+		capture_add(lp, VSL_S_BACKEND, tag, ptr, len);
 
-		/* Add formatter to ordered list of formatters */
-		if ((fmtid = format_add(fconf, *s, var, varlen,
-					def, deflen, flags,
-					errstr, errstr_size)) == -1)
-			return -1;
+	if (unlikely(conf.passthrough))
+		raw_tag_add(lp, VSL_S_BACKEND, tag, ptr, len);
+	else
+		tag_match(lp, VSL_S_BACKEND, tag, ptr, len);
+}
 
-		fconf->fmt[fmtid].type = type;
 
-		if (name) {
-			fconf->fmt[fmtid].name = name;
-			fconf->fmt[fmtid].namelen = namelen;
-		}
+/**
+ * Returns the backend table entry for backend connection 'fd',
+ * taking over the slot if it belongs to another connection.
+ */
+static struct join_backend *join_backend_get (const struct vk_instance *inst,
+					      unsigned int fd, uint64_t now) {
+	struct join_backend *jb = &join.backends[join_hkey(inst->idx, fd)];
 
-		cnt++;
+	if (jb->t && jb->fd == fd && jb->inst == inst->idx)
+		return jb;
 
-		/* Now add the matched tags specification to the
-		 * list of parse tags */
-		for (i = 0 ; map[(int)*s].f[i].spec ; i++) {
-			if (map[(int)*s].f[i].tag == 0)
-				continue;
+	if (jb->xid && join_logline(jb))
+		cnt.join_evicted++;
 
-			/* mapping has fmtvar specified, make sure it 
-			 * matches the format's variable. */
-			if (map[(int)*s].f[i].fmtvar) {
-				const char *iswc;
+	memset(jb, 0, sizeof(*jb) - sizeof(jb->open));
+	jb->inst = inst->idx;
+	jb->fd   = fd;
+	jb->t    = now;
 
-				if (!var)
-					continue;
+	return jb;
+}
 
-				/* Match "xxxx:<key>".
-				 * If format definition's key is wildcarded
-				 * ("*") then use the configured key as var.
-				 * I.e., "%{VCL_Log:hit}x" will put "hit" in
-				 * var since VCL_Log is defined as wildcard:
-				 * "VCL_Log:*". */
-				if ((iswc = strstr(map[(int)*s].f[i].fmtvar,
-						   ":*"))) {
-					/* Wildcard definition */
-					int fvlen = (int)(iswc -
-							  map[(int)*s].
-							  f[i].fmtvar) + 1;
 
-					/* Check that var matches prefix.
-					 * I.e.: "VCL_Log:" cmp "VCL_Log:" */
-					if (varlen <= fvlen ||
-					    strncmp(map[(int)*s].f[i].fmtvar,
-						    var, fvlen))
-						continue;
+/**
+ * Handle a backend record with join.backend enabled.
+ */
+static int join_backend_tag (const struct vk_instance *inst,
+			     enum VSL_tag_e tag, unsigned int fd,
+			     unsigned int len, const char *ptr) {
+	struct join_backend *jb;
+	struct join_client *jc;
+	struct logline *lp;
+	uint64_t now;
+
+	cnt.vsl_records++;
+
+	switch ((int)tag)
+	{
+	case SLT_BackendOpen:
+		/* New connection: saved for each of its transactions. */
+		jb = join_backend_get(inst, fd, vk_clock_us());
+		jb->xid = 0;
+		jb->open_len = len < JOIN_OPEN_MAX ? len : JOIN_OPEN_MAX;
+		memcpy(jb->open, ptr, jb->open_len);
+		return conf.pret;
 
-					/* set format var to "..:<key>" */
-					var = var + fvlen;
-					varlen -= fvlen;
+	case SLT_BackendXID:
+		/* Start of transaction: join to the client request. */
+		now = vk_clock_us();
+		jb = join_backend_get(inst, fd, now);
+		jb->t   = now;
+		jb->xid = strntou(ptr, len);
+
+		jc = &join.clients[join_hkey(inst->idx, jb->xid)];
+		if (!join_live(jc->t, now) || jc->xid != jb->xid ||
+		    jc->inst != inst->idx) {
+			jb->xid = 0;
+			cnt.join_missed++;
+			return conf.pret;
+		}
 
+		jb->client = jc->fd;
+		if (!(lp = join_logline(jb))) {
+			jb->xid = 0;
+			cnt.join_missed++;
+			return conf.pret;
+		}
 
-				} else {
-					/* Non-wildcard definition.
-					 * Var must match exactly. */
-					if (varlen != strlen(map[(int)*s].
-							     f[i].fmtvar) ||
-					    strncmp(map[(int)*s].f[i].fmtvar,
-						    var, varlen))
-						continue;
+		cnt.join_matched++;
 
-					/* fmtvar's resets the format var */
-					var = NULL;
-					varlen = 0;
-				}
-			}
+		if (jb->open_len) {
+			const char *open = jb->open;
 
-			if (tag_add(fconf, &fconf->fmt[fmtid],
-				    map[(int)*s].f[i].spec,
-				    map[(int)*s].f[i].tag,
-				    var ? var : map[(int)*s].f[i].var,
-				    var ? varlen : -1,
-				    map[(int)*s].f[i].col,
-				    map[(int)*s].f[i].parser,
-				    map[(int)*s].f[i].tag_flags,
-				    errstr, errstr_size) == -1)
-				return -1;
+			/* Matches must point to persistent memory. */
+			if (!conf.passthrough) {
+				char *t = scratch_alloc(NULL, lp,
+							jb->open_len);
+				memcpy(t, jb->open, jb->open_len);
+				open = t;
+			}
+			join_feed(lp, SLT_BackendOpen, open, jb->open_len);
 		}
+		break;
 
+	case SLT_BackendReuse:
+	case SLT_BackendClose:
+		/* End of transaction */
+		jb = &join.backends[join_hkey(inst->idx, fd)];
+		if (jb->fd != fd || jb->inst != inst->idx)
+			return conf.pret;
 
-		t = ++s;
-	}
-
-	/* "..%x....."
-	 *      ^---^  add this part as verbatim string */
-	if (s > t)
-		if (format_add(fconf, 0, NULL, 0,
-			       t, (int)(s - t), 0,
-			       errstr, errstr_size) == -1)
-			return -1;
+		if ((lp = join_logline(jb)))
+			join_feed(lp, tag, ptr, len);
 
-	/* Dump parsed format string. */
-	if (conf.log_level >= 7)
-		fmt_dump(fconf);
+		jb->xid = 0;
+		if (tag == SLT_BackendClose)
+			jb->t = 0;
+		return conf.pret;
 
+	default:
+		if (!tag_subscribed[tag]) {
+			cnt.vsl_skipped++;
+			return conf.pret;
+		}
 
-	if (fconf->fmt_cnt == 0) {
-		snprintf(errstr, errstr_size,
-			 "%s format string is empty",
-			 fmt_conf_names[fconf->fid]);
-		return -1;
-	} else if (cnt == 0) {
-		snprintf(errstr, errstr_size,
-			 "No %%.. formatters in %s format",
-			 fmt_conf_names[fconf->fid]);
-		return -1;
+		jb = &join.backends[join_hkey(inst->idx, fd)];
+		if (jb->fd != fd || jb->inst != inst->idx ||
+		    !(lp = join_logline(jb)))
+			return conf.pret;
+		break;
 	}
 
-	return fconf->fmt_cnt;
-}
+	join_feed(lp, tag, ptr, len);
 
+	return conf.pret;
+}
 
 
 /**
- * Simple rate limiter used to limit the amount of error syslogs.
- * Controlled through the "log.rate.max" and "log.rate.period" properties.
+ * VSL_Dispatch() callback called for each tag read from the VSL.
  */
-typedef enum {
-	RL_KAFKA_PRODUCE_ERR,
-	RL_KAFKA_ERROR_CB,
-	RL_KAFKA_DR_ERR,
-	RL_NUM,
-} rl_type_t;
+static int parse_tag (void *priv, enum VSL_tag_e tag, unsigned id,
+		      unsigned len, unsigned spec, const char *ptr,
+		      uint64_t bitmap) {
+	const struct vk_instance *inst = priv ? priv : &conf.instances[0];
+	struct logline *lp;
 
+	if (unlikely(!spec))
+		return conf.pret;
 
-static struct rate_limiter {
-	uint64_t total;        /* Total number of events in current period */
-	uint64_t suppressed;   /* Suppressed events in current period */
-	const char *name;      /* Rate limiter log message summary */
-	const char *fac;       /* Log facility */
-} rate_limiters[RL_NUM] = {
-	[RL_KAFKA_PRODUCE_ERR] = { name: "Kafka produce errors",
-				   fac: "PRODUCE" },
-	[RL_KAFKA_ERROR_CB] = { name: "Kafka errors", fac: "KAFKAERR" },
-	[RL_KAFKA_DR_ERR] = { name: "Kafka message delivery failures",
-			      fac: "KAFKADR" }
-};
+	/* Protect zero-copy matches and captured records from VSL wraps,
+	 * checked for every record since the join path also keeps
+	 * references to the VSL. */
+	if ((!conf.datacopy || (conf.capture_max && !conf.capture_copy)) &&
+	    priv)
+		vsl_overrun_check(priv);
 
-static time_t rate_limiter_t_curr; /* Current period */
+	/* Backend transactions are joined to their client request. */
+	if (conf.join_backend && (spec & VSL_S_BACKEND))
+		return join_backend_tag(inst, tag, id, len, ptr);
+
+	if (tag_skip(tag, id, bitmap))
+		return conf.pret;
 
+	if (0)
+		_DBG("[%u] #%-3i %-12s %c %.*s",
+		     id, tag, VSL_tags[tag],
+		     spec & VSL_S_CLIENT ? 'c' : 'b',
+		     len, ptr);
+
+	if (unlikely(!(lp = logline_get(inst->idx, id))))
+		return -1;
+
+	if (conf.join_backend && tag == SLT_ReqStart)
+		join_client_add(inst, lp, ptr, len);
+
+	return parse_logline(inst, lp, tag, len, spec, ptr, bitmap);
+}
+
+#else
 
 /**
- * Roll over all rate limiters to a new period.
+ * vk_vslq_dispatch() callback called for each (translated) record.
+ *
+ * VSLQ hands over complete requests so there is no need for the
+ * logline cache: each instance accumulates its current request in
+ * a single logline.
  */
-static void rate_limiters_rollover (time_t now) {
-	int i;
+static int parse_vslq (void *opaque, int tag, unsigned int id,
+		       unsigned int spec, const char *ptr, unsigned int len) {
+	struct vk_instance *inst = opaque;
+	struct logline *lp = inst->lp;
 
-	for (i = 0 ; i < RL_NUM ; i++) {
-		struct rate_limiter *rl = &rate_limiters[i];
-		if (rl->suppressed > 0)
-			vk_log(rl->fac, LOG_WARNING,
-			       "Suppressed %"PRIu64" (out of %"PRIu64") %s",
-			       rl->suppressed, rl->total, rl->name);
-		rl->total = 0;
-		rl->suppressed = 0;
+	if (tag_skip(tag, id, 0))
+		return conf.pret;
+
+	/* Allocate on first use and resize idle logline if scratch size
+	 * was adapted or the formats were reloaded. */
+	if (unlikely(!lp || ((lp->scratch_size != conf.scratch_size ||
+			      lp->gen != conf.gen) && !lp->t_first))) {
+		if (lp)
+			logline_free(lp);
+		lp = inst->lp = logline_new(inst->idx, id);
 	}
 
-	rate_limiter_t_curr = now;
+	lp->id = id;
+
+	return parse_logline(inst, lp, tag, len, spec, ptr, 0);
 }
 
 
 /**
- * Rate limiter.
- * Returns 1 if the threshold has been reached (DROP), or 0 if not (PASS)
+ * Replayed frames have no instance: use the first one.
  */
-static inline int rate_limit (rl_type_t type) {
-	struct rate_limiter *rl = &rate_limiters[type];
+static int parse_tag (void *priv, enum VSL_tag_e tag, unsigned id,
+		      unsigned len, unsigned spec, const char *ptr,
+		      uint64_t bitmap) {
+	return parse_vslq(&conf.instances[0], tag, id, spec, ptr, len);
+}
+#endif
 
-	if (++rl->total > conf.log_rate) {
-		rl->suppressed++;
-		return 1;
-	}
 
+/**
+ * vk_raw_frame_decode() callback: feeds each replayed tag to parse_tag().
+ * 'opaque' points to the frame's sequence number which is restored
+ * so that %n renders the original sequence number.
+ */
+static int raw_replay_tag (void *opaque, int tag, unsigned int spec,
+			   const char *ptr, unsigned int len) {
+	conf.sequence_number = *(uint64_t *)opaque - conf.shard_cnt;
+	parse_tag(NULL, tag, 0, len, spec, ptr, 0);
 	return 0;
 }
 
 
 /**
- * Kafka outputter
+ * Render raw passthrough frames read from 'path' ("-" for stdin)
+ * through the configured formats and output.
+ * If message.batch.records > 1 each frame is expected to be prefixed
+ * by its varint encoded length, as produced by message coalescing.
+ * 'path' may also be a capture.file ring.
+ *
+ * Returns 0 on success or -1 on error.
  */
-void out_kafka (struct fmt_conf *fconf, struct logline *lp,
-		const char *buf, size_t len) {
+static int raw_replay (const char *path) {
+	char errstr[256];
+	size_t size = 65536;
+	size_t len = 0;
+	uint64_t seq = 0;
+	char *buf, *ring = NULL;
+	size_t ring_len;
+	int prefixed = -1;  /* Unknown until the first bytes are read */
+	FILE *fp;
+	int ret = 0;
+
+	if (!strcmp(path, "-"))
+		fp = stdin;
+	else if ((ret = vk_raw_ring_read(path, &ring, &ring_len,
+					 errstr, sizeof(errstr))) == -1) {
+		vk_log("REPLAY", LOG_ERR, "%s", errstr);
+		return -1;
+	} else if (ret == 1) {
+		/* Capture ring: frames are not length prefixed */
+		ret = 0;
+		prefixed = 0;
+		if (!ring_len) {
+			free(ring);
+			return 0;
+		}
+		if (!(fp = fmemopen(ring, ring_len, "r"))) {
+			vk_log("REPLAY", LOG_ERR, "Failed to read %s: %s",
+			       path, strerror(errno));
+			free(ring);
+			return -1;
+		}
+	} else if (!(fp = fopen(path, "r"))) {
+		vk_log("REPLAY", LOG_ERR, "Failed to open %s: %s",
+		       path, strerror(errno));
+		return -1;
+	}
 
-	/* If 'buf' is the key we simply store it for later use
-	 * when the message is produced. */
-	if (fconf->fid == FMT_CONF_KEY) {
-		assert(!lp->key);
-		lp->key = malloc(len);
-		lp->key_len = len;
-		memcpy(lp->key, buf, len);
-		return;
+	buf = malloc(size);
+
+	while (conf.run) {
+		size_t r = fread(buf+len, 1, size-len, fp);
+		size_t of = 0;
+
+		len += r;
+
+		/* Bare frames start with the "VK" magic, while coalesced
+		 * records start with a varint length prefix: a one byte
+		 * prefix may be 'V' but is then followed by 'V', not 'K'. */
+		if (prefixed == -1) {
+			if (len < 2 && r > 0)
+				continue;
+			prefixed = !(len >= 2 &&
+				     buf[0] == VK_RAW_MAGIC0 &&
+				     buf[1] == VK_RAW_MAGIC1);
+		}
+
+		while (of < len) {
+			size_t pfx = 0;
+			ssize_t flen;
+
+			/* Skip varint length prefix of coalesced records */
+			if (prefixed) {
+				while (of + pfx < len &&
+				       (buf[of+pfx] & 0x80))
+					pfx++;
+				if (of + pfx++ >= len)
+					break;
+			}
+
+			flen = vk_raw_frame_decode(buf+of+pfx, len-of-pfx,
+						   &seq, raw_replay_tag, &seq,
+						   errstr, sizeof(errstr));
+			if (flen == -1) {
+				vk_log("REPLAY", LOG_ERR,
+				       "%s: frame at offset %zd: %s",
+				       path, of, errstr);
+				ret = -1;
+				goto done;
+			} else if (flen == 0)
+				break;
+
+			of += pfx + flen;
+		}
+
+		/* Move partial frame to the start of the buffer */
+		len -= of;
+		memmove(buf, buf+of, len);
+		if (len == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+
+		if (r == 0) {
+			if (len > 0)
+				vk_log("REPLAY", LOG_WARNING,
+				       "%s: ignoring %zd bytes of truncated "
+				       "trailing frame", path, len);
+			break;
+		}
 	}
 
-	if (rd_kafka_produce(rkt, conf.partition, RD_KAFKA_MSG_F_COPY,
-			     (void *)buf, len,
-			     lp->key, lp->key_len, NULL) == -1) {
-		cnt.txerr++;
-		if (!rate_limit(RL_KAFKA_PRODUCE_ERR))
-			vk_log("PRODUCE", LOG_WARNING,
-			       "Failed to produce Kafka message "
-			       "(seq %"PRIu64"): %s (%i messages in outq)",
-			       lp->seq, strerror(errno), rd_kafka_outq_len(rk));
+done:
+	free(buf);
+	if (fp != stdin)
+		fclose(fp);
+	free(ring);
+
+	return ret;
+}
+
+
+/**
+ * Apply VSL argument 'c' with value 'arg' (command line or varnish.arg.*).
+ * The first -n selects the instance of the default VSL handle, each
+ * following -n adds another Varnish instance (up to VK_INSTANCES_MAX).
+ * All other arguments are remembered and applied to every additional
+ * instance in instances_init().
+ *
+ * Returns the VSL_Arg() return value: 1 on success, 0 if the argument
+ * is not a VSL argument or -1 on error.
+ */
+int vsl_arg (int c, const char *arg) {
+	int r;
+
+	if (c == 'n' && conf.instance_cnt > 0) {
+		if (conf.instance_cnt == VK_INSTANCES_MAX) {
+			vk_log("VSL", LOG_ERR,
+			       "Too many Varnish instances (max %i)",
+			       VK_INSTANCES_MAX);
+			return -1;
+		}
+		conf.instances[conf.instance_cnt++].name = strdup(arg);
+		return 1;
 	}
 
-	rd_kafka_poll(rk, 0);
-}
+#ifndef VK_VSLQ
+	if ((r = VSL_Arg(vd, c, arg ? strdup(arg) : NULL)) != 1)
+		return r;
+#else
+	if ((r = vk_vslq_arg(conf.instances[0].vslq, c, arg)) != 1)
+		return r;
+#endif
 
+	if (c == 'r')
+		conf.r_flag = 1;
 
-/**
- * Stdout outputter
- */
-void out_stdout (struct fmt_conf *fconf, struct logline *lp,
-		 const char *buf, size_t len) {
-	printf("%.*s\n", (int)len, buf);
-}
+	if (c == 'n') {
+		conf.instances[0].name = strdup(arg);
+		conf.instance_cnt = 1;
+	} else if (vsl_arg_cnt < VSL_ARGS_MAX) {
+		vsl_args[vsl_arg_cnt].c = c;
+		vsl_args[vsl_arg_cnt].arg = arg ? strdup(arg) : NULL;
+		vsl_arg_cnt++;
+	}
 
-/**
- * Null outputter
- */
-void out_null (struct fmt_conf *fconf, struct logline *lp,
-	       const char *buf, size_t len) {
+	return r;
 }
 
 
+#ifdef VK_VSLQ
 /**
- * Currently selected outputter.
+ * vk_vslq_dispatch() callback for reader threads: serializes parse_vslq().
  */
-void (*outfunc) (struct fmt_conf *fconf, struct logline *lp,
-		 const char *buf, size_t len) = out_kafka;
+static int parse_vslq_locked (void *opaque, int tag, unsigned int id,
+			      unsigned int spec, const char *ptr,
+			      unsigned int len) {
+	int r;
 
+	pthread_mutex_lock(&parse_lock);
+	r = parse_vslq(opaque, tag, id, spec, ptr, len);
+	pthread_mutex_unlock(&parse_lock);
 
+	return r;
+}
+#else
 /**
- * Kafka error callback
+ * VSL_Dispatch() callback for reader threads: serializes parse_tag().
  */
-static void kafka_error_cb (rd_kafka_t *rk, int err,
-			    const char *reason, void *opaque) {
-	if (!rate_limit(RL_KAFKA_ERROR_CB))
-		vk_log("KAFKAERR", LOG_ERR,
-		       "Kafka error (%i): %s", err, reason);
-}
+static int parse_tag_locked (void *priv, enum VSL_tag_e tag, unsigned id,
+			     unsigned len, unsigned spec, const char *ptr,
+			     uint64_t bitmap) {
+	int r;
 
+	pthread_mutex_lock(&parse_lock);
+	r = parse_tag(priv, tag, id, len, spec, ptr, bitmap);
+	pthread_mutex_unlock(&parse_lock);
 
-/**
- * Kafka message delivery report callback.
- * Called for each delivered (or failed delivery) message.
- * NOTE: If the dr callback is not to be used it can be turned off to
- *       improve performance.
- */
-static void kafka_dr_cb (rd_kafka_t *rk,
-			 void *payload, size_t len,
-			 int error_code,
-			 void *opaque, void *msg_opaque) {
-	_DBG("Kafka delivery report: error=%i, size=%zd", error_code, len);
-	if (unlikely(error_code)) {
-		cnt.kafka_drerr++;
-		if (conf.log_kafka_msg_error && !rate_limit(RL_KAFKA_DR_ERR))
-			vk_log("KAFKADR", LOG_NOTICE,
-			       "Kafka message delivery error: %s",
-			       rd_kafka_err2str(error_code));
-	}
+	return r;
 }
+#endif
+
 
 /**
- * Kafka statistics callback.
+ * Set up VSL handles for all configured Varnish instances.
+ * Client communication (-c) is always included, backend communication
+ * only with join.backend.
  */
-static int kafka_stats_cb (rd_kafka_t *rk, char *json, size_t json_len,
-			    void *opaque) {
-	vk_log_stats("{ \"kafka\": %s }\n", json);
-	return 0;
-}
+static void instances_init (void) {
+	int i, j;
 
+	if (conf.instance_cnt == 0)
+		conf.instance_cnt = 1;
 
-static void render_match_string (struct fmt_conf *fconf, struct logline *lp) {
-	char buf[8192];
-	int  of = 0;
-	int  i;
+#ifdef VK_VSLQ
+	/* VSLQ request grouping only hands over client requests. */
+	for (i = 0 ; i < conf.instance_cnt ; i++) {
+		struct vk_instance *inst = &conf.instances[i];
 
-	/* Render each formatter in order. */
-	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
-		const void *ptr;
-		int len = lp->match[fconf->fid][i].len;
+		inst->idx = i;
 
-		/* Either use accumulated value, or the default value. */
-		if (len) {
-			ptr = lp->match[fconf->fid][i].ptr;
-		} else {
-			ptr = fconf->fmt[i].def;
-			len = fconf->fmt[i].deflen;
+		if (i > 0) {
+			inst->vslq = vk_vslq_new();
+			vk_vslq_arg(inst->vslq, 'n', inst->name);
+			for (j = 0 ; j < vsl_arg_cnt ; j++)
+				vk_vslq_arg(inst->vslq, vsl_args[j].c,
+					    vsl_args[j].arg);
 		}
-
-		if (of + len >= sizeof(buf))
-			break;
-
-		memcpy(buf+of, ptr, len);
-		of += len;
 	}
+#else
+	conf.instances[0].vd = vd;
 
-	/* Pass rendered log line to outputter function */
-	cnt.tx++;
-	outfunc(fconf, lp, buf, of);
-}
+	for (i = 0 ; i < conf.instance_cnt ; i++) {
+		struct vk_instance *inst = &conf.instances[i];
 
+		inst->idx = i;
 
-static void render_match_json (struct fmt_conf *fconf, struct logline *lp) {
-	yajl_gen g;
-	int      i;
-	const unsigned char *buf;
-#if YAJL_MAJOR < 2
-	unsigned int buflen;
-#else
-	size_t   buflen;
-#endif
+		if (i > 0) {
+			inst->vd = VSM_New();
+			VSL_Setup(inst->vd);
+			VSL_Arg(inst->vd, 'n', inst->name);
+			for (j = 0 ; j < vsl_arg_cnt ; j++)
+				VSL_Arg(inst->vd, vsl_args[j].c,
+					vsl_args[j].arg);
+		}
 
-#if YAJL_MAJOR < 2
-	g = yajl_gen_alloc(NULL, NULL);
-#else
-	g = yajl_gen_alloc(NULL);
+		/* Backend records are needed for join.backend */
+		if (!conf.join_backend)
+			VSL_Arg(inst->vd, 'c', NULL);
+	}
 #endif
-	yajl_gen_map_open(g);
-
-	/* Render each formatter in order. */
-	for (i = 0 ; i < fconf->fmt_cnt ; i++) {
-		const void *ptr;
-		int len = lp->match[fconf->fid][i].len;
+}
 
-		/* Skip constant strings */
-		if (fconf->fmt[i].id == 0)
-			continue;
 
-		/* Either use accumulated value, or the default value. */
-		if (len) {
-			ptr = lp->match[fconf->fid][i].ptr;
-		} else {
-			ptr = fconf->fmt[i].def;
-			len = fconf->fmt[i].deflen;
-		}
+/**
+ * Read and dispatch available VSL records of instance 'inst',
+ * serializing parsing on 'parse_lock' if 'locked' is set.
+ * Returns -1 when the VSL reader has failed or was stopped.
+ */
+static int instance_dispatch (struct vk_instance *inst, int locked) {
+#ifdef VK_VSLQ
+	uint64_t overruns = vk_vslq_overruns(inst->vslq);
+	int r;
 
-		/* Field name */
-		if (likely(fconf->fmt[i].name != NULL))
-			yajl_gen_string(g, (unsigned char *)fconf->fmt[i].name,
-					fconf->fmt[i].namelen);
-		else {
-			char name = (char)fconf->fmt[i].id;
-			yajl_gen_string(g, (unsigned char *)&name, 1);
-		}
+	r = vk_vslq_dispatch(inst->vslq,
+			     locked ? parse_vslq_locked : parse_vslq, inst);
 
-		/* Value */
-		switch (fconf->fmt[i].type)
-		{
-		case FMT_TYPE_STRING:
-			yajl_gen_string(g, ptr, len);
-			break;
-		case FMT_TYPE_NUMBER:
-			if (len == 3 && !strncasecmp(ptr, "nan", 3)) {
-				/* There is no NaN in JSON, encode as null */
-				ptr = "null";
-				len = 4;
-			}
-			yajl_gen_number(g, ptr, len);
-			break;
-		}
+	/* Requests lost to VSL overruns are never handed to us. */
+	if (unlikely(vk_vslq_overruns(inst->vslq) != overruns)) {
+		if (locked)
+			pthread_mutex_lock(&parse_lock);
+		cnt.vsl_overrun += vk_vslq_overruns(inst->vslq) - overruns;
+		if (locked)
+			pthread_mutex_unlock(&parse_lock);
 	}
 
-	yajl_gen_map_close(g);
+	return r;
+#else
+	return VSL_Dispatch(inst->vd,
+			    locked ? parse_tag_locked : parse_tag, inst);
+#endif
+}
 
-	yajl_gen_get_buf(g, &buf, &buflen);
 
-	/* Pass rendered log line to outputter function */
-	outfunc(fconf, lp, (const char *)buf, buflen);
+/**
+ * Reader thread main loop, one per Varnish instance when more than
+ * one instance is configured.
+ * The VSL shared memory is read concurrently by each instance's thread,
+ * while logline matching, rendering and output is serialized on
+ * 'parse_lock'.
+ */
+static void *instance_reader (void *arg) {
+	struct vk_instance *inst = arg;
+	sigset_t set;
+
+	/* Signals are handled by the main thread. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (conf.run && instance_dispatch(inst, 1) >= 0)
+		;
+
+	if (conf.run) {
+		vk_log("VSL", LOG_ERR,
+		       "Varnish instance %s: VSL reader failed: terminating",
+		       inst->name ? inst->name : "(default)");
+		conf.run = 0;
+	}
 
-	yajl_gen_clear(g);
-	yajl_gen_free(g);
+	return NULL;
 }
 
+
 /**
- * Render an accumulated logline to string and pass it to the output function.
+ * Start reader threads for all Varnish instances.
  */
-static void render_match (struct logline *lp, uint64_t seq) {
+static void instances_start (void) {
 	int i;
 
-	lp->seq = seq;
+	for (i = 0 ; i < conf.instance_cnt ; i++) {
+		struct vk_instance *inst = &conf.instances[i];
 
-	/* Render fmt_confs in reverse order so KEY is available for MAIN */
-	for (i = conf.fconf_cnt-1 ; i >= 0 ; i--) {
-		struct fmt_conf *fconf = &conf.fconf[i];
-		switch (fconf->encoding)
-		{
-		case VK_ENC_STRING:
-			render_match_string(fconf, lp);
-			break;
-		case VK_ENC_JSON:
-			render_match_json(fconf, lp);
-			break;
+		if ((errno = pthread_create(&inst->thread, NULL,
+					    instance_reader, inst))) {
+			vk_log("VSL", LOG_ERR,
+			       "Failed to create reader thread for "
+			       "Varnish instance %s: %s",
+			       inst->name ? inst->name : "(default)",
+			       strerror(errno));
+			exit(1);
 		}
 	}
 }
 
 
-
 /**
- * Initialize log line lookup hash
+ * Wait for reader threads to exit.
  */
-static void loglines_init (void) {
-	loglines = calloc(sizeof(*loglines), conf.loglines_hsize);
+static void instances_stop (void) {
+	int i;
+
+	for (i = 0 ; i < conf.instance_cnt ; i++)
+		pthread_join(conf.instances[i].thread, NULL);
 }
 
+
 /**
- * Returns the hash key (bucket) for a given log id
+ * varnishkafka logger
  */
-#define logline_hkey(id) ((id) % conf.loglines_hsize)
-
-
 /**
- * Resets the given logline and makes it ready for accumulating a new request.
+ * Asynchronous logging (log.queue.size).
+ *
+ * vk_log0() is called from any thread, including the parsing and Kafka
+ * produce paths, so log records are formatted into a slot of a bounded
+ * multi-producer ring and written to syslog/stderr by the logger thread.
+ * When the ring is full the record is dropped (and counted) rather than
+ * blocking the caller.
+ * Before the logger thread is started, and after it is stopped, records
+ * are written synchronously.
  */
-static void logline_reset (struct logline *lp) {
-	int i;
-	struct tmpbuf *tmpbuf;
-
-	/* Clear logline, except for scratch pad since it will be overwritten */
-
-	for (i = 0 ; i < conf.fconf_cnt ; i++)
-		memset(lp->match[i], 0,
-		       conf.fconf[i].fmt_cnt * sizeof(*lp->match[i]));
-
-	/* Free temporary buffers */
-	while ((tmpbuf = lp->tmpbuf)) {
-		lp->tmpbuf = tmpbuf->next;
-		free(tmpbuf);
-	}
-	
-	if (lp->key) {
-		free(lp->key);
-		lp->key = NULL;
-		lp->key_len = 0;
-	}
+#define LOGQ_MSG_MAX  8192  /* Same limit as synchronous logging */
 
-	lp->seq       = 0;
-	lp->sof       = 0;
-	lp->tags_seen = 0;
-	lp->t_last    = time(NULL);
-}
+static struct {
+	struct logq_slot {
+		/* Ring position the slot is ready for:
+		 *   pos     free, for the producer of position 'pos'
+		 *   pos+1   written, for the logger thread */
+		uint64_t seq;
+		int      level;
+		char     facility[32];
+		char     msg[LOGQ_MSG_MAX];
+	} *slots;
+	uint64_t   mask;
+	uint64_t   head;      /* Next position to produce */
+	uint64_t   tail;      /* Next position to write (logger thread) */
+	int        run;
+	int        wakeup[2]; /* Logger thread wakeup pipe */
+	pthread_t  thread;
+} logq;
 
 
 /**
- * Free up all loglines.
+ * Write a single log record to the configured log destinations.
  */
-static void loglines_term (void) {
-	unsigned int hkey;
-	for (hkey = 0 ; hkey < conf.loglines_hsize ; hkey++) {
-		struct logline *lp;
-		while ((lp = LIST_FIRST(&loglines[hkey].lps))) {
-			logline_reset(lp);
-			LIST_REMOVE(lp, link);
-			free(lp);
-			logline_cnt--;
-		}
-	}
-	free(loglines);
+static void log_write (int level, const char *facility, const char *msg) {
+	if (conf.log_to & VK_LOG_SYSLOG)
+		syslog(level, "%s: %s", facility, msg);
+
+	if (conf.log_to & VK_LOG_STDERR)
+		fprintf(stderr, "%%%i %s: %s\n", level, facility, msg);
 }
 
 
 /**
- * Returns a logline.
+ * Format and enqueue a log record for the logger thread.
+ * Returns 0 on success or -1 if the ring is full.
  */
-static inline struct logline *logline_get (unsigned int id) {
-	struct logline *lp, *oldest = NULL;
-	unsigned int hkey = logline_hkey(id);
-	int i;
-	char *ptr;
-
-	LIST_FOREACH(lp, &loglines[hkey].lps, link) {
-		if (lp->id == id) {
-			/* Cache hit: return existing logline */
-			loglines[hkey].hit++;
-			return lp;
-		} else if (loglines[hkey].cnt > conf.loglines_hmax &&
-			   lp->tags_seen &&
-			   (!oldest || lp->t_last < oldest->t_last))
-			oldest = lp;
-	}
-
-	/* Cache miss */
-	loglines[hkey].miss++;
-
-	if (oldest) {
-		/* Remove oldest entry.
-		 * We will not loose a log record here since this only
-		 * matches when 'tags_seen' is zero. */
-		LIST_REMOVE(oldest, link);
-		loglines[hkey].cnt--;
-		loglines[hkey].purge++;
-		free(oldest);
-		logline_cnt--;
-	}
-
-	/* Allocate and set up new logline */
-	lp = malloc(sizeof(*lp) + conf.scratch_size +
-		    (conf.total_fmt_cnt * sizeof(*lp->match[0])));
-	memset(lp, 0, sizeof(*lp));
-	lp->id = id;
-	ptr = (char *)(lp+1) + conf.scratch_size;
-	for (i = 0 ; i < conf.fconf_cnt ; i++) {
-		size_t msize = conf.fconf[i].fmt_cnt * sizeof(*lp->match[i]);
-		lp->match[i] = (struct match *)ptr;
-		memset(lp->match[i], 0, msize);
-		ptr += msize;
+static int logq_push (int level, const char *facility,
+		      const char *fmt, va_list ap) {
+	uint64_t pos = __atomic_load_n(&logq.head, __ATOMIC_RELAXED);
+	struct logq_slot *slot;
+
+	/* Claim the slot for position 'pos' */
+	while (1) {
+		int64_t dif;
+
+		slot = &logq.slots[pos & logq.mask];
+		dif = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+				pos);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&logq.head, &pos,
+							pos + 1, 0,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return -1; /* Full */
+		else
+			pos = __atomic_load_n(&logq.head, __ATOMIC_RELAXED);
 	}
 
-	LIST_INSERT_HEAD(&loglines[hkey].lps, lp, link);
-	loglines[hkey].cnt++;
-	logline_cnt++;
-
-	return lp;
-}
+	slot->level = level;
+	snprintf(slot->facility, sizeof(slot->facility), "%s", facility);
+	vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
 
+	/* Publish to the logger thread */
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 
+	/* write() is async-signal safe, for logging from signal handlers. */
+	if (write(logq.wakeup[1], "", 1) == -1) {
+		/* Pipe full: the logger thread is already woken up */
+	}
 
+	return 0;
+}
 
 
 /**
- * Given a single tag 'tagid' with its data 'ptr' and 'len';
- * try to match it to the registered format tags.
- *
- * Returns 1 if the line is done and can be rendered, else 0.
+ * Write all enqueued log records, oldest first.
  */
-static int tag_match (struct logline *lp, int spec, enum VSL_tag_e tagid,
-		      const char *ptr, int len) {
-	const struct tag *tag;
-
-	/* Iterate through all handlers for this tag. */
-	for (tag = conf.tag[tagid] ; tag ; tag = tag->next) {
-		const char *ptr2;
-		int len2;
+static void logq_drain (void) {
+	while (1) {
+		struct logq_slot *slot = &logq.slots[logq.tail & logq.mask];
 
-		/* Value already assigned */
-		if (lp->match[tag->fid][tag->fmt->idx].ptr)
-			continue;
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+		    logq.tail + 1)
+			break;
 
-		/* Match spec (client or backend) */
-		if (!(tag->spec & spec))
-			continue;
+		log_write(slot->level, slot->facility, slot->msg);
 
-		if (tag->var && !(tag->flags & TAG_F_NOVARMATCH)) {
-			const char *t;
-			
-			/* Variable match ("Varname: value") */
-			if (!(t = strnchr(ptr, len, ':')))
-				continue;
-			
-			if (tag->varlen != (int)(t-ptr) ||
-			    strncasecmp(ptr, tag->var, tag->varlen))
-				continue;
+		/* Hand the slot back to producers for the next lap */
+		__atomic_store_n(&slot->seq, logq.tail + logq.mask + 1,
+				 __ATOMIC_RELEASE);
+		logq.tail++;
+	}
+}
 
-			if (likely(len > tag->varlen + 1 /* ":" */)) {
-				ptr2 = t+1; /* ":" */
-                                /* Strip leading whitespaces */
-                                while (*ptr2 == ' ' && ptr2 < ptr+len)
-                                        ptr2++;
-				len2 = len - (int)(ptr2-ptr);
-			} else {
-				/* Empty value */
-				len2 = 0;
-				ptr2 = NULL;
-			}
 
-		} else {
-			ptr2 = ptr;
-			len2 = len;
+/**
+ * Logger thread main loop.
+ */
+static void *logq_main (void *arg) {
+	uint64_t dropped = 0;
+	sigset_t set;
+	char buf[64];
+
+	/* Signals are handled by the main thread. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	while (1) {
+		struct pollfd pfd = { .fd = logq.wakeup[0], .events = POLLIN };
+		uint64_t d;
+
+		logq_drain();
+
+		d = __atomic_load_n(&cnt.log_dropped, __ATOMIC_RELAXED);
+		if (d != dropped) {
+			snprintf(buf, sizeof(buf),
+				 "%"PRIu64" log messages dropped "
+				 "(log queue full)", d - dropped);
+			log_write(LOG_WARNING, "LOG", buf);
+			dropped = d;
 		}
 
-		/* Get specified column if specified. */
-		if (tag->col)
-			if (!column_get(tag->col, ' ', ptr2, len2,
-					&ptr2, &len2))
-				continue;
-
-		if (tag->parser) {
-			/* Pass value to parser which will assign it. */
-			tag->parser(tag, lp, ptr2, len2);
-			
-		} else {
-			/* Fallback to verbatim field. */
-			match_assign(tag, lp, ptr2, len2);
-		}
+		if (!__atomic_load_n(&logq.run, __ATOMIC_ACQUIRE))
+			break;
 
+		if (poll(&pfd, 1, 1000) > 0)
+			while (read(logq.wakeup[0], buf, sizeof(buf)) > 0)
+				;
 	}
 
-	/* Request end: render the match string. */
-	if (tagid == SLT_ReqEnd)
-		return 1;
-	else
-		return 0;
+	return NULL;
 }
 
 
 /**
- * VSL_Dispatch() callback called for each tag read from the VSL.
+ * Start the logger thread with a ring of log.queue.size records.
+ * Logging stays synchronous if the queue size is 0 or on failure.
  */
-static int parse_tag (void *priv, enum VSL_tag_e tag, unsigned id,
-		      unsigned len, unsigned spec, const char *ptr,
-		      uint64_t bitmap) {
-	struct logline *lp;
-	int    is_complete = 0;
-
-	if (unlikely(!spec))
-		return conf.pret;
-
-	if (0)
-		_DBG("[%u] #%-3i %-12s %c %.*s",
-		     id, tag, VSL_tags[tag],
-		     spec & VSL_S_CLIENT ? 'c' : 'b',
-		     len, ptr);
+static void logq_start (void) {
+	uint64_t size = 1, i;
 
-	if (unlikely(!(lp = logline_get(id))))
-		return -1;
+	if (conf.log_queue_size <= 0)
+		return;
 
-	/* Update bitfield of seen tags (-m regexp) */
-	lp->tags_seen |= bitmap;
+	while (size < (uint64_t)conf.log_queue_size)
+		size <<= 1;
 
-	/* Truncate data if exceeding configured max */
-	if (unlikely(len > conf.tag_size_max)) {
-		cnt.trunc++;
-		len = conf.tag_size_max;
+	if (pipe(logq.wakeup) == -1) {
+		vk_log("LOG", LOG_WARNING,
+		       "Failed to create log queue pipe: %s: "
+		       "logging synchronously", strerror(errno));
+		return;
 	}
-
-	/* Accumulate matched tag content */
-	if (likely(!(is_complete = tag_match(lp, spec, tag, ptr, len))))
-		return conf.pret;
-
-	/* Match tag regexp, if any */
-	if (conf.m_flag && !VSL_Matched(vd, lp->tags_seen)) {
-		logline_reset(lp);
-		return conf.pret;
+	fcntl(logq.wakeup[0], F_SETFL, O_NONBLOCK);
+	fcntl(logq.wakeup[1], F_SETFL, O_NONBLOCK);
+
+	logq.slots = malloc(size * sizeof(*logq.slots));
+	logq.mask = size - 1;
+	for (i = 0 ; i < size ; i++)
+		logq.slots[i].seq = i;
+	logq.head = logq.tail = 0;
+
+	__atomic_store_n(&logq.run, 1, __ATOMIC_RELEASE);
+
+	if ((errno = pthread_create(&logq.thread, NULL, logq_main, NULL))) {
+		logq.run = 0;
+		vk_log("LOG", LOG_WARNING,
+		       "Failed to start logger thread: %s: "
+		       "logging synchronously", strerror(errno));
+		close(logq.wakeup[0]);
+		close(logq.wakeup[1]);
+		free(logq.slots);
+		logq.slots = NULL;
 	}
-	
-	/* Log line is complete: render & output */
-	render_match(lp, ++conf.sequence_number);
+}
 
-	/* clean up */
-	logline_reset(lp);
 
-	/* Reuse fresh timestamp lp->t_last from logline_reset() */
-	if (unlikely(lp->t_last >= rate_limiter_t_curr + conf.log_rate_period))
-		rate_limiters_rollover(lp->t_last);
+/**
+ * Stop the logger thread after it has written all enqueued records,
+ * further logging is synchronous.
+ * Registered with atexit() so that records logged before an exit() are
+ * not lost.
+ */
+static void logq_stop (void) {
+	if (!logq.slots || !logq.run)
+		return;
 
-	/* Stats output */
-	if (conf.stats_interval) {
-		if (unlikely(conf.need_logrotate)) {
-			logrotate();
-		}
-		if (unlikely(lp->t_last >= conf.t_last_stats + conf.stats_interval)) {
-			print_stats();
-			conf.t_last_stats = lp->t_last;
-		}
+	__atomic_store_n(&logq.run, 0, __ATOMIC_RELEASE);
+	if (write(logq.wakeup[1], "", 1) == -1) {
+		/* Pipe full: the logger thread is already woken up */
 	}
+	pthread_join(logq.thread, NULL);
 
-	return conf.pret;
+	/* Records enqueued while the thread was exiting */
+	logq_drain();
 }
 
 
-/**
- * varnishkafka logger
- */
 void vk_log0 (const char *func, const char *file, int line,
 	      const char *facility, int level, const char *fmt, ...) {
 	va_list ap;
-	static char buf[8192];
+	char buf[LOGQ_MSG_MAX];
 
 	if (level > conf.log_level || !conf.log_to)
 		return;
 
+	if (__atomic_load_n(&logq.run, __ATOMIC_ACQUIRE)) {
+		int r;
+
+		va_start(ap, fmt);
+		r = logq_push(level, facility, fmt, ap);
+		va_end(ap);
+
+		if (r == -1)
+			__atomic_add_fetch(&cnt.log_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
 	va_start(ap, fmt);
 	vsnprintf(buf, sizeof(buf), fmt, ap);
 	va_end(ap);
 
-	if (conf.log_to & VK_LOG_SYSLOG)
-		syslog(level, "%s: %s", facility, buf);
-
-	if (conf.log_to & VK_LOG_STDERR)
-		fprintf(stderr, "%%%i %s: %s\n", level, facility, buf);
+	log_write(level, facility, buf);
 }
 
 /**
@@ -1886,6 +6563,20 @@ static void sig_hup(int sig) {
 	conf.need_logrotate = 1;
 }
 
+/**
+ * SIGUSR1 handler: request a logline cache dump.
+ */
+static void sig_usr1 (int sig) {
+	conf.need_cache_dump = 1;
+}
+
+/**
+ * SIGUSR2 handler: request a configuration reload.
+ */
+static void sig_usr2 (int sig) {
+	conf.need_reload = 1;
+}
+
 
 /**
  * Termination signal handler.
@@ -1912,7 +6603,10 @@ static void usage (const char *argv0) {
 		"varnishkafka version %s\n"
 		"Varnish log listener with Apache Kafka producer support\n"
 		"\n"
-		"Usage: %s [VSL_ARGS] [-S <config-file>]\n"
+		"Usage: %s [VSL_ARGS] [-S <config-file>] [-R <file>]\n"
+		"\n"
+		" -R <file>   Render raw passthrough frames from <file>\n"
+		"             (\"-\" for stdin) instead of reading the VSL\n"
 		"\n"
 		" VSL_ARGS are standard Varnish VSL arguments:\n"
 		"  %s\n"
@@ -1930,13 +6624,63 @@ static void usage (const char *argv0) {
 }
 
 
+/**
+ * Periodic housekeeping, called from the main loop when VSL_Dispatch()
+ * returns (idle) or at regular intervals with multiple Varnish instances.
+ */
+static void main_idle (void) {
+	if (conf.cpu_budget)
+		governor_check(vk_clock_us());
+
+	if (unlikely(conf.need_reload || gen_old.tag))
+		reload_check();
+
+	/* Dont hold back batched records when idle. */
+	if (conf.batch_records > 1)
+		batch_age_check(vk_clock_us());
+
+	/* Keep shm statistics (outq) fresh when idle. */
+	if (conf.stats_shm) {
+		time_t now = time(NULL);
+		if (now != conf.t_last_shm)
+			stats_shm_update(now);
+	}
+}
+
+
+/**
+ * Main loop for multiple Varnish instances: each instance is read by its
+ * own thread while the main thread serves Kafka delivery reports and
+ * housekeeping under the parse lock.
+ */
+static void instances_run (void) {
+	instances_start();
+
+	while (conf.run) {
+		pthread_mutex_lock(&parse_lock);
+		if (outfunc == out_kafka)
+			kafka_poll(0);
+		main_idle();
+		pthread_mutex_unlock(&parse_lock);
+
+		usleep(10000);
+	}
+
+	instances_stop();
+}
+
+
 int main (int argc, char **argv) {
 	char errstr[512];
+	int replay_err = 0;
 	char hostname[1024];
 	struct hostent *lh;
 	char c;
 	int r;
 	int i;
+	cpu_set_t cpus_main, cpus_orig, cpus_reader;
+
+	t_clock_start = vk_clock_us();
 
 	/*
 	 * Default configuration
@@ -1945,12 +6689,33 @@ int main (int argc, char **argv) {
 	conf.log_to    = VK_LOG_STDERR;
 	conf.log_rate  = 100;
 	conf.log_rate_period = 60;
+	conf.log_queue_size = 256;
 	conf.daemonize = 1;
 	conf.datacopy  = 1;
 	conf.tag_size_max   = 2048;
 	conf.loglines_hsize = 5000;
 	conf.loglines_hmax  = 5;
 	conf.scratch_size   = 4096;
+	conf.scratch_max    = 65536;
+	conf.scratch_headroom = 25;
+	conf.batch_records  = 1;
+	conf.batch_bytes    = 65536;
+	conf.batch_age_ms   = 1000;
+	conf.producers      = 1;
+	conf.prio_high_reserve = 20;
+	conf.tag_pushdown = 1;
+	conf.shard_cnt = 1;
+	conf.cpu_interval_ms = 1000;
+	conf.join_size = 16384;
+	conf.capture_max = 256;
+	conf.capture_file_size = 64 * 1024 * 1024;
+	conf.join_timeout_ms = 10000;
+	conf.reload_timeout_ms = 60000;
+	conf.sample_rate_max = 1024;
+	conf.kafka_queue_max = 1000000;
+	conf.kafka_msg_timeout_ms = 300000;
+	conf.part_batch_msgs = 1000;
+	conf.part_batch_ms  = 1000;
 	conf.stats_interval = 60;
 	conf.stats_file     = strdup("/tmp/varnishkafka.stats.json");
 	conf.log_kafka_msg_error = 1;
@@ -1967,9 +6732,7 @@ int main (int argc, char **argv) {
 	for (i = 0 ; i < FMT_CONF_NUM ; i++)
 		conf.fconf[i].fid = i;
 		
-	conf.format[FMT_CONF_MAIN] = "%l %n %t %{Varnish:time_firstbyte}x %h "
-		"%{Varnish:handling}x/%s %b %m http://%{Host}i%U%q - - "
-		"%{Referer}i %{X-Forwarded-For}i %{User-agent}i";
+	conf.format[FMT_CONF_MAIN] = fmt_main_default;
 
 	/* Construct logname (%l) from local hostname */
 	gethostname(hostname, sizeof(hostname)-1);
@@ -1979,11 +6742,15 @@ int main (int argc, char **argv) {
 
 
 	/* Create varnish shared memory handle */
+#ifdef VK_VSLQ
+	conf.instances[0].vslq = vk_vslq_new();
+#else
 	vd = VSM_New();
 	VSL_Setup(vd);
+#endif
 
 	/* Parse command line arguments */
-	while ((c = getopt(argc, argv, VSL_ARGS "hS:")) != -1) {
+	while ((c = getopt(argc, argv, VSL_ARGS "hS:R:")) != -1) {
 		switch (c) {
 		case 'h':
 			usage(argv[0]);
@@ -1991,11 +6758,21 @@ int main (int argc, char **argv) {
 		case 'S':
 			conf_file_path = optarg;
 			break;
+		case 'R':
+			conf.replay_path = optarg;
+			break;
 		case 'm':
 			conf.m_flag = 1;
 			/* FALLTHRU */
+		case 'i':
+		case 'x':
+		case 'I':
+		case 'X':
+			if (c != 'm')
+				conf.ix_flag = 1;
+			/* FALLTHRU */
 		default:
-			if ((r = VSL_Arg(vd, c, optarg)) == 0)
+			if ((r = vsl_arg(c, optarg)) == 0)
 				usage(argv[0]);
 			else if (r == -1)
 				exit(1); /* VSL_Arg prints error message */
@@ -2010,8 +6787,54 @@ int main (int argc, char **argv) {
 	if (!conf.topic)
 		usage(argv[0]);
 
-	/* Always include client communication (-c) */
-	VSL_Arg(vd, 'c', NULL);
+	/* Replayed raw frames are rendered, in the foreground. */
+	if (conf.replay_path) {
+		conf.passthrough = VK_PASSTHRU_NONE;
+		conf.daemonize = 0;
+		conf.shard_cnt = 1;
+		conf.shard_idx = 0;
+		/* Joined backend records are part of the frame. */
+		conf.join_backend = 0;
+	}
+
+#ifdef VK_VSLQ
+	if (conf.join_backend) {
+		vk_log("JOIN", LOG_ERR,
+		       "join.backend is not supported with the VSLQ API");
+		exit(1);
+	}
+#endif
+
+	/* Data read from files or replayed frames is not persistent. */
+	if (conf.replay_path || conf.r_flag)
+		conf.datacopy = 1;
+
+	/* Capture needs a predicate and a destination, passthrough frames
+	 * already carry all records. */
+	if (!(conf.capture_ttfb_ms || conf.capture_status) ||
+	    !(conf.capture_topic || conf.capture_file) ||
+	    conf.passthrough || conf.replay_path)
+		conf.capture_max = 0;
+
+	/* Captured records reference the live VSL, see capture_add() */
+#ifdef VK_VSLQ
+	conf.capture_copy = 1;
+#else
+	conf.capture_copy = conf.r_flag;
+#endif
+
+	if (conf.shard_idx < 0 || conf.shard_idx >= conf.shard_cnt) {
+		vk_log("SHARD", LOG_ERR,
+		       "shard.index %i out of range for shard.count %i",
+		       conf.shard_idx, conf.shard_cnt);
+		exit(1);
+	}
+
+	/* Interleave sequence numbers between shards */
+	conf.sequence_number += conf.shard_idx;
+
+	/* Set up VSL handles for all Varnish instances */
+	instances_init();
 
 	/* Set up syslog */
 	if (conf.log_to & VK_LOG_SYSLOG)
@@ -2037,6 +6860,13 @@ int main (int argc, char **argv) {
 }
 
 
+	/* Logline cache dump */
+	signal(SIGUSR1, sig_usr1);
+
+	/* Configuration reload */
+	if (!conf.replay_path)
+		signal(SIGUSR2, sig_usr2);
+
 	/* Termination signal handlers */
 	signal(SIGINT, sig_term);
 	signal(SIGTERM, sig_term);
@@ -2047,47 +6877,85 @@ int main (int argc, char **argv) {
 	/* Initialize base64 decoder */
 	VB64_init();
 
-	/* Space is the most common format separator so add it first
-	 * the the const string, followed by the typical default value "-". */
-	const_string_add(" -", 2);
+	/* Parse the formats and compile the topic routing
+	 * and priority class rules */
+	if (formats_init(errstr, sizeof(errstr)) == -1) {
+		vk_log("FMT", LOG_ERR, "%s", errstr);
+		exit(1);
+	}
 
-	/* Allocate room for format tag buckets. */
-	conf.tag = calloc(VSL_TAGS_MAX, sizeof(*conf.tag));
+	if (conf.log_level >= 7)
+		tag_dump();
 
-	/* Parse the format strings */
-	for (i = 0 ; i < FMT_CONF_NUM ; i++) {
-		if (!conf.format[i])
-			continue;
+	/* Subscribe to the tags referenced by the formats */
+	tags_subscribe();
 
-		if (format_parse(&conf.fconf[i], conf.format[i],
-				 errstr, sizeof(errstr)) == -1) {
-			vk_log("FMTPARSE", LOG_ERR,
-			       "Failed to parse %s format string: %s\n%s",
-			       fmt_conf_names[i], conf.format[i], errstr);
-			exit(1);
-		}
+	/* Set up capture destinations */
+	if (conf.capture_max && conf.capture_topic && outfunc == out_kafka)
+		capture.topic = topic_add(conf.capture_topic);
 
-		conf.fconf_cnt++;
-		conf.total_fmt_cnt += conf.fconf[i].fmt_cnt;
+	if (conf.capture_max && conf.capture_file &&
+	    !(capture.ring = vk_raw_ring_create(conf.capture_file,
+						conf.capture_file_size,
+						errstr, sizeof(errstr)))) {
+		vk_log("CAPTURE", LOG_ERR, "%s", errstr);
+		exit(1);
 	}
 
-	if (conf.fconf_cnt == 0) {
-		vk_log("FMT", LOG_ERR, "No formats defined");
+	/* Write derived Avro schemas and .proto files */
+	if (schema_write(errstr, sizeof(errstr)) == -1) {
+		vk_log("SCHEMA", LOG_ERR, "%s", errstr);
 		exit(1);
 	}
 
-	if (conf.log_level >= 7)
-		tag_dump();
+	/* Open the log file(s) */
+	for (i = 0 ; !conf.replay_path && i < conf.instance_cnt ; i++) {
+#ifdef VK_VSLQ
+		if (vk_vslq_open(conf.instances[i].vslq, VSL_tags,
+				 errstr, sizeof(errstr)) == -1) {
+			vk_log("VSLOPEN", LOG_ERR,
+			       "Failed to open Varnish VSL%s%s: %s\n",
+			       conf.instances[i].name ? " for instance " : "",
+			       conf.instances[i].name ?
+			       conf.instances[i].name : "",
+			       errstr);
+			exit(1);
+		}
+#else
+		if (VSL_Open(conf.instances[i].vd, 1) != 0) {
+			vk_log("VSLOPEN", LOG_ERR,
+			       "Failed to open Varnish VSL%s%s: %s\n",
+			       conf.instances[i].name ? " for instance " : "",
+			       conf.instances[i].name ?
+			       conf.instances[i].name : "",
+			       strerror(errno));
+			exit(1);
+		}
 
-	/* Open the log file */
-	if (VSL_Open(vd, 1) != 0) {
-		vk_log("VSLOPEN", LOG_ERR, "Failed to open Varnish VSL: %s\n",
-		       strerror(errno));
-		exit(1);
+		vsl_segment_get(&conf.instances[i]);
+#endif
 	}
 
 	/* Prepare logline cache */
+	/* Pin the reader (main) thread before allocating the logline cache
+	 * so that its memory is first touched, and thus allocated, on the
+	 * reader's NUMA node. The VSL reader threads created by the main
+	 * thread inherit this placement, helper threads do not (see below). */
+	if (conf.cpus_reader) {
+		pthread_getaffinity_np(pthread_self(),
+				       sizeof(cpus_orig), &cpus_orig);
+		if (affinity_set("reader", conf.cpus_reader) == -1)
+			exit(1);
+		pthread_getaffinity_np(pthread_self(),
+				       sizeof(cpus_reader), &cpus_reader);
+	}
+	placement_log("Reader");
+
 	loglines_init();
+#ifndef VK_VSLQ
+	if (conf.join_backend)
+		join_init();
+#endif
 
 	/* Daemonize if desired */
 	if (conf.daemonize) {
@@ -2099,28 +6967,97 @@ int main (int argc, char **argv) {
 		conf.log_to &= ~VK_LOG_STDERR;
 	}
 
+	/* The logger, metrics listener and librdkafka (without
+	 * cpu.affinity.kafka) threads are created on the CPUs the process
+	 * started with, leaving the reader CPUs to the VSL reader. */
+	if (conf.cpus_reader)
+		pthread_setaffinity_np(pthread_self(),
+				       sizeof(cpus_orig), &cpus_orig);
+
+	/* Start the logger thread (after daemon() which only keeps
+	 * the calling thread). */
+	logq_start();
+	atexit(logq_stop);
+
+	/* Create statistics shared memory segment, if configured. */
+	if (stats_shm_init(errstr, sizeof(errstr)) == -1) {
+		vk_log("STATS", LOG_ERR,
+		       "Failed to create statistics segment: %s", errstr);
+		exit(1);
+	}
+
+	/* Start metrics listener, if configured. */
+	if (conf.metrics_listen &&
+	    vk_metrics_start(conf.metrics_listen, conf.stats_shm,
+			     errstr, sizeof(errstr)) == -1) {
+		vk_log("METRICS", LOG_ERR,
+		       "Failed to start metrics listener on %s: %s",
+		       conf.metrics_listen, errstr);
+		exit(1);
+	}
+
 	/* Kafka outputter */
 	if (outfunc == out_kafka) {
-		/* Create Kafka handle */
-		if (!(rk = rd_kafka_new(RD_KAFKA_PRODUCER, conf.rk_conf,
-					errstr, sizeof(errstr)))) {
-			vk_log("KAFKANEW", LOG_ERR,
-			       "Failed to create kafka handle: %s", errstr);
+		/* Create Kafka handles.
+		 * librdkafka's threads inherit the affinity of the creating
+		 * thread so the main thread is temporarily moved to the
+		 * Kafka CPUs while the handles are created. */
+		if (conf.cpus_kafka) {
+			pthread_getaffinity_np(pthread_self(),
+					       sizeof(cpus_main), &cpus_main);
+			if (affinity_set("kafka", conf.cpus_kafka) == -1)
+				exit(1);
+		}
+
+		if (inflight_init(errstr, sizeof(errstr)) == -1) {
+			vk_log("KAFKA", LOG_ERR, "%s", errstr);
 			exit(1);
 		}
 
-		rd_kafka_set_log_level(rk, conf.log_level);
+		rks = calloc(conf.producers, sizeof(*rks));
+		kstats = calloc(conf.producers, sizeof(*kstats));
+
+		for (i = 0 ; i < conf.producers ; i++) {
+			rd_kafka_conf_t *rk_conf = conf.rk_conf;
+
+			/* The last producer takes the original config */
+			if (i < conf.producers - 1)
+				rk_conf = rd_kafka_conf_dup(conf.rk_conf);
+			rd_kafka_conf_set_opaque(rk_conf, &kstats[i]);
+
+			if (!(rks[i] = rd_kafka_new(RD_KAFKA_PRODUCER,
+						    rk_conf,
+						    errstr, sizeof(errstr)))) {
+				vk_log("KAFKANEW", LOG_ERR,
+				       "Failed to create kafka handle: %s",
+				       errstr);
+				exit(1);
+			}
+
+			rd_kafka_set_log_level(rks[i], conf.log_level);
+		}
+
+		if (conf.cpus_kafka) {
+			placement_log("Kafka");
+
+			/* Move the main thread back */
+			pthread_setaffinity_np(pthread_self(),
+					       sizeof(cpus_main), &cpus_main);
+		}
 
-		/* Create Kafka topic handle */
-		if (!(rkt = rd_kafka_topic_new(rk, conf.topic,
-					       conf.topic_conf))) {
+		/* Create Kafka topic handles */
+		if (topics_start(errstr, sizeof(errstr)) == -1) {
 			vk_log("KAFKANEW", LOG_ERR,
-			       "Invalid topic or configuration: %s: %s",
-			       conf.topic, strerror(errno));
+			       "Invalid topic or configuration: %s", errstr);
 			exit(1);
 		}
 	}
 
+	/* Back to the reader CPUs */
+	if (conf.cpus_reader)
+		pthread_setaffinity_np(pthread_self(),
+				       sizeof(cpus_reader), &cpus_reader);
+
 	/* Main dispatcher loop depending on outputter */
 	conf.run = 1;
 	conf.pret = 0;
@@ -2128,27 +7065,67 @@ int main (int argc, char **argv) {
 	if (outfunc == out_kafka) {
 		/* Kafka outputter */
 
-		while (conf.run && VSL_Dispatch(vd, parse_tag, NULL) >= 0)
-			rd_kafka_poll(rk, 0);
+		if (conf.replay_path)
+			replay_err = raw_replay(conf.replay_path);
+		else if (conf.instance_cnt > 1)
+			instances_run();
+		else {
+			while (conf.run &&
+			       instance_dispatch(&conf.instances[0], 0) >= 0) {
+				kafka_poll(0);
+				main_idle();
+			}
+		}
+
+		/* Produce any remaining batched records. */
+		batch_flush();
+		free(batch.buf);
+		free(batch.key);
 
 		/* Run until all kafka messages have been delivered
 		 * or we are stopped again */
 		conf.run = 1;
 
-		while (conf.run && rd_kafka_outq_len(rk) > 0)
-			rd_kafka_poll(rk, 100);
+		while (conf.run && kafka_outq_len() > 0)
+			kafka_poll(100);
 
-		rd_kafka_destroy(rk);
+		topics_stop();
+
+		for (i = 0 ; i < conf.producers ; i++)
+			rd_kafka_destroy(rks[i]);
+		free(rks);
+		rks = NULL;
+		free(kstats);
+		kstats = NULL;
 
 	} else {
 		/* Stdout outputter */
 
-		while (conf.run && VSL_Dispatch(vd, parse_tag, NULL) >= 0)
-			;
+		if (conf.replay_path)
+			replay_err = raw_replay(conf.replay_path);
+		else if (conf.instance_cnt > 1)
+			instances_run();
+		else
+			while (conf.run &&
+			       instance_dispatch(&conf.instances[0], 0) >= 0)
+				;
 
 	}
 
+	if (conf.metrics_listen)
+		vk_metrics_stop();
+
+	if (conf.stats_shm) {
+		stats_shm_update(time(NULL));
+		vk_shm_destroy(conf.stats_shm, conf.stats_shm_path);
+		conf.stats_shm = NULL;
+	}
+
 	loglines_term();
+#ifndef VK_VSLQ
+	if (conf.join_backend)
+		join_term();
+#endif
 	print_stats();
 
 	/* if stats_fp is set (i.e. open), close it. */
@@ -2158,8 +7135,20 @@ int main (int argc, char **argv) {
 	}
 	free(conf.stats_file);
 
+	if (capture.ring)
+		vk_raw_ring_destroy(capture.ring);
+	free(capture.buf);
+
 	rate_limiters_rollover(time(NULL));
 
-	VSM_Close(vd);
-	exit(0);
+	for (i = 0 ; !conf.replay_path && i < conf.instance_cnt ; i++) {
+#ifdef VK_VSLQ
+		vk_vslq_destroy(conf.instances[i].vslq);
+		if (conf.instances[i].lp)
+			logline_free(conf.instances[i].lp);
+#else
+		VSM_Close(conf.instances[i].vd);
+#endif
+	}
+	exit(replay_err ? 1 : 0);
 }
@@ -31,6 +31,7 @@
 #pragma once
 
 #include <sys/queue.h>
+#include <pthread.h>
 
 #ifndef likely
 #define likely(x)   __builtin_expect((x),1)
@@ -56,10 +57,26 @@ struct match {
 };
 
 
+/**
+ * VSL record captured for slow or failed requests (capture.*).
+ */
+struct capture_rec {
+	const char   *ptr;
+	unsigned int  len;
+	unsigned char tag;
+	unsigned char spec;
+};
+
+
 /* Format configurations */
 #define FMT_CONF_MAIN    0  /* Main format */
 #define FMT_CONF_KEY     1  /* Kafka key format */
-#define FMT_CONF_NUM     2
+#define FMT_CONF_OUT_NUM 2  /* Formats above are rendered and output,
+			     * formats below are selectors only used to
+			     * make decisions on the logline. */
+#define FMT_CONF_ROUTE   2  /* Topic routing selector */
+#define FMT_CONF_PRIO    3  /* Priority class selector */
+#define FMT_CONF_NUM     4
 
 
 /**
@@ -82,6 +99,9 @@ struct logline {
 	/* Log id */
 	unsigned int  id;
 
+	/* Varnish instance (index in conf.instances) */
+	int           inst;
+
 	/* Per fmt_conf logline matches */
 	struct match *match[FMT_CONF_NUM];
 
@@ -94,6 +114,37 @@ struct logline {
 	/* Last use of this logline */
 	time_t   t_last;
 
+	/* First tag seen for current request, 0 if idle */
+	time_t   t_first;
+
+	/* Request is sampled out by the CPU governor */
+	int      skip;
+
+	/* Zero-copy matches or captured records may have been
+	 * overwritten (VSL overrun) */
+	int      overrun;
+
+	/* Captured records, up to conf.capture_max (capture.*) */
+	struct capture_rec *capture;
+	int      capture_cnt;
+
+	/* Client response status (capture.status.min) */
+	int      status;
+
+	/* Client request xid from SLT_ReqStart (join.backend) */
+	unsigned int xid;
+
+	/* Format generation the match arrays are laid out for (conf.gen) */
+	unsigned int gen;
+
+	/* Request end time from SLT_ReqEnd (unix time in microseconds) */
+	uint64_t t_reqend;
+
+	/* Raw tag frame (passthrough mode) */
+	char    *raw;
+	size_t   raw_len;
+	size_t   raw_size;
+
 	/* Rendered FMT_CONF_KEY for use in _MAIN output func */
 	char    *key;
 	size_t   key_len;
@@ -102,9 +153,10 @@ struct logline {
 	struct tmpbuf *tmpbuf;
 
 	/* Scratch pad */
+	size_t   scratch_size;  /* Allocated scratch pad size */
 	int      sof;
 	char     scratch[0];  /* Must be at end of struct.
-			       * Allocated to conf.scratch_size bytes */
+			       * Allocated to .scratch_size bytes */
 };
 
 
@@ -143,12 +195,19 @@ struct fmt {
 	}     type;       /* output type (for JSON, et.al) */
 	int   flags;
 #define FMT_F_ESCAPE    0x1 /* Escape the value string */
+	const char *encname; /* Pre-encoded field name or tag
+			      * (binary encodings) */
+	int   encnamelen;    /* Pre-encoded field name length */
+	int   fieldnum;      /* Field number (protobuf), "@NAME#N" */
 };
 
 
 typedef enum {
 	VK_ENC_STRING,
 	VK_ENC_JSON,
+	VK_ENC_MSGPACK,
+	VK_ENC_AVRO,
+	VK_ENC_PROTOBUF,
 } fmt_enc_t;
 
 struct fmt_conf {
@@ -156,9 +215,101 @@ struct fmt_conf {
 	struct fmt *fmt;
 	int         fmt_cnt;
 	int         fmt_size;
+	int         field_cnt;  /* Number of non-constant formatters */
 
 	int         fid;  /* conf.fconf index */
 	fmt_enc_t   encoding;
+
+	char       *format;     /* Parsed (legacy-replaced) format string,
+				 * field names point into it. */
+
+	char       *schema;     /* Derived schema (Avro, .proto) */
+	uint64_t    schema_fp;  /* Schema fingerprint (CRC-64-AVRO) */
+};
+
+
+/**
+ * Per producer (kafka.producers) instance of a topic.
+ */
+struct vk_topic_inst {
+	struct vk_topic  *topic;
+	rd_kafka_topic_t *rkt;
+
+	/* Sticky and roundrobin partitioner state */
+	int32_t           part_curr;   /* Current partition, -1 if none */
+	int               part_msgs;   /* Messages to current partition */
+	uint64_t          t_part;      /* Time current partition was picked */
+};
+
+
+/**
+ * Kafka topic.
+ * topics[0] is the default topic (kafka.topic), the others are
+ * added by topic routing rules.
+ */
+struct vk_topic {
+	char             *name;
+	struct vk_topic_inst *inst;    /* Per producer instances */
+	uint64_t          tx;      /* Messages produced */
+	uint64_t          txerr;   /* Produce failures */
+
+	/* Per partition enqueue counts, the last entry also counts
+	 * all higher partitions. */
+#define VK_TOPIC_PARTITIONS_MAX 256
+	uint64_t          part_enq[VK_TOPIC_PARTITIONS_MAX];
+	int               part_max;    /* Highest partition seen + 1 */
+};
+
+
+/**
+ * Selector value rule, mapping a rendered selector value to a target:
+ *   topic.route.<value> = <topic>
+ *   priority.match.<value> = <class>
+ * Rules whose value ends with '*' match by prefix.
+ */
+struct vk_route {
+	struct vk_route *next;     /* Configuration order */
+	struct vk_route *hnext;    /* Hash chain */
+	char            *value;
+	int              len;
+	int              prefix;   /* Prefix match */
+	char            *target;   /* Target name */
+	int              idx;      /* Target index: topics[], priority */
+};
+
+
+/**
+ * Priority classes
+ */
+#define VK_PRIO_NORMAL  0
+#define VK_PRIO_HIGH    1
+#define VK_PRIO_NUM     2
+
+
+/**
+ * Varnish instance (varnish.arg.n), each with its own VSL reader.
+ */
+#define VK_INSTANCES_MAX  8
+
+struct vk_instance {
+	int              idx;
+	char            *name;      /* -n instance name, NULL for default */
+	pthread_t        thread;    /* Reader thread (multiple instances) */
+
+#ifdef VK_VSLQ
+	struct vk_vslq  *vslq;
+	struct logline  *lp;        /* Current request, see parse_vslq() */
+#else
+	struct VSM_data *vd;
+
+	/* VSL log segment, for overrun detection in zero-copy mode
+	 * and of captured records.
+	 * vsl_start[0] is bumped by varnishd each time the log wraps. */
+	const volatile uint32_t *vsl_start;
+	const char      *vsl_end;
+	uint32_t         vsl_wrap;  /* Last seen wrap count */
+	unsigned         vsm_seq;   /* VSM allocation sequence (remaps) */
+#endif
 };
 
 
@@ -171,6 +322,8 @@ struct conf {
 	int         run;
 	int         pret;   /* parse return value: use to exit parser. */
 	int         m_flag;
+	int         r_flag;   /* -r: reading from a VSL file */
+	int         ix_flag;  /* -i, -x, -I or -X VSL filter given */
 
 	/* Sparsely populated with desired tags */
 	struct tag **tag;
@@ -179,10 +332,23 @@ struct conf {
 	struct fmt_conf fconf[FMT_CONF_NUM];
 	int             fconf_cnt;
 
+	/* Format generation, bumped by each configuration reload */
+	unsigned int    gen;
+	int             reload_timeout_ms; /* Max drain time of the previous
+					    * generation */
+
 	uint64_t    sequence_number;
 
 	size_t      scratch_size;    /* Size of scratch buffer */
+	int         scratch_adaptive;/* Adapt scratch_size to usage */
+	size_t      scratch_max;     /* Maximum adaptive scratch size */
+	int         scratch_headroom;/* Adaptive scratch headroom (%) */
 	int         datacopy;
+	int         passthrough;     /* Raw tag passthrough mode */
+#define VK_PASSTHRU_NONE    0    /* Render formats (default) */
+#define VK_PASSTHRU_FORMAT  1    /* Tags referenced by the formats */
+#define VK_PASSTHRU_ALL     2    /* All tags */
+	char       *replay_path;     /* Render raw frames from file (-R) */
 	fmt_enc_t   fmt_enc;
 	int         total_fmt_cnt;
 	int         loglines_hsize;  /* Log id hash size */
@@ -194,12 +360,72 @@ struct conf {
 	char       *stats_file;      /* Statistics output log file */
 	FILE       *stats_fp;        /* Statistics file pointer    */
 	time_t      t_last_stats;    /* Last stats output */
+	char       *stats_shm_path;  /* Statistics shared memory segment */
+	struct vk_shm_hdr *stats_shm; /* Mapped statistics segment */
+	time_t      t_last_shm;      /* Last shm statistics update */
+	char       *metrics_listen;  /* Metrics HTTP listener address */
 
 	int         need_logrotate;  /* If this is 1, log files will be reopened */
+	int         need_cache_dump; /* Dump logline cache (SIGUSR1) */
+	int         need_reload;     /* Reload configuration (SIGUSR2) */
 
 	/* Kafka config */
+	int         producers;       /* Number of producer handles */
 	int         partition;
 	char       *topic;
+	struct vk_route *routes;     /* Topic routing rules */
+	int         route_cnt;
+	struct vk_route *prio_rules; /* Priority class rules */
+	int         prio_rule_cnt;
+	int         prio_high_reserve; /* Out queue share (%) reserved for
+					* high priority messages */
+	int         kafka_queue_max; /* queue.buffering.max.messages */
+	int         kafka_msg_timeout_ms; /* topic.message.timeout.ms */
+
+	int         tag_pushdown;    /* Push tag subscription to VSL reader */
+
+	/* Id sharding across cooperating processes */
+	int         shard_cnt;       /* Number of shards (processes) */
+	int         shard_idx;       /* This process' shard (0..shard_cnt-1) */
+
+	/* Client/backend join */
+	int         join_backend;    /* Join backend records to client */
+	int         join_size;       /* Join table size (entries) */
+	int         join_timeout_ms; /* Join table entry expiry */
+
+	/* Capture of all records of slow or failed requests */
+	int         capture_max;     /* Max records per request, 0 = off */
+	int         capture_ttfb_ms; /* Capture if ttfb exceeds, 0 = off */
+	int         capture_status;  /* Capture if status >= this, 0 = off */
+	char       *capture_topic;   /* Kafka topic for captured frames */
+	char       *capture_file;    /* Ring file for captured frames */
+	size_t      capture_file_size; /* Ring file data size */
+	int         capture_copy;    /* Copy records: VSL not persistent */
+
+	/* CPU placement (CPU lists such as "0-3,8") */
+	char       *cpus_reader;     /* VSL reader and main threads */
+	char       *cpus_kafka;      /* librdkafka threads */
+
+	/* CPU governor */
+	int         cpu_budget;      /* CPU budget (% of one core), 0 = off */
+	int         cpu_interval_ms; /* Governor measurement interval */
+	int         sample_rate_max; /* Max governor sample rate (1 in N) */
+	int         partitioner;     /* kafka.partitioner */
+#define VK_PART_RANDOM      0    /* librdkafka's random partitioner */
+#define VK_PART_STICKY      1    /* Stick to a random partition per batch */
+#define VK_PART_ROUNDROBIN  2    /* Next partition per batch */
+#define VK_PART_HASH        3    /* Consistent hash of the message key */
+	int         part_batch_msgs; /* Messages per sticky partition */
+	int         part_batch_ms;   /* Max time per sticky partition */
+
+	/* Coalescing of multiple records into one Kafka message */
+	int         batch_records;   /* Max records per message, 1 = off */
+	size_t      batch_bytes;     /* Max coalesced message size */
+	int         batch_age_ms;    /* Max time to hold back a record */
+	int         batch_key;       /* Message key strategy */
+#define VK_BATCH_KEY_SPLIT  0    /* Flush on key change: one key/message */
+#define VK_BATCH_KEY_FIRST  1    /* Use the first record's key */
+#define VK_BATCH_KEY_NONE   2    /* No message key */
 
 	char       *logname;
 	int         log_level;
@@ -208,21 +434,35 @@ struct conf {
 #define VK_LOG_SYSLOG 0x2
 	int         log_rate;        /* Maximum log rate per minute. */
 	int         log_rate_period; /* Log rate limiting period */
+	int         log_queue_size;  /* Async log queue size, 0 = sync */
 
 	int         log_kafka_msg_error;  /* Log Kafka message delivery errors*/
 
 	char       *format[FMT_CONF_NUM]; /* Configured format string(s) */
+	int         avro_fingerprint;     /* Prefix Avro messages with the
+					   * schema fingerprint */
+	char       *avro_schema_file;     /* Write Avro schema to file */
+	char       *proto_file;           /* Write .proto file */
 	int         daemonize;
 
 	rd_kafka_conf_t       *rk_conf;
 	rd_kafka_topic_conf_t *topic_conf;
+
+	/* Varnish instances, instances[0].vd is 'vd' */
+	struct vk_instance instances[VK_INSTANCES_MAX];
+	int         instance_cnt;
 };
 
 extern struct conf conf;
+#ifndef VK_VSLQ
 struct VSM_data *vd;
+#endif
+
+int vsl_arg (int c, const char *arg);
 
 
 int conf_file_read (const char *path);
+int conf_file_reload (const char *path, char *errstr, size_t errstr_size);
 
 
 void vk_log0 (const char *func, const char *file, int line,
@@ -245,3 +485,8 @@ void out_null (struct fmt_conf *fconf, struct logline *lp,
 	       const char *buf, size_t len);
 extern void (*outfunc) (struct fmt_conf *fconf, struct logline *lp,
 			const char *buf, size_t len);
+
+
+int vk_metrics_start (const char *listen, const struct vk_shm_hdr *hdr,
+		      char *errstr, size_t errstr_size);
+void vk_metrics_stop (void);
@@ -0,0 +1,188 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * varnishkafkastat - reads the varnishkafka statistics shared memory
+ *                    segment (log.statistics.shm) and prints its counters.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "vkshm.h"
+
+
+static void usage (const char *argv0) {
+	fprintf(stderr,
+		"varnishkafkastat version %s\n"
+		"varnishkafka statistics segment reader\n"
+		"\n"
+		"Usage: %s [-f <segment-file>] [-1] [-b] [-w <seconds>]\n"
+		"\n"
+		"  -f <file>  Statistics segment (log.statistics.shm)\n"
+		"             Default: %s\n"
+		"  -1         Print statistics once and exit\n"
+		"  -b         Include per logline cache bucket counters\n"
+		"  -w <secs>  Update interval (default 1)\n"
+		"\n",
+		VARNISHKAFKA_VERSION, argv0, VK_SHM_DEFAULT_PATH);
+	exit(1);
+}
+
+
+/**
+ * Print counters from snapshot 'hdr'.
+ * If 'prev' is non-NULL per second rates are calculated for counters.
+ */
+static void print_snapshot (const struct vk_shm_hdr *hdr,
+			    const struct vk_shm_hdr *prev,
+			    int interval, int buckets) {
+	const struct vk_shm_cnt *c = VK_SHM_CNTS(hdr);
+	const struct vk_shm_cnt *pc = prev ? VK_SHM_CNTS(prev) : NULL;
+	int i;
+
+	printf("varnishkafka pid %u, updated %"PRIu64"\n",
+	       hdr->pid, hdr->t_update);
+
+	for (i = 0 ; i < hdr->cnt_num ; i++) {
+		if (pc && c[i].type == VK_SHM_T_COUNTER)
+			printf("%-40s %20"PRIu64" %14.2f/s\n",
+			       c[i].name, c[i].val,
+			       (double)(c[i].val - pc[i].val) / interval);
+		else
+			printf("%-40s %20"PRIu64"\n", c[i].name, c[i].val);
+	}
+
+	if (hdr->hist_num > 0) {
+		const struct vk_shm_hist *h = VK_SHM_HISTS(hdr);
+
+		printf("%-32s %14s %10s %10s %10s %10s\n",
+		       "histogram (us)", "cnt", "avg", "p50", "p99", "max");
+		for (i = 0 ; i < hdr->hist_num ; i++)
+			printf("%-32s %14"PRIu64" %10"PRIu64" %10"PRIu64
+			       " %10"PRIu64" %10"PRIu64"\n",
+			       h[i].name, h[i].cnt,
+			       h[i].cnt ? h[i].sum / h[i].cnt : 0,
+			       vk_hist_percentile(&h[i], 50.0),
+			       vk_hist_percentile(&h[i], 99.0),
+			       h[i].max);
+	}
+
+	if (buckets) {
+		const struct vk_shm_bucket *b = VK_SHM_BUCKETS(hdr);
+
+		printf("%-8s %8s %20s %20s %20s\n",
+		       "bucket", "cnt", "hit", "miss", "purge");
+		for (i = 0 ; i < hdr->bucket_num ; i++)
+			printf("%-8i %8"PRIu64" %20"PRIu64" %20"PRIu64
+			       " %20"PRIu64"\n",
+			       i, b[i].cnt, b[i].hit, b[i].miss, b[i].purge);
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+
+int main (int argc, char **argv) {
+	const char *path = VK_SHM_DEFAULT_PATH;
+	struct vk_shm_hdr *hdr;
+	size_t mapsize;
+	void *snap, *prev = NULL;
+	char errstr[512];
+	int once = 0;
+	int buckets = 0;
+	int interval = 1;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:1bw:h")) != -1) {
+		switch (c)
+		{
+		case 'f':
+			path = optarg;
+			break;
+		case '1':
+			once = 1;
+			break;
+		case 'b':
+			buckets = 1;
+			break;
+		case 'w':
+			if ((interval = atoi(optarg)) < 1)
+				interval = 1;
+			break;
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (!(hdr = vk_shm_attach(path, &mapsize, errstr, sizeof(errstr)))) {
+		fprintf(stderr, "%s\n", errstr);
+		exit(1);
+	}
+
+	snap = malloc(hdr->size);
+	if (!once)
+		prev = calloc(1, hdr->size);
+
+	while (1) {
+		if (vk_shm_snapshot(hdr, snap, hdr->size) == -1) {
+			fprintf(stderr, "Unable to read consistent "
+				"snapshot of %s\n", path);
+			exit(1);
+		}
+
+		print_snapshot(snap,
+			       prev && ((struct vk_shm_hdr *)prev)->magic ?
+			       prev : NULL,
+			       interval, buckets);
+
+		if (once)
+			break;
+
+		memcpy(prev, snap, hdr->size);
+		sleep(interval);
+
+		if (!hdr->magic) {
+			fprintf(stderr, "varnishkafka terminated\n");
+			exit(1);
+		}
+	}
+
+	free(snap);
+	free(prev);
+	vk_shm_detach(hdr, mapsize);
+
+	return 0;
+}
@@ -0,0 +1,427 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Embedded HTTP metrics listener.
+ *
+ * Serves the statistics segment in the Prometheus text exposition format
+ * from a separate thread. Each scrape works on a private snapshot of
+ * the segment, the VSL reader thread is never blocked by a scrape.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "vkvsl.h"
+#include <librdkafka/rdkafka.h>
+
+#include "varnishkafka.h"
+#include "vkshm.h"
+
+
+static struct {
+	int                      fd;       /* Listening socket */
+	char                    *unix_path;/* Unix socket path, if any */
+	const struct vk_shm_hdr *hdr;      /* Statistics segment */
+	pthread_t                thread;
+	volatile int             run;
+} metrics = { fd: -1 };
+
+
+/**
+ * Growable output buffer
+ */
+struct mbuf {
+	char  *buf;
+	size_t size;
+	size_t of;
+};
+
+static void mbuf_printf (struct mbuf *mb, const char *fmt, ...)
+	__attribute__((format (printf, 2, 3)));
+
+static void mbuf_printf (struct mbuf *mb, const char *fmt, ...) {
+	va_list ap;
+	int r;
+
+	while (1) {
+		va_start(ap, fmt);
+		r = vsnprintf(mb->buf + mb->of, mb->size - mb->of, fmt, ap);
+		va_end(ap);
+
+		if (r < mb->size - mb->of)
+			break;
+
+		mb->size = (mb->size + r + 1) * 2;
+		mb->buf = realloc(mb->buf, mb->size);
+	}
+
+	mb->of += r;
+}
+
+
+/**
+ * Render snapshot 'hdr' in Prometheus text format.
+ */
+static void metrics_render (struct mbuf *mb, const struct vk_shm_hdr *hdr) {
+	const struct vk_shm_cnt *c = VK_SHM_CNTS(hdr);
+	const struct vk_shm_hist *h = VK_SHM_HISTS(hdr);
+	int i, j;
+
+	for (i = 0 ; i < hdr->cnt_num ; i++) {
+		if (c[i].type == VK_SHM_T_COUNTER)
+			mbuf_printf(mb,
+				    "# TYPE varnishkafka_%s_total counter\n"
+				    "varnishkafka_%s_total %"PRIu64"\n",
+				    c[i].name, c[i].name, c[i].val);
+		else
+			mbuf_printf(mb,
+				    "# TYPE varnishkafka_%s gauge\n"
+				    "varnishkafka_%s %"PRIu64"\n",
+				    c[i].name, c[i].name, c[i].val);
+	}
+
+	for (i = 0 ; i < hdr->hist_num ; i++) {
+		uint64_t sum = 0;
+
+		mbuf_printf(mb, "# TYPE varnishkafka_%s_seconds histogram\n",
+			    h[i].name);
+
+		for (j = 0 ; j < VK_HIST_BUCKETS - 1 ; j++) {
+			sum += h[i].buckets[j];
+			mbuf_printf(mb,
+				    "varnishkafka_%s_seconds_bucket"
+				    "{le=\"%g\"} %"PRIu64"\n",
+				    h[i].name,
+				    (double)(1llu << j) / 1000000.0, sum);
+		}
+
+		mbuf_printf(mb,
+			    "varnishkafka_%s_seconds_bucket{le=\"+Inf\"} "
+			    "%"PRIu64"\n"
+			    "varnishkafka_%s_seconds_sum %f\n"
+			    "varnishkafka_%s_seconds_count %"PRIu64"\n",
+			    h[i].name, h[i].cnt,
+			    h[i].name, (double)h[i].sum / 1000000.0,
+			    h[i].name, h[i].cnt);
+	}
+
+	mbuf_printf(mb,
+		    "# TYPE varnishkafka_last_update_timestamp_seconds gauge\n"
+		    "varnishkafka_last_update_timestamp_seconds %"PRIu64"\n",
+		    hdr->t_update);
+}
+
+
+/**
+ * Write all of 'buf' to 's'.
+ */
+static void metrics_write (int s, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t r = write(s, buf, len);
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			return;
+		}
+		buf += r;
+		len -= r;
+	}
+}
+
+
+/**
+ * Serve a single HTTP request on socket 's'.
+ */
+static void metrics_serve (int s, void *snap) {
+	char req[2048];
+	size_t of = 0;
+	struct mbuf mb = {};
+	struct timeval tv = { tv_sec: 2 };
+	const char *status = "200 OK";
+
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* Read request headers. */
+	while (of < sizeof(req) - 1) {
+		ssize_t r = read(s, req+of, sizeof(req)-1-of);
+		if (r <= 0)
+			return;
+		of += r;
+		req[of] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+	req[of] = '\0';
+
+	if (strncmp(req, "GET ", 4))
+		status = "405 Method Not Allowed";
+	else if (strncmp(req+4, "/metrics ", 9) &&
+		 strncmp(req+4, "/metrics?", 9) &&
+		 strncmp(req+4, "/ ", 2))
+		status = "404 Not Found";
+	else if (vk_shm_snapshot(metrics.hdr, snap, metrics.hdr->size) == -1)
+		status = "503 Service Unavailable";
+	else
+		metrics_render(&mb, snap);
+
+	snprintf(req, sizeof(req),
+		 "HTTP/1.0 %s\r\n"
+		 "Content-Type: text/plain; version=0.0.4\r\n"
+		 "Content-Length: %zd\r\n"
+		 "Connection: close\r\n"
+		 "\r\n",
+		 status, mb.of);
+	metrics_write(s, req, strlen(req));
+	if (mb.of > 0)
+		metrics_write(s, mb.buf, mb.of);
+
+	free(mb.buf);
+}
+
+
+/**
+ * Metrics listener thread main loop.
+ */
+static void *metrics_main (void *arg) {
+	void *snap = malloc(metrics.hdr->size);
+
+	while (metrics.run) {
+		struct pollfd pfd = { fd: metrics.fd, events: POLLIN };
+		int s;
+
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		if ((s = accept(metrics.fd, NULL, NULL)) == -1)
+			continue;
+
+		metrics_serve(s, snap);
+		close(s);
+	}
+
+	free(snap);
+	return NULL;
+}
+
+
+/**
+ * Returns true if 'sa' is a loopback address.
+ */
+static int addr_is_loopback (const struct sockaddr *sa) {
+	if (sa->sa_family == AF_INET)
+		return (ntohl(((const struct sockaddr_in *)sa)->
+			      sin_addr.s_addr) >> 24) == 127;
+	else if (sa->sa_family == AF_INET6) {
+		const struct in6_addr *a =
+			&((const struct sockaddr_in6 *)sa)->sin6_addr;
+
+		return IN6_IS_ADDR_LOOPBACK(a) ||
+			(IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+	}
+
+	return 0;
+}
+
+
+/**
+ * Create listening socket for 'listen_addr' which is either
+ * "unix:<path>", "<host>:<port>" or "<port>" (loopback).
+ * The statistics are internal: only loopback hosts are accepted,
+ * an empty host means 127.0.0.1.
+ */
+static int metrics_listen (const char *listen_addr,
+			   char *errstr, size_t errstr_size) {
+	struct addrinfo hints = {}, *ai;
+	char *host, *port;
+	int on = 1;
+	int fd;
+	int r;
+
+	if (!strncmp(listen_addr, "unix:", 5)) {
+		struct sockaddr_un sun = { sun_family: AF_UNIX };
+
+		if (strlen(listen_addr+5) >= sizeof(sun.sun_path)) {
+			snprintf(errstr, errstr_size,
+				 "Unix socket path too long");
+			return -1;
+		}
+		strcpy(sun.sun_path, listen_addr+5);
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			snprintf(errstr, errstr_size, "socket: %s",
+				 strerror(errno));
+			return -1;
+		}
+
+		unlink(sun.sun_path);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+			snprintf(errstr, errstr_size, "bind: %s",
+				 strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		metrics.unix_path = strdup(sun.sun_path);
+
+	} else {
+		host = strdupa(listen_addr);
+		if ((port = strrchr(host, ':')))
+			*(port++) = '\0';
+		else {
+			port = host;
+			host = "";
+		}
+
+		if (!*host)
+			host = "127.0.0.1";
+
+		hints.ai_family   = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		if ((r = getaddrinfo(host, port, &hints, &ai))) {
+			snprintf(errstr, errstr_size, "%s: %s",
+				 listen_addr, gai_strerror(r));
+			return -1;
+		}
+
+		if (!addr_is_loopback(ai->ai_addr)) {
+			snprintf(errstr, errstr_size,
+				 "%s: not a loopback address: "
+				 "use a loopback host or unix:<path>",
+				 listen_addr);
+			freeaddrinfo(ai);
+			return -1;
+		}
+
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+				 ai->ai_protocol)) == -1) {
+			snprintf(errstr, errstr_size, "socket: %s",
+				 strerror(errno));
+			freeaddrinfo(ai);
+			return -1;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+			snprintf(errstr, errstr_size, "bind: %s",
+				 strerror(errno));
+			freeaddrinfo(ai);
+			close(fd);
+			return -1;
+		}
+
+		freeaddrinfo(ai);
+	}
+
+	if (listen(fd, 16) == -1) {
+		snprintf(errstr, errstr_size, "listen: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/**
+ * Start the metrics listener on 'listen_addr' serving segment 'hdr'.
+ * Returns 0 on success or -1 on failure in which case 'errstr' will
+ * contain an error string.
+ */
+int vk_metrics_start (const char *listen_addr, const struct vk_shm_hdr *hdr,
+		      char *errstr, size_t errstr_size) {
+	sigset_t newset, oldset;
+	int r;
+
+	if ((metrics.fd = metrics_listen(listen_addr,
+					 errstr, errstr_size)) == -1)
+		return -1;
+
+	metrics.hdr = hdr;
+	metrics.run = 1;
+
+	/* Signals are handled by the main thread only. */
+	sigfillset(&newset);
+	pthread_sigmask(SIG_SETMASK, &newset, &oldset);
+	r = pthread_create(&metrics.thread, NULL, metrics_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (r) {
+		snprintf(errstr, errstr_size,
+			 "Failed to create thread: %s", strerror(r));
+		close(metrics.fd);
+		metrics.fd = -1;
+		return -1;
+	}
+
+	vk_log("METRICS", LOG_INFO, "Serving metrics on %s", listen_addr);
+
+	return 0;
+}
+
+
+/**
+ * Stop the metrics listener.
+ */
+void vk_metrics_stop (void) {
+	if (metrics.fd == -1)
+		return;
+
+	metrics.run = 0;
+	pthread_join(metrics.thread, NULL);
+
+	close(metrics.fd);
+	metrics.fd = -1;
+
+	if (metrics.unix_path) {
+		unlink(metrics.unix_path);
+		free(metrics.unix_path);
+		metrics.unix_path = NULL;
+	}
+}
@@ -0,0 +1,353 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vkraw.h"
+
+
+/**
+ * Decode the frame at the start of 'buf' (of 'size' bytes) and call 'cb'
+ * for each of its tag records, in order.
+ * The frame's sequence number is returned in '*seqp'.
+ *
+ * Returns the size of the decoded frame, 0 if 'buf' does not yet hold
+ * a complete frame, or -1 on a malformed frame or if 'cb' returned -1,
+ * in which case 'errstr' will contain an error string.
+ */
+ssize_t vk_raw_frame_decode (const char *buf, size_t size, uint64_t *seqp,
+			     vk_raw_tag_cb_t *cb, void *opaque,
+			     char *errstr, size_t errstr_size) {
+	const unsigned char *b = (const unsigned char *)buf;
+	uint64_t seq = 0;
+	uint32_t len = 0;
+	size_t of;
+	int i;
+
+	if (size < VK_RAW_HDR_SIZE)
+		return 0;
+
+	if (b[0] != VK_RAW_MAGIC0 || b[1] != VK_RAW_MAGIC1) {
+		snprintf(errstr, errstr_size,
+			 "Bad frame magic 0x%02x%02x", b[0], b[1]);
+		return -1;
+	}
+
+	if (b[2] != VK_RAW_VERSION) {
+		snprintf(errstr, errstr_size,
+			 "Unsupported frame version %i (expected %i)",
+			 b[2], VK_RAW_VERSION);
+		return -1;
+	}
+
+	for (i = 0 ; i < 4 ; i++)
+		len = (len << 8) | b[4+i];
+	for (i = 0 ; i < 8 ; i++)
+		seq = (seq << 8) | b[8+i];
+
+	if (size < VK_RAW_HDR_SIZE + (size_t)len)
+		return 0;
+
+	*seqp = seq;
+
+	of = VK_RAW_HDR_SIZE;
+	size = VK_RAW_HDR_SIZE + len;
+
+	while (of < size) {
+		unsigned int rlen;
+
+		if (of + VK_RAW_REC_HDR_SIZE > size) {
+			snprintf(errstr, errstr_size,
+				 "Truncated record header at offset %zd "
+				 "(frame seq %"PRIu64")", of, seq);
+			return -1;
+		}
+
+		rlen = ((unsigned int)b[of+2] << 8) | b[of+3];
+
+		if (of + VK_RAW_REC_HDR_SIZE + rlen > size) {
+			snprintf(errstr, errstr_size,
+				 "Record at offset %zd exceeds frame "
+				 "(frame seq %"PRIu64")", of, seq);
+			return -1;
+		}
+
+		if (cb(opaque, b[of], b[of+1],
+		       buf + of + VK_RAW_REC_HDR_SIZE, rlen) == -1) {
+			snprintf(errstr, errstr_size,
+				 "Record at offset %zd rejected "
+				 "(frame seq %"PRIu64")", of, seq);
+			return -1;
+		}
+
+		of += VK_RAW_REC_HDR_SIZE + rlen;
+	}
+
+	return (ssize_t)size;
+}
+
+
+/**
+ * Ring data of 'ring'.
+ */
+#define RING_DATA(ring)  ((char *)((ring) + 1))
+
+
+/**
+ * Copy 'len' bytes from 'src' to ring offset 'of', wrapping as needed.
+ */
+static void ring_put (struct vk_raw_ring *ring, uint64_t of,
+		      const char *src, size_t len) {
+	size_t pos = (size_t)(of % ring->size);
+	size_t part = ring->size - pos;
+
+	if (part > len)
+		part = len;
+
+	memcpy(RING_DATA(ring) + pos, src, part);
+	if (part < len)
+		memcpy(RING_DATA(ring), src + part, len - part);
+}
+
+
+/**
+ * Copy 'len' bytes from ring offset 'of' to 'dst', wrapping as needed.
+ */
+static void ring_get (const struct vk_raw_ring *ring, uint64_t of,
+		      char *dst, size_t len) {
+	size_t pos = (size_t)(of % ring->size);
+	size_t part = ring->size - pos;
+
+	if (part > len)
+		part = len;
+
+	memcpy(dst, RING_DATA(ring) + pos, part);
+	if (part < len)
+		memcpy(dst + part, RING_DATA(ring), len - part);
+}
+
+
+/**
+ * Create (or truncate) ring file 'path' with 'size' bytes of frame data.
+ *
+ * Returns the mapped ring or NULL on failure in which case 'errstr'
+ * will contain an error string.
+ */
+struct vk_raw_ring *vk_raw_ring_create (const char *path, size_t size,
+					char *errstr, size_t errstr_size) {
+	struct vk_raw_ring *ring;
+	size_t total = sizeof(*ring) + size;
+	int fd;
+
+	if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+		snprintf(errstr, errstr_size, "Failed to create %s: %s",
+			 path, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, total) == -1) {
+		snprintf(errstr, errstr_size,
+			 "Failed to size %s to %zd bytes: %s",
+			 path, total, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	ring = mmap(NULL, total, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (ring == MAP_FAILED) {
+		snprintf(errstr, errstr_size, "Failed to map %s: %s",
+			 path, strerror(errno));
+		return NULL;
+	}
+
+	ring->version = VK_RAW_RING_VERSION;
+	ring->size    = size;
+	ring->gen     = 0;
+	ring->head    = 0;
+	ring->tail    = 0;
+
+	/* Magic is written last to mark the ring as ready for use. */
+	__sync_synchronize();
+	ring->magic   = VK_RAW_RING_MAGIC;
+
+	return ring;
+}
+
+
+/**
+ * Append frame 'frame' of 'len' bytes to the ring, evicting the oldest
+ * frames as needed.
+ *
+ * Returns 0 on success or -1 if the frame is larger than the ring.
+ */
+int vk_raw_ring_write (struct vk_raw_ring *ring, const char *frame,
+		       size_t len) {
+	if (len > ring->size || len < VK_RAW_HDR_SIZE)
+		return -1;
+
+	ring->gen++;
+	__sync_synchronize();
+
+	/* Evict oldest frames until there is room for the new one. */
+	while (ring->head + len - ring->tail > ring->size) {
+		unsigned char hdr[VK_RAW_HDR_SIZE];
+		uint32_t flen = 0;
+		int i;
+
+		ring_get(ring, ring->tail, (char *)hdr, sizeof(hdr));
+		for (i = 0 ; i < 4 ; i++)
+			flen = (flen << 8) | hdr[4+i];
+
+		ring->tail += VK_RAW_HDR_SIZE + flen;
+	}
+
+	ring_put(ring, ring->head, frame, len);
+	ring->head += len;
+
+	__sync_synchronize();
+	ring->gen++;
+
+	return 0;
+}
+
+
+/**
+ * Unmap a ring created with vk_raw_ring_create(), the file is kept.
+ */
+void vk_raw_ring_destroy (struct vk_raw_ring *ring) {
+	munmap(ring, sizeof(*ring) + ring->size);
+}
+
+
+/**
+ * Read the frames of ring file 'path' (oldest first) into a newly
+ * allocated buffer returned in '*bufp' and '*lenp'.
+ *
+ * Returns 1 on success, 0 if 'path' is not a ring file, or -1 on error
+ * in which case 'errstr' will contain an error string.
+ */
+int vk_raw_ring_read (const char *path, char **bufp, size_t *lenp,
+		      char *errstr, size_t errstr_size) {
+	struct vk_raw_ring *ring;
+	struct stat st;
+	uint64_t gen, head = 0, tail = 0;
+	char *buf = NULL, *tmp;
+	int fd, tries = 0, torn;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		snprintf(errstr, errstr_size, "Failed to open %s: %s",
+			 path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size < sizeof(*ring) ||
+	    (ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			 fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+	close(fd);
+
+	if (ring->magic != VK_RAW_RING_MAGIC ||
+	    ring->version != VK_RAW_RING_VERSION || ring->size == 0 ||
+	    sizeof(*ring) + ring->size != (size_t)st.st_size) {
+		munmap(ring, st.st_size);
+		return 0;
+	}
+
+	/* Retry while the writer is updating the ring.
+	 * The generation of a writer that died mid-update stays odd,
+	 * so waiting for it counts against the retries too. */
+	do {
+		if ((gen = ring->gen) & 1) {
+			usleep(1000);
+			continue;
+		}
+		__sync_synchronize();
+
+		head = ring->head;
+		tail = ring->tail;
+
+		/* A consistent read of a lapped or corrupted ring */
+		if (tail > head || head - tail > ring->size) {
+			__sync_synchronize();
+			if (gen != ring->gen)
+				continue;
+			snprintf(errstr, errstr_size,
+				 "%s: corrupt ring: head %"PRIu64", "
+				 "tail %"PRIu64", size %"PRIu64,
+				 path, head, tail, ring->size);
+			munmap(ring, st.st_size);
+			free(buf);
+			return -1;
+		}
+
+		if (!(tmp = realloc(buf, (size_t)(head - tail) + 1))) {
+			munmap(ring, st.st_size);
+			free(buf);
+			snprintf(errstr, errstr_size,
+				 "%s: failed to allocate %"PRIu64" bytes",
+				 path, head - tail);
+			return -1;
+		}
+		buf = tmp;
+		ring_get(ring, tail, buf, (size_t)(head - tail));
+
+		__sync_synchronize();
+	} while (((gen & 1) || gen != ring->gen) && ++tries < 100);
+
+	torn = (gen & 1) || gen != ring->gen;
+	munmap(ring, st.st_size);
+
+	if (torn) {
+		free(buf);
+		snprintf(errstr, errstr_size,
+			 "%s: ring is being updated too frequently "
+			 "or its writer died while updating it", path);
+		return -1;
+	}
+
+	*bufp = buf;
+	*lenp = (size_t)(head - tail);
+	return 1;
+}
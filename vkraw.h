@@ -0,0 +1,147 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+/**
+ * Raw tag passthrough frames.
+ *
+ * In passthrough mode varnishkafka does not render log lines, instead
+ * the VSL tags of each request are serialized verbatim as a frame that
+ * can later be rendered with the regular formatting machinery
+ * (see varnishkafka -R).
+ *
+ * Frame layout (integers are big endian):
+ *   u8   magic[2]   "VK"
+ *   u8   version    VK_RAW_VERSION
+ *   u8   flags      Reserved, 0
+ *   u32  len        Length of the records following the header
+ *   u64  seq        Sequence number (%n)
+ *   records[]:
+ *     u8   tag      VSL tag
+ *     u8   spec     VSL_S_CLIENT, VSL_S_BACKEND
+ *     u16  len      Payload length
+ *     u8   payload[len]
+ *
+ * Any incompatible layout change must bump VK_RAW_VERSION.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#define VK_RAW_MAGIC0       'V'
+#define VK_RAW_MAGIC1       'K'
+#define VK_RAW_VERSION      1
+#define VK_RAW_HDR_SIZE     16
+#define VK_RAW_REC_HDR_SIZE 4
+#define VK_RAW_REC_LEN_MAX  0xffff
+
+
+/**
+ * Write a frame header for 'len' bytes of records with sequence
+ * number 'seq' to 'd' which must have room for VK_RAW_HDR_SIZE bytes.
+ */
+static inline void vk_raw_hdr_write (char *d, uint32_t len, uint64_t seq) {
+	int i;
+
+	d[0] = VK_RAW_MAGIC0;
+	d[1] = VK_RAW_MAGIC1;
+	d[2] = VK_RAW_VERSION;
+	d[3] = 0;
+	for (i = 0 ; i < 4 ; i++)
+		d[4+i] = (char)(len >> (24 - (i * 8)));
+	for (i = 0 ; i < 8 ; i++)
+		d[8+i] = (char)(seq >> (56 - (i * 8)));
+}
+
+/**
+ * Write a tag record to 'd' which must have room for
+ * VK_RAW_REC_HDR_SIZE + 'len' bytes.
+ * 'len' must not exceed VK_RAW_REC_LEN_MAX.
+ *
+ * Returns a pointer to the byte following the record.
+ */
+static inline char *vk_raw_rec_write (char *d, int tag, int spec,
+				      const char *ptr, unsigned int len) {
+	d[0] = (char)tag;
+	d[1] = (char)spec;
+	d[2] = (char)(len >> 8);
+	d[3] = (char)len;
+	__builtin_memcpy(d+VK_RAW_REC_HDR_SIZE, ptr, len);
+	return d + VK_RAW_REC_HDR_SIZE + len;
+}
+
+
+/**
+ * Tag record callback for vk_raw_frame_decode()
+ * Returns 0 to continue decoding or -1 to abort.
+ */
+typedef int (vk_raw_tag_cb_t) (void *opaque, int tag, unsigned int spec,
+			       const char *ptr, unsigned int len);
+
+ssize_t vk_raw_frame_decode (const char *buf, size_t size, uint64_t *seqp,
+			     vk_raw_tag_cb_t *cb, void *opaque,
+			     char *errstr, size_t errstr_size);
+
+
+/**
+ * Frame ring file.
+ *
+ * A fixed size memory mapped file holding the most recently written
+ * frames (capture.file), the oldest frames are overwritten first.
+ *
+ * Layout: struct vk_raw_ring followed by 'size' bytes of frame data.
+ * 'head' and 'tail' are monotonically increasing byte offsets:
+ * the ring holds the complete frames from 'tail' up to 'head', stored
+ * back to back at offset % 'size' and wrapping at the end of the data.
+ * 'gen' is odd while the writer is updating the ring.
+ */
+#define VK_RAW_RING_MAGIC    0x564b5252U  /* "VKRR" */
+#define VK_RAW_RING_VERSION  1
+
+struct vk_raw_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;          /* Size of frame data */
+	volatile uint64_t gen;  /* Update generation, odd while updating */
+	volatile uint64_t head; /* End of newest frame */
+	volatile uint64_t tail; /* Start of oldest frame */
+};
+
+struct vk_raw_ring *vk_raw_ring_create (const char *path, size_t size,
+					char *errstr, size_t errstr_size);
+int vk_raw_ring_write (struct vk_raw_ring *ring, const char *frame,
+		       size_t len);
+void vk_raw_ring_destroy (struct vk_raw_ring *ring);
+int vk_raw_ring_read (const char *path, char **bufp, size_t *lenp,
+		      char *errstr, size_t errstr_size);
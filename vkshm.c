@@ -0,0 +1,190 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vkshm.h"
+
+
+/**
+ * Create a new statistics segment with room for 'cnt_num' counters,
+ * 'bucket_num' logline cache buckets and 'hist_num' histograms.
+ * If 'path' is NULL an anonymous (process private) segment is created.
+ *
+ * Returns the mapped segment or NULL on failure in which case 'errstr'
+ * will contain an error string.
+ */
+struct vk_shm_hdr *vk_shm_create (const char *path, int cnt_num,
+				  int bucket_num, int hist_num,
+				  char *errstr, size_t errstr_size) {
+	struct vk_shm_hdr *hdr;
+	size_t size;
+	int fd = -1;
+	int flags = MAP_SHARED;
+
+	size = sizeof(*hdr) +
+		(cnt_num * sizeof(struct vk_shm_cnt)) +
+		(bucket_num * sizeof(struct vk_shm_bucket)) +
+		(hist_num * sizeof(struct vk_shm_hist));
+
+	if (path) {
+		/* Remove any previous segment so that readers still
+		 * attached to it are not confused by the new layout. */
+		unlink(path);
+
+		if ((fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644)) == -1) {
+			snprintf(errstr, errstr_size,
+				 "Failed to create %s: %s",
+				 path, strerror(errno));
+			return NULL;
+		}
+
+		if (ftruncate(fd, size) == -1) {
+			snprintf(errstr, errstr_size,
+				 "Failed to size %s to %zd bytes: %s",
+				 path, size, strerror(errno));
+			close(fd);
+			unlink(path);
+			return NULL;
+		}
+	} else
+		flags |= MAP_ANONYMOUS;
+
+	hdr = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, fd, 0);
+	if (fd != -1)
+		close(fd);
+
+	if (hdr == MAP_FAILED) {
+		snprintf(errstr, errstr_size,
+			 "Failed to map %zd bytes statistics segment: %s",
+			 size, strerror(errno));
+		if (path)
+			unlink(path);
+		return NULL;
+	}
+
+	memset(hdr, 0, size);
+	hdr->version    = VK_SHM_VERSION;
+	hdr->size       = size;
+	hdr->pid        = (uint32_t)getpid();
+	hdr->cnt_num    = cnt_num;
+	hdr->bucket_num = bucket_num;
+	hdr->hist_num   = hist_num;
+	hdr->cnt_of     = sizeof(*hdr);
+	hdr->bucket_of  = hdr->cnt_of + (cnt_num * sizeof(struct vk_shm_cnt));
+	hdr->hist_of    = hdr->bucket_of +
+		(bucket_num * sizeof(struct vk_shm_bucket));
+
+	/* Magic is written last to mark the segment as ready for use. */
+	__sync_synchronize();
+	hdr->magic      = VK_SHM_MAGIC;
+
+	return hdr;
+}
+
+
+/**
+ * Unmap a segment created with vk_shm_create() and remove its file.
+ */
+void vk_shm_destroy (struct vk_shm_hdr *hdr, const char *path) {
+	hdr->magic = 0;
+	munmap(hdr, hdr->size);
+	if (path)
+		unlink(path);
+}
+
+
+/**
+ * Map an existing statistics segment read-only.
+ * The mapped length is returned in '*mapsizep' for vk_shm_detach().
+ *
+ * Returns the mapped segment or NULL on failure in which case 'errstr'
+ * will contain an error string.
+ */
+struct vk_shm_hdr *vk_shm_attach (const char *path, size_t *mapsizep,
+				  char *errstr, size_t errstr_size) {
+	struct vk_shm_hdr *hdr;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		snprintf(errstr, errstr_size, "Failed to open %s: %s",
+			 path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(*hdr)) {
+		snprintf(errstr, errstr_size,
+			 "%s is not a varnishkafka statistics segment", path);
+		close(fd);
+		return NULL;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (hdr == MAP_FAILED) {
+		snprintf(errstr, errstr_size, "Failed to map %s: %s",
+			 path, strerror(errno));
+		return NULL;
+	}
+
+	if (hdr->magic != VK_SHM_MAGIC || hdr->size > st.st_size) {
+		snprintf(errstr, errstr_size,
+			 "%s is not a varnishkafka statistics segment", path);
+		munmap(hdr, st.st_size);
+		return NULL;
+	}
+
+	if (hdr->version != VK_SHM_VERSION) {
+		snprintf(errstr, errstr_size,
+			 "%s has unsupported version %u (expected %u)",
+			 path, hdr->version, VK_SHM_VERSION);
+		munmap(hdr, st.st_size);
+		return NULL;
+	}
+
+	*mapsizep = st.st_size;
+	return hdr;
+}
+
+
+/**
+ * Unmap a segment mapped with vk_shm_attach() of 'mapsize' bytes.
+ */
+void vk_shm_detach (struct vk_shm_hdr *hdr, size_t mapsize) {
+	munmap(hdr, mapsize);
+}
@@ -0,0 +1,218 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * Shared memory statistics segment.
+ *
+ * varnishkafka periodically publishes its counters to a memory mapped
+ * file that can be read by external tools (such as varnishkafkastat)
+ * without any interaction with the varnishkafka process.
+ *
+ * Segment layout:
+ *   struct vk_shm_hdr
+ *   struct vk_shm_cnt    [hdr->cnt_num]     at hdr->cnt_of
+ *   struct vk_shm_bucket [hdr->bucket_num]  at hdr->bucket_of
+ *   struct vk_shm_hist   [hdr->hist_num]    at hdr->hist_of
+ *
+ * The writer bumps 'gen' to an odd value before updating the segment
+ * and to the next even value when done; readers must retry their copy
+ * if 'gen' was odd or changed during the copy.
+ *
+ * Any incompatible layout change must bump VK_SHM_VERSION.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+
+
+#define VK_SHM_MAGIC     0x564b534dU  /* "VKSM" */
+#define VK_SHM_VERSION   2
+#define VK_SHM_NAME_MAX  48
+
+/* Default segment path used by readers */
+#define VK_SHM_DEFAULT_PATH  "/tmp/varnishkafka.stats.shm"
+
+
+struct vk_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;          /* Total segment size */
+	volatile uint64_t gen;  /* Update generation, odd while updating. */
+	uint64_t t_update;      /* Time of last update (unix time) */
+	uint32_t pid;           /* Writer's pid */
+	uint32_t cnt_num;       /* Number of counters */
+	uint32_t bucket_num;    /* Number of logline cache buckets */
+	uint32_t hist_num;      /* Number of latency histograms */
+	uint64_t cnt_of;        /* Offset of counter array */
+	uint64_t bucket_of;     /* Offset of bucket array */
+	uint64_t hist_of;       /* Offset of histogram array */
+};
+
+
+/**
+ * Named counter or gauge.
+ */
+struct vk_shm_cnt {
+	char     name[VK_SHM_NAME_MAX];
+	uint32_t type;
+#define VK_SHM_T_COUNTER  0  /* Monotonically increasing counter */
+#define VK_SHM_T_GAUGE    1  /* Current value */
+	uint32_t _pad;
+	uint64_t val;
+};
+
+
+/**
+ * Per logline cache bucket counters.
+ */
+struct vk_shm_bucket {
+	uint64_t hit;
+	uint64_t miss;
+	uint64_t purge;
+	uint64_t cnt;
+};
+
+
+/**
+ * Latency histogram.
+ * Bucket 'i' counts values (in microseconds) that are less than 2^i,
+ * the last bucket also counts all larger values.
+ */
+#define VK_HIST_BUCKETS  28  /* 2^27us: ~134s */
+
+struct vk_shm_hist {
+	char     name[VK_SHM_NAME_MAX];
+	uint64_t cnt;           /* Number of values */
+	uint64_t sum;           /* Sum of values (microseconds) */
+	uint64_t max;           /* Largest value (microseconds) */
+	uint64_t buckets[VK_HIST_BUCKETS];
+};
+
+
+/**
+ * Add value 'us' (microseconds) to histogram 'h'.
+ */
+static inline void vk_hist_add (struct vk_shm_hist *h, uint64_t us) {
+	int i = us ? 64 - __builtin_clzll(us) : 0;
+
+	if (i >= VK_HIST_BUCKETS)
+		i = VK_HIST_BUCKETS - 1;
+
+	h->buckets[i]++;
+	h->cnt++;
+	h->sum += us;
+	if (us > h->max)
+		h->max = us;
+}
+
+/**
+ * Returns the approximate (upper bound) 'pct' percentile of histogram 'h'
+ * in microseconds.
+ */
+static inline uint64_t vk_hist_percentile (const struct vk_shm_hist *h,
+					   double pct) {
+	uint64_t thres = (uint64_t)((double)h->cnt * pct / 100.0);
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0 ; i < VK_HIST_BUCKETS - 1 ; i++) {
+		sum += h->buckets[i];
+		if (sum > thres)
+			return 1llu << i;
+	}
+
+	return h->max;
+}
+
+
+#define VK_SHM_CNTS(hdr) \
+	((struct vk_shm_cnt *)((char *)(hdr) + (hdr)->cnt_of))
+#define VK_SHM_BUCKETS(hdr) \
+	((struct vk_shm_bucket *)((char *)(hdr) + (hdr)->bucket_of))
+#define VK_SHM_HISTS(hdr) \
+	((struct vk_shm_hist *)((char *)(hdr) + (hdr)->hist_of))
+
+
+/**
+ * Writer side: mark segment as being updated.
+ */
+static inline void vk_shm_write_begin (struct vk_shm_hdr *hdr) {
+	hdr->gen++;
+	__sync_synchronize();
+}
+
+/**
+ * Writer side: mark segment update as done.
+ */
+static inline void vk_shm_write_end (struct vk_shm_hdr *hdr) {
+	__sync_synchronize();
+	hdr->gen++;
+}
+
+/**
+ * Reader side: copy a consistent snapshot of the segment 'hdr' to 'dst'
+ * which must be at least 'hdr->size' bytes.
+ * An update takes a while (all logline cache buckets are copied), so
+ * retries back off for 100us, giving the writer about 100ms.
+ * Returns 0 on success or -1 if no consistent copy could be made.
+ */
+static inline int vk_shm_snapshot (const struct vk_shm_hdr *hdr,
+				   void *dst, size_t size) {
+	int tries = 1000;
+
+	for ( ; tries-- > 0 ; usleep(100)) {
+		uint64_t gen = hdr->gen;
+
+		if (gen & 1)
+			continue;
+
+		__sync_synchronize();
+		__builtin_memcpy(dst, (const void *)hdr,
+				 size < hdr->size ? size : hdr->size);
+		__sync_synchronize();
+
+		if (hdr->gen == gen)
+			return 0;
+	}
+
+	return -1;
+}
+
+
+struct vk_shm_hdr *vk_shm_create (const char *path, int cnt_num,
+				  int bucket_num, int hist_num,
+				  char *errstr, size_t errstr_size);
+void vk_shm_destroy (struct vk_shm_hdr *hdr, const char *path);
+struct vk_shm_hdr *vk_shm_attach (const char *path, size_t *mapsizep,
+				  char *errstr, size_t errstr_size);
+void vk_shm_detach (struct vk_shm_hdr *hdr, size_t mapsize);
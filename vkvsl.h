@@ -0,0 +1,125 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * VSL tag definitions.
+ *
+ * varnishkafka's formatter map, raw passthrough frames and tag matching
+ * all use the Varnish 3 VSL tag ids.
+ *
+ * The default build reads the VSL with the Varnish 3 libvarnishapi.
+ * With VK_VSLQ (make VARNISH_API=4) the VSL is read through the
+ * Varnish 4+ VSLQ API instead (see vkvslq.c) which translates records
+ * to the Varnish 3 tags defined below, so the two APIs' headers never
+ * meet in the same translation unit.
+ */
+
+#ifndef VK_VSLQ
+
+#include <varnish/varnishapi.h>
+
+#else
+
+#include "vkvslq.h"
+
+/* Varnish 3.0 VSL tags, in include/vsl_tags.h order. */
+enum VSL_tag_e {
+	SLT_Debug,
+	SLT_Error,
+	SLT_CLI,
+	SLT_StatSess,
+	SLT_ReqEnd,
+	SLT_SessionOpen,
+	SLT_SessionClose,
+	SLT_BackendOpen,
+	SLT_BackendXID,
+	SLT_BackendReuse,
+	SLT_BackendClose,
+	SLT_HttpGarbage,
+	SLT_Backend,
+	SLT_Length,
+	SLT_FetchError,
+	SLT_RxRequest,
+	SLT_RxResponse,
+	SLT_RxStatus,
+	SLT_RxURL,
+	SLT_RxProtocol,
+	SLT_RxHeader,
+	SLT_TxRequest,
+	SLT_TxResponse,
+	SLT_TxStatus,
+	SLT_TxURL,
+	SLT_TxProtocol,
+	SLT_TxHeader,
+	SLT_ObjRequest,
+	SLT_ObjResponse,
+	SLT_ObjStatus,
+	SLT_ObjURL,
+	SLT_ObjProtocol,
+	SLT_ObjHeader,
+	SLT_LostHeader,
+	SLT_TTL,
+	SLT_Fetch_Body,
+	SLT_VCL_acl,
+	SLT_VCL_call,
+	SLT_VCL_trace,
+	SLT_VCL_return,
+	SLT_VCL_error,
+	SLT_ReqStart,
+	SLT_Hit,
+	SLT_HitPass,
+	SLT_ExpBan,
+	SLT_ExpKill,
+	SLT_WorkThread,
+	SLT_ESI_xmlerror,
+	SLT_Hash,
+	SLT_Backend_health,
+	SLT_VCL_Log,
+	SLT_Gzip,
+	SLT_Reserved = 254,
+	SLT_WRAPMARKER = 255
+};
+
+#define VSL_S_CLIENT   (1 << 0)
+#define VSL_S_BACKEND  (1 << 1)
+
+/* Varnish 3 tag names, indexed by enum VSL_tag_e */
+extern const char *vk_vsl3_tags[256];
+#define VSL_tags vk_vsl3_tags
+
+/* Supported VSL command line arguments */
+#define VSL_ARGS   "bcCi:I:L:n:q:r:T:x:X:"
+#define VSL_USAGE  "[-b] [-c] [-C] [-i tag] [-I [tag:]regex] [-L limit]\n"  \
+	"  [-n dir] [-q query] [-r file] [-T seconds] [-x tag]\n"        \
+	"  [-X [tag:]regex]"
+
+#endif
@@ -0,0 +1,484 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * Varnish 4+ VSLQ ingestion backend, see vkvslq.h.
+ * Only built with VK_VSLQ (make VARNISH_API=4).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include <vapi/vsm.h>
+#include <vapi/vsl.h>
+
+#include "vkvslq.h"
+
+
+/**
+ * Record translation kinds
+ */
+enum {
+	XL_DROP = 0,    /* Not translated */
+	XL_COPY,        /* Verbatim */
+	XL_LOWER,       /* Lower-cased (VCL_call "MISS" -> "miss") */
+	XL_REQSTART,    /* "ip port [listener]" -> "ip port xid" */
+	XL_REQACCT,     /* ReqAcct response body bytes -> Length */
+	XL_TIMESTAMP,   /* Collected for the synthesized ReqEnd */
+};
+
+/**
+ * Varnish 4 tag to Varnish 3 tag translation.
+ */
+static const struct {
+	const char *v4;
+	const char *v3;
+	int         kind;
+} xlate[] = {
+	{ "ReqStart",     "ReqStart",   XL_REQSTART },
+	{ "ReqMethod",    "RxRequest",  XL_COPY },
+	{ "ReqURL",       "RxURL",      XL_COPY },
+	{ "ReqProtocol",  "RxProtocol", XL_COPY },
+	{ "ReqHeader",    "RxHeader",   XL_COPY },
+	{ "RespStatus",   "TxStatus",   XL_COPY },
+	{ "RespProtocol", "TxProtocol", XL_COPY },
+	{ "RespReason",   "TxResponse", XL_COPY },
+	{ "RespHeader",   "TxHeader",   XL_COPY },
+	{ "ReqAcct",      "Length",     XL_REQACCT },
+	{ "VCL_call",     "VCL_call",   XL_LOWER },
+	{ "VCL_return",   "VCL_return", XL_LOWER },
+	{ "VCL_Log",      "VCL_Log",    XL_COPY },
+	{ "Hit",          "Hit",        XL_COPY },
+	{ "HitPass",      "HitPass",    XL_COPY },
+	{ "Hash",         "Hash",       XL_COPY },
+	{ "Debug",        "Debug",      XL_COPY },
+	{ "Error",        "Error",      XL_COPY },
+	{ "Timestamp",    "ReqEnd",     XL_TIMESTAMP },
+};
+
+
+struct vk_vslq {
+	struct VSM_data *vsm;
+	struct VSL_data *vsl;
+	struct VSLQ     *vslq;
+	char            *query;     /* -q */
+	char            *file;      /* -r */
+
+	/* Indexed by Varnish 4 tag */
+	struct {
+		int kind;
+		int tag3;
+	} map[256];
+	int              tag3_reqend;
+
+	/* Current dispatch */
+	vk_vslq_rec_f   *cb;
+	void            *opaque;
+
+	/* Per request buffer for translated record data, data passed to
+	 * the record callback must stay valid until the request's ReqEnd. */
+	char             xbuf[8192];
+	size_t           xof;
+	char             reqend[128];  /* Synthesized ReqEnd */
+
+	uint64_t         overruns;
+	uint64_t         abandoned;
+};
+
+
+/**
+ * Allocate 'len' bytes from the request's translation buffer.
+ * Returns NULL if the buffer is exhausted.
+ */
+static char *xalloc (struct vk_vslq *q, size_t len) {
+	char *p;
+
+	if (q->xof + len > sizeof(q->xbuf))
+		return NULL;
+
+	p = q->xbuf + q->xof;
+	q->xof += len;
+	return p;
+}
+
+
+/**
+ * Returns a pointer to column 'col' (1-based, space separated) of 'ptr',
+ * or NULL if there is no such column.
+ */
+static const char *column (const char *ptr, const char *end, int col) {
+	while (--col > 0) {
+		while (ptr < end && *ptr != ' ')
+			ptr++;
+		while (ptr < end && *ptr == ' ')
+			ptr++;
+	}
+
+	return ptr < end ? ptr : NULL;
+}
+
+
+/**
+ * Translate the data of record 'kind' in place or into the translation
+ * buffer. Returns the translated data, or NULL to drop the record.
+ */
+static const char *translate (struct vk_vslq *q, int kind, unsigned int vxid,
+			      const char *ptr, unsigned int *lenp) {
+	const char *end = ptr + *lenp;
+	const char *t;
+	char *dst;
+	unsigned int i;
+	int r;
+
+	switch (kind)
+	{
+	case XL_COPY:
+		return ptr;
+
+	case XL_LOWER:
+		if (!(dst = xalloc(q, *lenp)))
+			return NULL;
+		for (i = 0 ; i < *lenp ; i++)
+			dst[i] = tolower((int)ptr[i]);
+		return dst;
+
+	case XL_REQSTART:
+		/* Keep "ip port", replace any listener name with the xid */
+		if (!(t = column(ptr, end, 3)))
+			t = end;
+		while (t > ptr && t[-1] == ' ')
+			t--;
+		if (!(dst = xalloc(q, (t - ptr) + 12)))
+			return NULL;
+		r = snprintf(dst, (t - ptr) + 12, "%.*s %u",
+			     (int)(t - ptr), ptr, vxid);
+		*lenp = r;
+		return dst;
+
+	case XL_REQACCT:
+		/* "reqhdr reqbody reqtotal resphdr respbody resptotal" */
+		if (!(t = column(ptr, end, 5)))
+			return NULL;
+		for (i = 0 ; t + i < end && t[i] != ' ' ; i++)
+			;
+		*lenp = i;
+		return t;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Dispatch the records of a single client request, followed by the
+ * synthesized ReqEnd.
+ */
+static int vslq_txn (struct vk_vslq *q, struct VSL_data *vsl,
+		     struct VSL_transaction *t) {
+	double ts_start = 0.0, ts_end = 0.0, ttfb = -1.0;
+	int r;
+
+	q->xof = 0;
+
+	while (VSL_Next(t->c) == 1) {
+		const uint32_t *p = t->c->rec.ptr;
+		unsigned int tag4 = VSL_TAG(p);
+		unsigned int len = VSL_LEN(p);
+		const char *ptr = VSL_CDATA(p);
+		int kind = q->map[tag4].kind;
+
+		if (kind == XL_DROP || !VSL_Match(vsl, t->c))
+			continue;
+
+		/* Varnish 4 records are nul-terminated */
+		if (len > 0 && ptr[len-1] == '\0')
+			len--;
+
+		if (kind == XL_TIMESTAMP) {
+			/* "Label: absolute since-start since-last" */
+			char *e;
+			double abs, since;
+
+			if (!(ptr = memchr(ptr, ':', len)))
+				continue;
+			abs = strtod(ptr+1, &e);
+			since = strtod(e, NULL);
+
+			if (!strncmp(VSL_CDATA(p), "Start:", 6))
+				ts_start = abs;
+			else if (!strncmp(VSL_CDATA(p), "Process:", 8))
+				ttfb = since;
+			else if (!strncmp(VSL_CDATA(p), "Resp:", 5)) {
+				ts_end = abs;
+				if (ttfb < 0.0)
+					ttfb = since;
+			}
+			continue;
+		}
+
+		if (!(ptr = translate(q, kind, t->vxid, ptr, &len)))
+			continue;
+
+		if ((r = q->cb(q->opaque, q->map[tag4].tag3, t->vxid,
+			       VK_VSLQ_S_CLIENT, ptr, len)))
+			return r;
+	}
+
+	/* Varnish 3 ReqEnd: "xid start end accept-delay ttfb deliver" */
+	if (ts_end < ts_start)
+		ts_end = ts_start;
+	if (ttfb < 0.0)
+		ttfb = ts_end - ts_start;
+
+	r = snprintf(q->reqend, sizeof(q->reqend),
+		     "%u %.9f %.9f %.9f %.9f %.9f",
+		     t->vxid, ts_start, ts_end, 0.0, ttfb,
+		     ts_end - ts_start - ttfb);
+
+	return q->cb(q->opaque, q->tag3_reqend, t->vxid,
+		     VK_VSLQ_S_CLIENT, q->reqend, r);
+}
+
+
+/**
+ * VSLQ_Dispatch() callback: called with the transactions of a request
+ * group. Only top level client requests are logged: backend and ESI
+ * sub-requests are skipped, as with Varnish 3's forced -c.
+ */
+static int vslq_group_cb (struct VSL_data *vsl,
+			  struct VSL_transaction * const trans[],
+			  void *priv) {
+	struct vk_vslq *q = priv;
+	struct VSL_transaction *t;
+	int i, r;
+
+	for (i = 0 ; (t = trans[i]) ; i++) {
+		if (t->type != VSL_t_req || t->level > 1)
+			continue;
+
+		if ((r = vslq_txn(q, vsl, t)))
+			return r;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Create a new VSLQ reader, arguments are set with vk_vslq_arg()
+ * before it is opened with vk_vslq_open().
+ */
+struct vk_vslq *vk_vslq_new (void) {
+	struct vk_vslq *q;
+
+	q = calloc(1, sizeof(*q));
+	q->vsm = VSM_New();
+	q->vsl = VSL_New();
+
+	return q;
+}
+
+
+/**
+ * Set VSL argument 'opt'.
+ * Returns 1 on success, 0 if 'opt' is not a VSL argument or -1 on error
+ * (in which case the error has been printed to stderr).
+ */
+int vk_vslq_arg (struct vk_vslq *q, int opt, const char *arg) {
+	int r;
+
+	switch (opt)
+	{
+	case 'n':
+		if ((r = VSM_n_Arg(q->vsm, arg)) <= 0) {
+			fprintf(stderr, "%s\n", VSM_Error(q->vsm));
+			return -1;
+		}
+		return 1;
+
+	case 'q':
+		free(q->query);
+		q->query = strdup(arg);
+		return 1;
+
+	case 'r':
+		free(q->file);
+		q->file = strdup(arg);
+		return 1;
+
+	default:
+		if ((r = VSL_Arg(q->vsl, opt, arg)) == -1)
+			fprintf(stderr, "%s\n", VSL_Error(q->vsl));
+		return r;
+	}
+}
+
+
+/**
+ * Set up the record translation for Varnish 3 tag names 'tags3'
+ * (indexed by Varnish 3 tag id) and open the VSL.
+ *
+ * Returns 0 on success or -1 on error in which case 'errstr' will
+ * contain an error string.
+ */
+int vk_vslq_open (struct vk_vslq *q, const char **tags3,
+		  char *errstr, size_t errstr_size) {
+	struct VSL_cursor *c;
+	unsigned int i;
+	int j;
+
+	for (i = 0 ; i < sizeof(xlate) / sizeof(*xlate) ; i++) {
+		int tag4 = VSL_Name2Tag(xlate[i].v4, -1);
+
+		if (tag4 < 0)
+			continue; /* Not in this Varnish version */
+
+		for (j = 0 ; j < 256 ; j++) {
+			if (tags3[j] && !strcmp(tags3[j], xlate[i].v3))
+				break;
+		}
+
+		if (j == 256) {
+			snprintf(errstr, errstr_size,
+				 "Unknown Varnish 3 tag %s", xlate[i].v3);
+			return -1;
+		}
+
+		q->map[tag4].kind = xlate[i].kind;
+		q->map[tag4].tag3 = j;
+
+		if (xlate[i].kind == XL_TIMESTAMP)
+			q->tag3_reqend = j;
+	}
+
+	if (q->file)
+		c = VSL_CursorFile(q->vsl, q->file, 0);
+	else {
+		if (VSM_Open(q->vsm)) {
+			snprintf(errstr, errstr_size, "%s",
+				 VSM_Error(q->vsm));
+			return -1;
+		}
+		c = VSL_CursorVSM(q->vsl, q->vsm,
+				  VSL_COPT_TAIL|VSL_COPT_BATCH);
+	}
+
+	if (!c) {
+		snprintf(errstr, errstr_size, "%s", VSL_Error(q->vsl));
+		return -1;
+	}
+
+	if (!(q->vslq = VSLQ_New(q->vsl, &c, VSL_g_request, q->query))) {
+		snprintf(errstr, errstr_size, "%s", VSL_Error(q->vsl));
+		VSL_DeleteCursor(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Read and dispatch available records to 'cb'.
+ *
+ * Returns 1 if records were dispatched, 0 if none were available
+ * (after a short wait) and -1 at end of file or if 'cb' returned
+ * non-zero.
+ */
+int vk_vslq_dispatch (struct vk_vslq *q, vk_vslq_rec_f *cb, void *opaque) {
+	struct VSL_cursor *c;
+	int r;
+
+	/* Reattach to a restarted varnishd */
+	if (!q->file && !VSM_IsOpen(q->vsm)) {
+		if (VSM_Open(q->vsm)) {
+			VSM_ResetError(q->vsm);
+			usleep(100000);
+			return 0;
+		}
+
+		c = VSL_CursorVSM(q->vsl, q->vsm,
+				  VSL_COPT_TAIL|VSL_COPT_BATCH);
+		if (!c) {
+			VSL_ResetError(q->vsl);
+			VSM_Close(q->vsm);
+			usleep(100000);
+			return 0;
+		}
+
+		VSLQ_SetCursor(q->vslq, &c);
+	}
+
+	q->cb = cb;
+	q->opaque = opaque;
+
+	r = VSLQ_Dispatch(q->vslq, vslq_group_cb, q);
+	if (r == 1)
+		return 1;
+	else if (r == 0) {
+		usleep(10000);
+		return 0;
+	} else if (r > 0 || r == -1)
+		return -1; /* Callback stopped us, or EOF */
+
+	/* Log abandoned (varnishd restart) or overrun */
+	(void)VSLQ_Flush(q->vslq, vslq_group_cb, q);
+
+	if (r == -2) {
+		q->abandoned++;
+		VSLQ_SetCursor(q->vslq, NULL);
+		VSM_Close(q->vsm);
+	} else
+		q->overruns++;
+
+	return 0;
+}
+
+
+/**
+ * Returns the number of log overruns and abandons seen by 'q'.
+ */
+uint64_t vk_vslq_overruns (const struct vk_vslq *q) {
+	return q->overruns + q->abandoned;
+}
+
+
+void vk_vslq_destroy (struct vk_vslq *q) {
+	if (q->vslq)
+		VSLQ_Delete(&q->vslq);
+	VSL_Delete(q->vsl);
+	VSM_Delete(q->vsm);
+	free(q->query);
+	free(q->file);
+	free(q);
+}
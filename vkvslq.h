@@ -0,0 +1,72 @@
+/*
+ * varnishkafka
+ *
+ * Copyright (c) 2013 Wikimedia Foundation
+ * Copyright (c) 2013 Magnus Edenhill <vk@edenhill.se>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * Varnish 4+ VSLQ ingestion backend (VK_VSLQ builds).
+ *
+ * The VSL is read with request grouping so that varnishd's own
+ * transaction tracking hands over complete client requests.
+ * Each record of a request is translated to its Varnish 3 counterpart
+ * and passed to the record callback, followed by a synthesized ReqEnd
+ * record ("xid start end accept-delay ttfb deliver") that completes
+ * the request, all within a single vk_vslq_dispatch() call.
+ *
+ * This interface only uses plain types so that it can be included
+ * alongside the Varnish 3 compatible tag definitions in vkvsl.h.
+ */
+
+#include <inttypes.h>
+#include <stddef.h>
+
+struct vk_vslq;
+
+/* Record spec passed to the record callback, same as VSL_S_CLIENT */
+#define VK_VSLQ_S_CLIENT  0x1
+
+/**
+ * Record callback: 'tag' is a Varnish 3 tag id, 'id' the request's vxid
+ * and 'spec' VK_VSLQ_S_CLIENT. 'ptr' is valid until the callback for the
+ * request's ReqEnd has returned.
+ * A non-zero return value stops dispatching and is returned by
+ * vk_vslq_dispatch().
+ */
+typedef int (vk_vslq_rec_f) (void *opaque, int tag, unsigned int id,
+			     unsigned int spec, const char *ptr,
+			     unsigned int len);
+
+struct vk_vslq *vk_vslq_new (void);
+int vk_vslq_arg (struct vk_vslq *q, int opt, const char *arg);
+int vk_vslq_open (struct vk_vslq *q, const char **tags3,
+		  char *errstr, size_t errstr_size);
+int vk_vslq_dispatch (struct vk_vslq *q, vk_vslq_rec_f *cb, void *opaque);
+uint64_t vk_vslq_overruns (const struct vk_vslq *q);
+void vk_vslq_destroy (struct vk_vslq *q);